@@ -7,6 +7,8 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
+#include <limits.h>
 #include <pure/runtime.h>
 
 #define STRSIZE 128
@@ -19,66 +21,147 @@
 #define error_handler(msg) \
   return pure_app(pure_symbol(pure_sym("csv_error")), pure_cstring_dup(msg))
 
-/* Return a CSV record as a Pure string.
+/* Dialect parameters, as extracted from the dialect list (see csv.pure). */
+typedef struct {
+  char *delimiter, *escape, *quote, *lineterm;
+  int n_delimiter, n_escape, n_quote, n_lineterm;
+  int quoting_style, skipspace_f, esc_eq_quote;
+} dialect_t;
+
+/* Extract the dialect parameters from a dialect list.
    Input:
-     fp:    File pointer to read from
-     quote: Pure string representing CSV quotes
+     dialect: Pure dialect list
+     cvt:     1 -> convert strings to the system encoding, 0 -> leave as is
 
    Output:
-     pure_string representing a CSV record. The string may have embedded '\n's.
-       Does not check for badly formated records.
+     1 if the dialect is valid, 0 otherwise. In the former case, the
+     parameters must be freed with free_dialect.
+*/
+static int get_dialect(pure_expr *dialect, dialect_t *d, int cvt) {
+  size_t n_elems;
+  pure_expr **elems;
+  int ok;
 
-   Exceptions:
-     csv_error msg is invoked f there is a system memory allocation error,
-     beyond end of file, or a file error is encountered.
+  if (!pure_is_listv(dialect, &n_elems, &elems))
+    return 0;
+  d->delimiter = d->escape = d->quote = d->lineterm = NULL;
+  if (cvt)
+    ok = n_elems == 6
+      && pure_is_cstring_dup(elems[0], &d->delimiter)
+      && pure_is_cstring_dup(elems[1], &d->escape)
+      && pure_is_cstring_dup(elems[2], &d->quote)
+      && pure_is_int(elems[3], &d->quoting_style)
+      && pure_is_cstring_dup(elems[4], &d->lineterm)
+      && pure_is_int(elems[5], &d->skipspace_f);
+  else
+    ok = n_elems == 6
+      && pure_is_string_dup(elems[0], &d->delimiter)
+      && pure_is_string_dup(elems[1], &d->escape)
+      && pure_is_string_dup(elems[2], &d->quote)
+      && pure_is_int(elems[3], &d->quoting_style)
+      && pure_is_string_dup(elems[4], &d->lineterm)
+      && pure_is_int(elems[5], &d->skipspace_f);
+  free(elems);
+  if (!ok) {
+    free(d->delimiter);
+    free(d->escape);
+    free(d->quote);
+    free(d->lineterm);
+    return 0;
+  }
+  d->n_delimiter = strlen(d->delimiter);
+  d->n_escape = strlen(d->escape);
+  d->n_quote = strlen(d->quote);
+  d->n_lineterm = strlen(d->lineterm);
+  d->esc_eq_quote = !strcmp(d->escape, d->quote);
+  return 1;
+}
+
+static void free_dialect(dialect_t *d) {
+  free(d->delimiter);
+  free(d->escape);
+  free(d->quote);
+  free(d->lineterm);
+}
+
+/* Read a CSV record from a file.
+   Input:
+     fp:    File pointer to read from
+     quote: CSV quote string
+
+   Output:
+     malloc'ed string holding the record (in the system encoding), or NULL
+     at the end of the file or if an error occurred. In the latter case *err
+     is set to 1, otherwise to 0. The string may have embedded '\n's. Does
+     not check for badly formated records.
 */
-pure_expr *c_csv_fgets(FILE *fp, char *quote) {
+static char *read_record(FILE *fp, const char *quote, int *err) {
   char *bf, *tb, *s;
   int quote_count = 0, n_quote;
-  long sz = BUFSIZE, n = 0;
-  pure_expr *ret;
-
-  if (!(s = bf = (char *)malloc(sz))) {
-    error_handler("malloc error");
-  }
+  size_t sz = BUFSIZE, n = 0, m = 0;
 
+  *err = 1;
+  if (!(bf = (char *)malloc(sz)))
+    return NULL;
   n_quote = strlen(quote);
   while (1) {
-    s = bf + n;
-    if (n > sz) {
+    if (sz - n < BUFSIZE) {
       if (!(tb = realloc(bf, sz <<= 1))) {
 	free(bf);
-	error_handler("realloc error");
+	return NULL;
       }
-      s = (bf = tb) + n;
-    }
-    tb = fgets(s, BUFSIZE, fp);
-    if (ferror(fp)) {
-      free(bf);
-      return 0;
+      bf = tb;
     }
-    if (tb == NULL) {
-      if (n == 0)
+    s = bf + n;
+    if (fgets(s, BUFSIZE, fp) == NULL || ferror(fp)) {
+      if (n == 0 || ferror(fp)) {
+	*err = ferror(fp) != 0;
+	free(bf);
 	return NULL;
-      else
-	return pure_cstring(bf);
+      } else {
+	*err = 0;
+	return bf;
+      }
     }
     n += strlen(s);
     if (*(bf+n-1) != '\n')
       continue;
+    /* count the quotes in the line(s) read since the last check */
+    s = bf + m;
     while (*s) {
-      if (!strncmp(s, quote, n_quote)) {
+      if (n_quote && !strncmp(s, quote, n_quote)) {
 	++quote_count;
 	s += n_quote;
-      } else 
+      } else
 	++s;
     }
-    if (!(quote_count & 1))
-      /* let pure handle freeing bf */
-      return pure_cstring(bf);
+    m = n;
+    if (!(quote_count & 1)) {
+      *err = 0;
+      return bf;
+    }
   }
 }
 
+/* Return a CSV record as a Pure string.
+   Input:
+     fp:    File pointer to read from
+     quote: Pure string representing CSV quotes
+
+   Output:
+     pure_string representing a CSV record. The string may have embedded '\n's.
+       Does not check for badly formated records.
+
+   Exceptions:
+     Fails (returns NULL) at the end of the file or if a file error is
+     encountered.
+*/
+pure_expr *c_csv_fgets(FILE *fp, char *quote) {
+  int err;
+  char *bf = read_record(fp, quote, &err);
+  return bf ? pure_cstring(bf) : NULL;
+}
+
 /* Convert a string to a number.
    Input:
      s: string to be converted.
@@ -104,99 +187,70 @@ pure_expr *convert_string(char *s, int cvt_flag) {
   return pure_cstring_dup(s);
 }
 
+/* Callback invoked by parse_record for each field of a record. fld is the
+   (NUL-terminated) field value, cvt is 0 for quoted and empty fields, the
+   quoting style otherwise. Returns 0 if the field couldn't be stored;
+   errmsg may then be set to indicate the reason (it is empty otherwise). */
+typedef int (*field_fn)(void *data, char *fld, int cvt, char *errmsg);
+
 #define putfld(len) \
   if (n_fld + len >= fld_sz) { \
     if (!(tfld = (char *)realloc(fld, fld_sz <<= 1))) \
       goto done; \
     fld = tfld; \
   } \
-  fldp = fld + n_fld; \
-  strncpy(fldp, s, len); \
-  n_fld += len \
-
+  strncpy(fld + n_fld, s, len); \
+  n_fld += len
 
 #define putrec(qt) \
-  *(fldp + 1) = 0; \
-  if (n_rec >= rec_sz - 1) { \
-    if (!(trec = (pure_expr **)realloc(rec, (rec_sz+=64)*sizeof(pure_expr)))) \
-      goto done; \
-    rec = trec; \
+  fld[n_fld] = 0; \
+  if (!put(data, fld, qt, errmsg)) { \
+    st = *errmsg ? 20 : 0; \
+    goto done; \
   } \
-  rec[n_rec++] = convert_string(fld, qt)
+  ++n_rec
 
-#define free_params				\
-  free(delimiter);				\
-  free(escape);					\
-  free(quote);					\
-  free(lineterm);				\
-  free(elems)
-
-/* Convert a CSV string to a list of fields
-   input: 
-     dialect: (Conversion flag, field delimeter char, string delimeter char)
-     s: CSV formatted string
-
-   Output: record of fields
+/* Parse a CSV record and pass its fields to the given callback.
+   Input:
+     s:       CSV formatted string
+     d:       dialect
+     put:     field callback
+     data:    data passed to the callback
+     errmsg:  buffer for error messages (at least 80 chars)
 
-   Exceptions:
-     Invokes 'csv_error MSG' if the string is badly formatted, or memory error
+   Output:
+     10 on success, 20 if the record is badly formatted (errmsg holds a
+     description of the error), 0 if memory allocation fails.
 
    Notes:
-     \r char is treated as white space except inside "" 
+     \r char is treated as white space except inside ""
 */
-pure_expr *c_csvstr_to_list(char *s, pure_expr *dialect) {
-  size_t n_elems;
-  pure_expr **elems, **rec, **trec;
-  int n, st = 0, fld_sz = 256, n_fld, rec_sz = 64, n_ws = 0, n_rec = 0,
-    n_delimiter, n_escape, n_quote, n_lineterm, skipspace_f, esc_eq_quote,
-    quoting_style;
-  char *fld, *tfld, *fldp, errmsg[80], *delimiter, *escape, *quote, *lineterm;
-
-  if (!(pure_is_listv(dialect, &n_elems, &elems)
-	&& n_elems == 6
-	&& pure_is_cstring_dup(elems[0], &delimiter)
-	&& pure_is_cstring_dup(elems[1], &escape)
-	&& pure_is_cstring_dup(elems[2], &quote)
-	&& pure_is_int(elems[3], &quoting_style)
-	&& pure_is_cstring_dup(elems[4], &lineterm)
-	&& pure_is_int(elems[5], &skipspace_f)))
-    return 0;
-  
-  if (!(fld = (char *)malloc(fld_sz))) {
-    free_params;
-    error_handler("malloc error");
-  }
+static int parse_record(const char *s, dialect_t *d, field_fn put, void *data,
+			char *errmsg) {
+  int st = 0, fld_sz = 256, n_fld = 0, n_ws = 0, n_rec = 0;
+  char *fld, *tfld;
 
-  if (!(rec = (pure_expr **)malloc(rec_sz*sizeof(pure_expr)))) {
-    free(fld);  
-    free_params;
-    error_handler("malloc error");
-  }
-  n_delimiter = strlen(delimiter);
-  n_escape = strlen(escape);
-  n_quote = strlen(quote);
-  esc_eq_quote = !strcmp(escape, quote);
-  n_lineterm = strlen(lineterm);
-  fldp = fld;
+  *errmsg = 0;
+  if (!(fld = (char *)malloc(fld_sz)))
+    return 0;
   while (st < 10) {
     switch (st) {
     case 0:
-      fldp = fld;
-      *fldp = 0;
       n_fld = 0;
-      if (!strncmp(s, delimiter, n_delimiter)) {
+      n_ws = 0;
+      if (!strncmp(s, d->delimiter, d->n_delimiter)) {
 	putrec(QUOTE_ALL);
-	s += n_delimiter;
-      } else if (!strncmp(s, quote, n_quote)) {
-	s += n_quote;
+	s += d->n_delimiter;
+      } else if (!strncmp(s, d->quote, d->n_quote)) {
+	s += d->n_quote;
 	st = 1;
-      } else if (!*s || *s == EOF || !strncmp(s, lineterm, n_lineterm)) {
+      } else if (!*s || !strncmp(s, d->lineterm, d->n_lineterm)) {
 	putrec(QUOTE_ALL);
 	st = 10;
-      } else if (isspace(*s) && skipspace_f) {
+      } else if (isspace(*s) && d->skipspace_f) {
 	++s;
-      } else if (!strncmp(s, escape, n_escape)) {
-	sprintf(errmsg, "column %d: unexpected escape.", n_fld+1);
+      } else if (!strncmp(s, d->escape, d->n_escape)) {
+	sprintf(errmsg, "column %d: unexpected escape.", n_rec+1);
 	st = 20;
       } else {
 	putfld(1);
@@ -205,75 +259,73 @@ pure_expr *c_csvstr_to_list(char *s, pure_expr *dialect) {
       }
       break;
     case 1:
-      if (!strncmp(s, quote, n_quote)) {
-	s += n_quote;
+      if (!strncmp(s, d->quote, d->n_quote)) {
+	s += d->n_quote;
 	st = 2;
-      } else if (!*s || *s == EOF) {
-	sprintf(errmsg, "column %d: expected {%s}.", 
-		n_fld+1, quote);
+      } else if (!*s) {
+	sprintf(errmsg, "column %d: expected {%.40s}.", n_rec+1, d->quote);
 	st = 20;
-      } else if (!strncmp(s, escape, n_escape)) {
-	s += n_escape;
-	putfld(n_escape);
-	++s;
+      } else if (!strncmp(s, d->escape, d->n_escape)) {
+	s += d->n_escape;
+	if (*s) {
+	  putfld(1);
+	  ++s;
+	}
       } else {
 	putfld(1);
 	++s;
       }
       break;
     case 2:
-      if (!strncmp(s, quote, n_quote) && esc_eq_quote) {
-	putfld(n_quote);
-	s += n_quote;
+      if (!strncmp(s, d->quote, d->n_quote) && d->esc_eq_quote) {
+	putfld(d->n_quote);
+	s += d->n_quote;
 	st = 1;
-      } else if (!strncmp(s, delimiter, n_delimiter)) {
+      } else if (!strncmp(s, d->delimiter, d->n_delimiter)) {
 	putrec(QUOTE_ALL);
-	s += n_delimiter;
+	s += d->n_delimiter;
 	st = 0;
-      } else if (!*s || *s == EOF || !strncmp(s, lineterm, n_lineterm)) {
+      } else if (!*s || !strncmp(s, d->lineterm, d->n_lineterm)) {
 	putrec(QUOTE_ALL);
 	st = 10;
       } else if (isspace(*s)) {
 	++s;
 	st = 3;
       } else {
-	sprintf(errmsg, "column %d: expected {%s}.", 
-		n_fld+1, delimiter);
+	sprintf(errmsg, "column %d: expected {%.40s}.", n_rec+1, d->delimiter);
 	st = 20;
       }
       break;
     case 3:
-      if (!strncmp(s, delimiter, n_delimiter)) {
+      if (!strncmp(s, d->delimiter, d->n_delimiter)) {
 	putrec(QUOTE_ALL);
-	s += n_delimiter;
+	s += d->n_delimiter;
 	st = 0;
-      } else if (!*s || *s == '\n' || *s == EOF) {
+      } else if (!*s || *s == '\n') {
 	putrec(QUOTE_ALL);
 	st = 10;
       } else if (isspace(*s)) {
 	++s;
       } else {
-	sprintf(errmsg, "column %d: expected {%s}.",
-		n_fld+1, delimiter);
+	sprintf(errmsg, "column %d: expected {%.40s}.", n_rec+1, d->delimiter);
 	st = 20;
       }
       break;
     case 4:
-      if (!strncmp(s, quote, n_quote) || !strncmp(s, escape, n_escape)) {
-	sprintf(errmsg, "column %d: expected {%s}.", 
-		n_fld+1, delimiter);
+      if (!strncmp(s, d->quote, d->n_quote)
+	  || !strncmp(s, d->escape, d->n_escape)) {
+	sprintf(errmsg, "column %d: expected {%.40s}.", n_rec+1, d->delimiter);
 	st = 20;
-      } else if (!strncmp(s, delimiter, n_delimiter)) {
-	fldp -= n_ws;
+      } else if (!strncmp(s, d->delimiter, d->n_delimiter)) {
 	n_fld -= n_ws;
-	putrec(quoting_style);
-	s += n_delimiter;
+	putrec(d->quoting_style);
+	s += d->n_delimiter;
 	st = 0;
-      } else if (!*s || *s == EOF || !strncmp(s, lineterm, n_lineterm)) {
-	putrec(quoting_style);
+      } else if (!*s || !strncmp(s, d->lineterm, d->n_lineterm)) {
+	putrec(d->quoting_style);
 	st = 10;
       } else if (isspace(*s)) {
-	n_ws = n_ws ? n_ws+1 : 1;
+	++n_ws;
 	putfld(1);
 	++s;
       } else {
@@ -286,24 +338,268 @@ pure_expr *c_csvstr_to_list(char *s, pure_expr *dialect) {
   }
  done:
   free(fld);
-  free_params;
+  return st;
+}
+
+/* Growable vector of field values, used to collect the fields of a record
+   in c_csvstr_to_list. */
+typedef struct {
+  int n, sz;
+  pure_expr **xs;
+} fields_t;
+
+static int put_field(void *data, char *fld, int cvt, char *errmsg) {
+  fields_t *r = (fields_t*)data;
+  pure_expr **txs;
+  if (r->n >= r->sz) {
+    if (!(txs = (pure_expr **)realloc(r->xs, (r->sz+=64)*sizeof(pure_expr*))))
+      return 0;
+    r->xs = txs;
+  }
+  r->xs[r->n++] = pure_new(convert_string(fld, cvt));
+  return 1;
+}
+
+static pure_expr *parse_list(const char *s, dialect_t *d) {
+  fields_t r = { 0, 0, NULL };
+  char errmsg[80];
+  pure_expr *ret;
+  int n, st = parse_record(s, d, put_field, &r, errmsg);
+
   if (st == 10)
-    return pure_listv(n_rec, realloc(rec, sizeof(pure_expr)*n_rec));
-  else {
-    for (n = 0; n < n_rec; ++n)
-      pure_free(rec[n]);
-    free(rec);
-    if (st==20)
-      error_handler(errmsg);
+    ret = pure_listv(r.n, r.xs);
+  for (n = 0; n < r.n; ++n)
+    if (st == 10)
+      pure_unref(r.xs[n]);
+    else
+      pure_free(r.xs[n]);
+  free(r.xs);
+  if (st == 10)
+    return ret;
+  else if (st == 20)
+    error_handler(errmsg);
+  else
     error_handler("malloc error");
+}
 
+/* Convert a CSV string to a list of fields
+   input:
+     dialect: (Conversion flag, field delimeter char, string delimeter char)
+     s: CSV formatted string
+
+   Output: record of fields
+
+   Exceptions:
+     Invokes 'csv_error MSG' if the string is badly formatted, or memory error
+
+   Notes:
+     \r char is treated as white space except inside ""
+*/
+pure_expr *c_csvstr_to_list(char *s, pure_expr *dialect) {
+  dialect_t d;
+  pure_expr *ret;
+
+  if (!get_dialect(dialect, &d, 1))
+    return 0;
+  ret = parse_list(s, &d);
+  free_dialect(&d);
+  return ret;
+}
+
+/* Read the next CSV record from a file and convert it to a list of fields.
+   This is the same as c_csvstr_to_list(c_csv_fgets(fp, quote), dialect),
+   but avoids the conversion of the record to a Pure string.
+
+   Output: record of fields, [] at the end of the file. Fails (returns
+     NULL) if the file pointer or the dialect is invalid.
+
+   Exceptions:
+     Invokes 'csv_error MSG' if the record is badly formatted, or read or
+     memory error
+*/
+pure_expr *c_csv_fget_rec(FILE *fp, pure_expr *dialect) {
+  dialect_t d;
+  char *s;
+  int err;
+  pure_expr *ret = NULL;
+
+  if (!fp || !get_dialect(dialect, &d, 1))
+    return 0;
+  if ((s = read_record(fp, d.quote, &err))) {
+    ret = parse_list(s, &d);
+    free(s);
   }
+  free_dialect(&d);
+  if (ret)
+    return ret;
+  else if (err)
+    error_handler("read error");
+  else
+    return pure_listl(0);
+}
+
+/* Numeric data, used to collect the fields of all records in
+   c_csv_fget_matrix. */
+typedef struct {
+  int type;			/* 1 = double, 3 = int (cf. matrix_type) */
+  size_t n, sz;
+  void *data;
+} numbers_t;
+
+static int put_number(void *data, char *fld, int cvt, char *errmsg) {
+  numbers_t *r = (numbers_t*)data;
+  size_t elsz = r->type == 1 ? sizeof(double) : sizeof(int);
+  void *tdata;
+  char *p;
+  long i;
+  double d;
+
+  if (r->n >= r->sz) {
+    if (!(tdata = realloc(r->data, (r->sz = r->sz ? r->sz<<1 : 1024)*elsz)))
+      return 0;
+    r->data = tdata;
+  }
+  if (r->type == 1) {
+    d = strtod(fld, &p);
+  } else {
+    i = strtol(fld, &p, 10);
+    if (i < INT_MIN || i > INT_MAX)
+      p = fld;
+  }
+  while (p > fld && isspace(*p)) ++p;
+  if (p == fld || *p) {
+    sprintf(errmsg, "invalid number {%.40s}.", fld);
+    return 0;
+  }
+  if (r->type == 1)
+    ((double*)r->data)[r->n++] = d;
+  else
+    ((int*)r->data)[r->n++] = i;
+  return 1;
+}
+
+/* Read the remaining records of a file into a numeric matrix.
+   Input:
+     fp:      File pointer to read from
+     dialect: CSV dialect
+     type:    1 -> double matrix, 3 -> int matrix
+
+   Output:
+     Double or int matrix with one row per record. Empty lines are skipped.
+     The field values are stored directly in the matrix, without creating
+     intermediate Pure values.
+
+   Exceptions:
+     Invokes 'csv_error MSG' if a record is badly formatted, if a field is not
+     a valid number, if the records differ in length, or read or memory
+     error. Fails (returns NULL) if the file pointer, the dialect or the type
+     is invalid.
+*/
+pure_expr *c_csv_fget_matrix(FILE *fp, pure_expr *dialect, int type) {
+  dialect_t d;
+  numbers_t r = { type, 0, 0, NULL };
+  size_t rows = 0, cols = 0, n;
+  char *s, msg[80], errmsg[120];
+  int st = 10, err = 0;
+  pure_expr *ret;
+
+  if (!fp || (type != 1 && type != 3) || !get_dialect(dialect, &d, 1))
+    return 0;
+  while (st == 10 && (s = read_record(fp, d.quote, &err))) {
+    if (*s && strcmp(s, "\n") && strcmp(s, d.lineterm)) {
+      n = r.n;
+      st = parse_record(s, &d, put_number, &r, msg);
+      if (st == 10) {
+	if (rows == 0)
+	  cols = r.n - n;
+	else if (r.n - n != cols) {
+	  sprintf(msg, "expected %d fields.", (int)cols);
+	  st = 20;
+	}
+      }
+      if (st == 10)
+	++rows;
+      if (st == 20)
+	sprintf(errmsg, "record %d: %s", (int)rows+1, msg);
+    }
+    free(s);
+  }
+  free_dialect(&d);
+  if (st == 10 && err) {
+    strcpy(errmsg, "read error");
+    st = 20;
+  }
+  if (st == 10)
+    ret = type == 1 ? matrix_from_double_array(rows, cols, r.data)
+      : matrix_from_int_array(rows, cols, r.data);
+  free(r.data);
+  if (st == 10 && ret)
+    return ret;
+  else if (st == 20)
+    error_handler(errmsg);
+  else
+    error_handler("malloc error");
+}
+
+/* Write a numeric matrix to a file, one record per row.
+   Input:
+     fp:      File pointer to write to
+     x:       double or int matrix
+     dialect: CSV dialect
+
+   Output: number of records written, -1 on error.
+
+   Notes:
+     The values are written directly from the matrix data. Output goes through
+     the buffered stdio routines.
+*/
+int c_csv_fput_matrix(FILE *fp, pure_expr *x, pure_expr *dialect) {
+  dialect_t d;
+  int type = matrix_type(x), i, j, n, m, ok, ret;
+  size_t k;
+  pure_expr *dim, **elems;
+  void *data;
+  const char *q;
+
+  if ((type != 1 && type != 3) || !get_dialect(dialect, &d, 0))
+    return -1;
+  dim = pure_new(matrix_dim(x));
+  ok = pure_is_tuplev(dim, &k, &elems) && k == 2
+    && pure_is_int(elems[0], &n) && pure_is_int(elems[1], &m);
+  free(elems);
+  pure_free(dim);
+  if (!ok) {
+    free_dialect(&d);
+    return -1;
+  }
+  data = type == 1 ? matrix_to_double_array(NULL, x)
+    : matrix_to_int_array(NULL, x);
+  if (!data) {
+    free_dialect(&d);
+    return -1;
+  }
+  q = d.quoting_style == QUOTE_ALL ? d.quote : "";
+  for (i = 0, k = 0; i < n; i++) {
+    for (j = 0; j < m; j++, k++) {
+      if (j > 0) fputs(d.delimiter, fp);
+      if (type == 1)
+	fprintf(fp, "%s%.16g%s", q, ((double*)data)[k], q);
+      else
+	fprintf(fp, "%s%d%s", q, ((int*)data)[k], q);
+    }
+    fputs(d.lineterm, fp);
+  }
+  ret = ferror(fp) ? -1 : n;
+  free(data);
+  free_dialect(&d);
+  return ret;
 }
 
 #define resize_str \
-  if (len > sz) { \
+  while (len >= sz) { \
     if (!(ts = (char *)realloc(s, sz <<= 1))) { \
       free(s); \
+      free_params; \
       error_handler("realloc error"); \
     } \
     s = ts; \
@@ -317,99 +613,91 @@ pure_expr *c_csvstr_to_list(char *s, pure_expr *dialect) {
   resize_str;					\
   strncpy(t, tb, len - mrk)
 
-/* Convert list to a CSV formated string 
+/* Convert list to a CSV formated string
    Input:
      dialect: (Conversion flag, field delimeter char, string delimeter char)
      list: record to be converted
-   
+
    Output: CSV formatted string
-   
+
    Exceptions:
      Invokes csv_error if no more memory is available or if field cannot be
      converted.
 
    Notes:
-     \r char is treated as white space except inside "" 
+     \r char is treated as white space except inside ""
 */
 pure_expr *c_list_to_csvstr(pure_expr *list, pure_expr *dialect) {
   size_t n_elems;
-  int i, n, k, sz = 256, mrk, quote_cnt, delim_cnt, lineterm_cnt, len = 0, 
-    skipspace_f, n_escape, n_quote, n_delimiter, n_lineterm, quoting_style,
+  int i, k, sz = 256, mrk, quote_cnt, delim_cnt, lineterm_cnt, len = 0,
     ival;
-  char *s, *ts, *p, *sval, tb[48], errmsg[80], *escape, *quote, *delimiter,
-    *lineterm;
+  char *s, *ts, *p, *sval, tb[48], errmsg[80];
   double dval;
-  pure_expr **elems, **xs;
+  pure_expr **xs;
+  dialect_t d;
   register char *t;
-  
-  if (!(pure_is_listv(dialect, &n_elems, &elems)
-	&& n_elems == 6
-	&& pure_is_string_dup(elems[0], &delimiter)
-	&& pure_is_string_dup(elems[1], &escape)
-	&& pure_is_string_dup(elems[2], &quote)
-	&& pure_is_int(elems[3], &quoting_style)
-	&& pure_is_string_dup(elems[4], &lineterm)
-	&& pure_is_int(elems[5], &skipspace_f)
-	&& pure_is_listv(list, &n_elems, &xs))) {
+
+  if (!get_dialect(dialect, &d, 0))
+    return 0;
+  if (!pure_is_listv(list, &n_elems, &xs)) {
+    free_dialect(&d);
     return 0;
   }
-  
+
+#define free_params free_dialect(&d); free(xs)
+
   if (!(s = (char *)malloc(sz))) {
     free_params;
     error_handler("malloc error");
   }
-  
-  n_escape = strlen(escape);
-  n_quote = strlen(quote);
-  n_delimiter = strlen(delimiter);
-  n_lineterm = strlen(lineterm);
+
   for (i = 0; i < n_elems; ++i) {
     if (pure_is_int(xs[i], &ival)) {
-      if (!quoting_style)
-        sprintf(tb, "%s%d%s%s", quote, ival, quote, delimiter);
+      if (!d.quoting_style)
+        sprintf(tb, "%.8s%d%.8s%.8s", d.quote, ival, d.quote, d.delimiter);
       else
-        sprintf(tb, "%d%s", ival, delimiter);
+        sprintf(tb, "%d%.8s", ival, d.delimiter);
       insert;
     } else if (pure_is_double(xs[i], &dval)) {
-      if (!quoting_style)
-        sprintf(tb, "%s%.16g%s%s", quote, dval, quote, delimiter);
+      if (!d.quoting_style)
+        sprintf(tb, "%.8s%.16g%.8s%.8s", d.quote, dval, d.quote, d.delimiter);
       else
-        sprintf(tb, "%.16g%s", dval, delimiter);
+        sprintf(tb, "%.16g%.8s", dval, d.delimiter);
       insert;
     } else if (pure_is_cstring_dup(xs[i], &sval)) {
       quote_cnt = 0;
       delim_cnt = 0;
       lineterm_cnt = 0;
       p = sval;
-      if (skipspace_f && quoting_style == QUOTE_EMBEDDED)
+      if (d.skipspace_f && d.quoting_style == QUOTE_EMBEDDED)
         while (isspace(*p)
-               && strncmp(p, quote, n_delimiter)
-               && strncmp(p, delimiter, n_delimiter)
-               && strncmp(p, lineterm, n_lineterm))
+               && strncmp(p, d.quote, d.n_delimiter)
+               && strncmp(p, d.delimiter, d.n_delimiter)
+               && strncmp(p, d.lineterm, d.n_lineterm))
           ++p;
       k = p - sval;
       mrk = len;
       while (*p) {
-        if (!strncmp(p, quote, n_quote)) {
+        if (!strncmp(p, d.quote, d.n_quote)) {
           ++quote_cnt;
-          p += n_quote;
-          len += n_escape + n_quote;
-        } else if (!strncmp(p, delimiter, n_delimiter)) {
+          p += d.n_quote;
+          len += d.n_escape + d.n_quote;
+        } else if (!strncmp(p, d.delimiter, d.n_delimiter)) {
           ++delim_cnt;
-          p += n_delimiter;
-          len += n_delimiter;
-        } else if (!strncmp(p, lineterm, n_lineterm)) {
+          p += d.n_delimiter;
+          len += d.n_delimiter;
+        } else if (!strncmp(p, d.lineterm, d.n_lineterm)) {
           ++lineterm_cnt;
-          p += n_lineterm;
-          len += n_lineterm;
+          p += d.n_lineterm;
+          len += d.n_lineterm;
         } else {
           ++len;
           ++p;
         }
       }
-      len += n_delimiter;
+      len += d.n_delimiter;
       p = sval + k;
-      if (quoting_style == QUOTE_EMBEDDED
+      if (d.quoting_style == QUOTE_EMBEDDED
 	  && !(quote_cnt+delim_cnt+lineterm_cnt)) {
         resize_str;
         k = len - mrk - 1;
@@ -417,36 +705,38 @@ pure_expr *c_list_to_csvstr(pure_expr *list, pure_expr *dialect) {
         t += k;
       } else {
         /* Add space for surrounding quotes */
-        len += n_quote << 1;
+        len += d.n_quote << 1;
         resize_str;
-        strncpy(t, quote, n_quote);
-        t += n_quote;
+        strncpy(t, d.quote, d.n_quote);
+        t += d.n_quote;
         while (*p) {
-          if (!strncmp(p, quote, n_quote)) {
-            strncpy(t, escape, n_escape);
-            t += n_escape;
-            strncpy(t, quote, n_quote);
-            t += n_quote;
-            p += n_quote;
+          if (!strncmp(p, d.quote, d.n_quote)) {
+            strncpy(t, d.escape, d.n_escape);
+            t += d.n_escape;
+            strncpy(t, d.quote, d.n_quote);
+            t += d.n_quote;
+            p += d.n_quote;
           } else
             *t++ = *p++;
         }
-        strncpy(t, quote, n_quote);
-        t += n_quote;
+        strncpy(t, d.quote, d.n_quote);
+        t += d.n_quote;
       }
-      strncpy(t, delimiter, n_delimiter);
-      t += n_delimiter;
+      strncpy(t, d.delimiter, d.n_delimiter);
+      t += d.n_delimiter;
+      free(sval);
     } else {
-      sprintf(errmsg, "field %d: invalid conversion type.", 
+      sprintf(errmsg, "field %d: invalid conversion type.",
 	      i+1);
+      free(s);
       free_params;
       error_handler(errmsg);
     }
   }
-  mrk = (len -= n_delimiter); /* write over last delimiter */
-  len += n_lineterm;
+  mrk = (len -= d.n_delimiter); /* write over last delimiter */
+  len += d.n_lineterm;
   resize_str;
-  strcpy(t, lineterm);
+  strcpy(t, d.lineterm);
   free_params;
   return pure_cstring((char *)realloc(s, len+1));
 }
@@ -128,11 +128,18 @@ struct EXPR {
     CASE	= -10,	// case expression
     WHEN	= -11,	// when expression
     WITH	= -12,	// with expression
+    // sparse matrix types (runtime only, see runtime.h):
+    SDMATRIX	= -13,	// sparse double matrix
+    SIMATRIX	= -14,	// sparse integer matrix
     // GSL matrix types:
     MATRIX	= -32,  // generic GSL matrix, symbolic matrices
     DMATRIX	= -31,	// double matrix
     CMATRIX	= -30,	// complex matrix
     IMATRIX	= -29,	// integer matrix
+    FMATRIX	= -28,	// single precision (float) matrix
+    LMATRIX	= -27,	// 64 bit integer matrix
+    HMATRIX	= -26,	// 16 bit integer (short) matrix
+    BMATRIX	= -25,	// 8 bit unsigned integer (byte) matrix
     /* Other values in the range -17..-32 are reserved for later use in the
        runtime expression data structure. Note that all GSL-related tags,
        taken as an unsigned binary quantity, are of the form 0xffffffe0+t,
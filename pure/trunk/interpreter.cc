@@ -945,6 +945,55 @@ pure_expr *interpreter::const_defn(expr pat, expr& x)
   return res;
 }
 
+#ifdef HAVE_GSL
+static inline expr compact_elem(double x)
+{
+  return expr(EXPR::DBL, x);
+}
+
+static inline expr compact_elem(int x)
+{
+  return expr(EXPR::INT, x);
+}
+
+static inline expr compact_elem(int64_t x)
+{
+  if (x == (int64_t)(int32_t)x)
+    return expr(EXPR::INT, (int32_t)x);
+  else {
+    char tmp[32];
+    sprintf(tmp, "%lld", (long long)x);
+    mpz_t z;
+    mpz_init_set_str(z, tmp, 10);
+    return expr(EXPR::BIGINT, z);
+  }
+}
+
+/* Convert one of the compact (float, int64, short, byte) matrix types to a
+   call of the corresponding conversion function f applied to a matrix of its
+   elements, or to the dimensions if the matrix is empty. This mirrors the way
+   these matrices are printed (cf. put_compact_matrix in printer.cc). */
+
+template <class M>
+static expr compact_matrix_expr(expr f, const M *m)
+{
+  if (m->size1 == 0 || m->size2 == 0) {
+    exprl dims;
+    dims.push_back(expr(EXPR::INT, (int32_t)m->size1));
+    dims.push_back(expr(EXPR::INT, (int32_t)m->size2));
+    return expr(f, expr::tuple(dims));
+  }
+  exprll *xs = new exprll;
+  for (size_t i = 0; i < m->size1; i++) {
+    xs->push_back(exprl());
+    exprl& ys = xs->back();
+    for (size_t j = 0; j < m->size2; j++)
+      ys.push_back(compact_elem(m->data[i * m->tda + j]));
+  }
+  return expr(f, expr(EXPR::MATRIX, xs));
+}
+#endif
+
 expr interpreter::pure_expr_to_expr(pure_expr *x)
 {
   char test;
@@ -982,7 +1031,7 @@ expr interpreter::pure_expr_to_expr(pure_expr *x)
 	  ys.push_back(pure_expr_to_expr(m->data[i * m->tda + j]));
 	}
       }
-      return expr(EXPR::MATRIX, m);
+      return expr(EXPR::MATRIX, xs);
     } else
       return expr(EXPR::MATRIX, new exprll);
   }
@@ -998,7 +1047,7 @@ expr interpreter::pure_expr_to_expr(pure_expr *x)
 	  ys.push_back(expr(EXPR::DBL, m->data[i * m->tda + j]));
 	}
       }
-      return expr(EXPR::MATRIX, m);
+      return expr(EXPR::MATRIX, xs);
     } else
       return expr(EXPR::MATRIX, new exprll);
 #else
@@ -1018,7 +1067,7 @@ expr interpreter::pure_expr_to_expr(pure_expr *x)
 	  ys.push_back(expr(EXPR::INT, m->data[i * m->tda + j]));
 	}
       }
-      return expr(EXPR::MATRIX, m);
+      return expr(EXPR::MATRIX, xs);
     } else
       return expr(EXPR::MATRIX, new exprll);
 #else
@@ -1042,7 +1091,7 @@ expr interpreter::pure_expr_to_expr(pure_expr *x)
 	  ys.push_back(expr(f, u, v));
 	}
       }
-      return expr(EXPR::MATRIX, m);
+      return expr(EXPR::MATRIX, xs);
     } else
       return expr(EXPR::MATRIX, new exprll);
 #else
@@ -1050,6 +1099,29 @@ expr interpreter::pure_expr_to_expr(pure_expr *x)
     return expr(EXPR::MATRIX, new exprll);
 #endif
   }
+#ifdef HAVE_GSL
+  case EXPR::FMATRIX:
+    return compact_matrix_expr(symtab.sym("fmatrix").x,
+			       (gsl_matrix_float*)x->data.mat.p);
+  case EXPR::LMATRIX:
+    return compact_matrix_expr(symtab.sym("lmatrix").x,
+			       (gsl_matrix_int64*)x->data.mat.p);
+  case EXPR::HMATRIX:
+    return compact_matrix_expr(symtab.sym("hmatrix").x,
+			       (gsl_matrix_short*)x->data.mat.p);
+  case EXPR::BMATRIX:
+    return compact_matrix_expr(symtab.sym("bmatrix").x,
+			       (gsl_matrix_uchar*)x->data.mat.p);
+#else
+  case EXPR::FMATRIX:
+  case EXPR::LMATRIX:
+  case EXPR::HMATRIX:
+  case EXPR::BMATRIX:
+    throw err("GSL matrices not supported in this implementation");
+#endif
+  case EXPR::SDMATRIX:
+  case EXPR::SIMATRIX:
+    throw err("sparse matrix not permitted in constant definition");
   default:
     assert(x->tag > 0);
     if (x->data.clos && x->data.clos->local)
@@ -1853,6 +1925,16 @@ void interpreter::promote_ttags(expr f, expr x, expr u)
 
 void interpreter::promote_ttags(expr f, expr x, expr u, expr v)
 {
+  if (f.ftag() == symtab.index_sym().f &&
+      (u.ttag() == EXPR::DMATRIX || u.ttag() == EXPR::IMATRIX)) {
+    // element access on a double or int matrix, with an int index or a pair
+    // of int indices (see matrix_elem_codegen() below)
+    expr i, j;
+    if (v.ttag() == EXPR::INT ||
+	v.is_pair(i, j) && i.ttag() == EXPR::INT && j.ttag() == EXPR::INT)
+      x.set_ttag((u.ttag() == EXPR::DMATRIX)?EXPR::DBL:EXPR::INT);
+    return;
+  }
   if (((u.ttag() == EXPR::INT || u.ttag() == EXPR::DBL) &&
        (v.ttag() == EXPR::INT || v.ttag() == EXPR::DBL))) {
     if (u.ttag() == EXPR::INT && v.ttag() == EXPR::INT) {
@@ -2870,8 +2952,25 @@ expr interpreter::mkmatcomp_expr(expr x, size_t n,
       expr p = c.first;
       return expr::cond(p, mkmatcomp_expr(x, n, ++cs, end),
 			expr(EXPR::MATRIX, new exprll));
+    } else if (++cs == end) {
+      /* The innermost generator. Here the values of x are passed to colcatmap
+	 as is, rather than being wrapped up in 1x1 matrices, so that the
+	 runtime can store numeric values directly in a row vector of the
+	 appropriate size (submatrices still get spliced in, as with {x}). A
+	 generator drawing from an arithmetic sequence n..m is turned into a
+	 call to colrangemap, which avoids constructing the list if n and m
+	 are ints. */
+      expr pat = c.first, body = x, arg = c.second, u, v, w, a;
+      closure(pat, body);
+      symbol *range = symtab.range_sym();
+      if (range && arg.is_app(u, v) && u.is_app(w, a) &&
+	  w.tag() == range->f && !a.is_cons())
+	return expr(symtab.colrangemap_sym().x, expr::lambda(pat, body),
+		    a, v);
+      else
+	return expr(symtab.colcatmap_sym().x, expr::lambda(pat, body), arg);
     } else {
-      expr pat = c.first, body = mkmatcomp_expr(x, n-1, ++cs, end),
+      expr pat = c.first, body = mkmatcomp_expr(x, n-1, cs, end),
 	arg = c.second;
       closure(pat, body);
       expr f = (n&1)?symtab.colcatmap_sym().x:symtab.rowcatmap_sym().x;
@@ -4787,14 +4886,86 @@ Value *interpreter::get_double(expr x)
   }
 }
 
+Value *interpreter::matrix_elem_codegen(expr x, expr y)
+{
+  // Inline element access x!y on a ::dmatrix or ::imatrix variable x, where
+  // y is either an ::int index or a pair of ::int indices. Like the
+  // corresponding definitions in matrices.pure, this throws an out_of_bounds
+  // exception if an index is out of range. Returns the unboxed element.
+  Env& e = act_env();
+  Builder& b = act_builder();
+  assert(x.tag() == EXPR::VAR &&
+	 (x.ttag() == EXPR::DMATRIX || x.ttag() == EXPR::IMATRIX));
+  const bool is64 = sizeof(size_t) == 8;
+  // get the GSL matrix from the expression (this is the second pointer in
+  // the data field, see the description of the expr struct)
+  Value *u = codegen(x);
+  Value *mp = b.CreateBitCast(e.CreateLoadGEP(u, Zero, ValFld2Index),
+			      (x.ttag() == EXPR::DMATRIX)?
+			      GSLDoubleMatrixPtrTy:GSLIntMatrixPtrTy, "matp");
+  Value *size1 = e.CreateLoadGEP(mp, Zero, Zero, "size1");
+  Value *size2 = e.CreateLoadGEP(mp, Zero, One, "size2");
+  Value *tda = e.CreateLoadGEP(mp, Zero, Two, "tda");
+  Value *data = e.CreateLoadGEP(mp, Zero, Three, "data");
+  // compute the index and the range check (negative indices are taken care
+  // of by the unsigned comparisons)
+  expr i, j;
+  Value *iv, *jv = 0, *okv;
+  if (y.is_pair(i, j)) {
+    iv = get_int(i); jv = get_int(j);
+    if (is64) {
+      iv = b.CreateSExt(iv, Type::Int64Ty);
+      jv = b.CreateSExt(jv, Type::Int64Ty);
+    }
+    okv = b.CreateAnd(b.CreateICmpULT(iv, size1), b.CreateICmpULT(jv, size2));
+  } else {
+    iv = get_int(y);
+    if (is64) iv = b.CreateSExt(iv, Type::Int64Ty);
+    okv = b.CreateICmpULT(iv, b.CreateMul(size1, size2));
+  }
+  BasicBlock *okbb = BasicBlock::Create("ok");
+  BasicBlock *errbb = BasicBlock::Create("err");
+  b.CreateCondBr(okv, okbb, errbb);
+  e.f->getBasicBlockList().push_back(errbb);
+  b.SetInsertPoint(errbb);
+  unwind(symtab.out_of_bounds_sym().f);
+  e.f->getBasicBlockList().push_back(okbb);
+  b.SetInsertPoint(okbb);
+  Value *kv;
+  if (jv)
+    kv = b.CreateAdd(b.CreateMul(iv, tda), jv);
+  else {
+    // a linear index needs to be translated if the matrix isn't packed
+    // (i.e., a slice of a larger matrix)
+    BasicBlock *packedbb = b.GetInsertBlock();
+    BasicBlock *slicebb = BasicBlock::Create("slice");
+    BasicBlock *endbb = BasicBlock::Create("end");
+    b.CreateCondBr(b.CreateICmpUGT(tda, size2), slicebb, endbb);
+    e.f->getBasicBlockList().push_back(slicebb);
+    b.SetInsertPoint(slicebb);
+    Value *sv = b.CreateAdd(b.CreateMul(b.CreateUDiv(iv, size2), tda),
+			    b.CreateURem(iv, size2));
+    b.CreateBr(endbb);
+    e.f->getBasicBlockList().push_back(endbb);
+    b.SetInsertPoint(endbb);
+    PHINode *phi = b.CreatePHI(is64?Type::Int64Ty:Type::Int32Ty);
+    phi->addIncoming(iv, packedbb);
+    phi->addIncoming(sv, slicebb);
+    kv = phi;
+  }
+  return e.CreateLoadGEP(data, kv, "elem");
+}
+
 Value *interpreter::builtin_codegen(expr x)
 {
   // handle special cases which should be inlined for efficiency: mixed
   // arithmetic, comparisons, logical ops using unboxed integer and floating
-  // point values
+  // point values, and element access on int and double matrices
   Builder& b = act_builder();
   expr f; uint32_t n = count_args(x, f);
   assert((n == 1 || n == 2) && "error in type checker");
+  if (n == 2 && f.ftag() == symtab.index_sym().f)
+    return matrix_elem_codegen(x.xval1().xval2(), x.xval2());
   if (n == 1 && x.ttag() == EXPR::INT) {
     // unary int operations
     Value *u = get_int(x.xval2());
@@ -6677,16 +6848,23 @@ void interpreter::complex_match(matcher *pm, const list<Value*>& xs, state *s,
     // set up the switch instruction branching over the different type tags
     SwitchInst *sw = f.builder.CreateSwitch(tagv, defaultbb);
     vector<BasicBlock*> vtransbb;
+    set<int32_t> vtags;
     transl::iterator t;
     for (t = t1, i = 0; t != s->tr.end() && t->tag == EXPR::VAR; t++, i++) {
       vtransbb.push_back
 	(BasicBlock::Create(mklabel("trans.state", s->s, t->st->s)));
       sw->addCase(SInt(t->ttag), vtransbb[i]);
+      vtags.insert(t->ttag);
       if (t->ttag == EXPR::MATRIX) {
 	// this can denote any type of matrix, add the other possible cases
-	sw->addCase(SInt(EXPR::DMATRIX), vtransbb[i]);
-	sw->addCase(SInt(EXPR::CMATRIX), vtransbb[i]);
-	sw->addCase(SInt(EXPR::IMATRIX), vtransbb[i]);
+	// (except those with a transition of their own, which come first)
+	static const int32_t subtags[] = {
+	  EXPR::DMATRIX, EXPR::CMATRIX, EXPR::IMATRIX, EXPR::FMATRIX,
+	  EXPR::LMATRIX, EXPR::HMATRIX, EXPR::BMATRIX
+	};
+	for (size_t k = 0; k < sizeof(subtags)/sizeof(subtags[0]); k++)
+	  if (vtags.find(subtags[k]) == vtags.end())
+	    sw->addCase(SInt(subtags[k]), vtransbb[i]);
       }
     }
     // now handle the transitions on the different type tags
@@ -535,6 +535,7 @@ private:
   pure_expr *dodefn(env vars, expr lhs, expr rhs, pure_expr*& e);
   llvm::Value *codegen(expr x);
   void toplevel_codegen(expr x);
+  llvm::Value *matrix_elem_codegen(expr x, expr y);
   llvm::Value *builtin_codegen(expr x);
   llvm::Value *get_int(expr x);
   llvm::Value *get_double(expr x);
@@ -83,6 +83,14 @@ trans::~trans()
   delete st;
 }
 
+/* Specific matrix type tags (::dmatrix etc.) denote a subset of the values
+   matched by ::matrix. */
+
+static inline bool is_matrix_subtype(int32_t tag)
+{
+  return tag != EXPR::MATRIX && (tag & ~0xf) == EXPR::MATRIX;
+}
+
 /* TA matching algorithm. */
 
 state *matcher::match(state *st, expr x)
@@ -115,9 +123,12 @@ state *matcher::match(state *st, expr x)
     for (t = st->tr.begin(); t != st->tr.end() && t->tag == EXPR::VAR; t++)
       if (t->ttag == 0)
 	continue;
-      else if (t->ttag == x.tag())
+      else if (t->ttag == x.tag() ||
+	       t->ttag == EXPR::MATRIX && is_matrix_subtype(x.tag()))
 	return t->st;
-      else if (t->ttag < x.tag())
+      else if (t->ttag < x.tag() && !is_matrix_subtype(x.tag()))
+	// transitions are sorted by type tag, so we're done (matrix subtypes
+	// may still match a ::matrix transition further down, however)
 	break;
   // still no match, use default transition if present
   if ((t = st->tr.begin()) != st->tr.end() &&
@@ -312,7 +323,23 @@ void matcher::merge_vtrans(transl& tr, int8_t ttag, state *st)
   for (t = t0; t != tr.end() && t->tag == EXPR::VAR && t->ttag > ttag; t++) ;
   if (t == tr.end() || t->tag != EXPR::VAR || t->ttag < ttag) {
     trans t1 = trans(EXPR::VAR, ttag);
-    if (ttag != 0 && t0 != tr.end() && t0->tag == EXPR::VAR && t0->ttag == 0) {
+    /* A specific matrix type tag also matches everything that an existing
+       ::matrix transition matches. (Being the smallest matrix tag, ::matrix
+       always comes after the subtypes.) */
+    transl::iterator t2 = t;
+    if (is_matrix_subtype(ttag))
+      while (t2 != tr.end() && t2->tag == EXPR::VAR &&
+	     t2->ttag != EXPR::MATRIX)
+	t2++;
+    if (is_matrix_subtype(ttag) && t2 != tr.end() && t2->tag == EXPR::VAR) {
+      /* The ::matrix state already includes the completions for the default
+	 transition, if any, and it isn't a trie in general, so we can't merge
+	 it into another state. Make the new state a copy of it instead and
+	 merge in the new transition. */
+      *t1.st = *t2->st;
+      merge_state(t1.st, st);
+    } else if (ttag != 0 && t0 != tr.end() && t0->tag == EXPR::VAR &&
+	       t0->ttag == 0) {
       /* We have a typed variable transition, and there's already an existing
 	 untyped (default) var transition. Make the new state a copy of the
 	 old default state and merge in the new transition. */
@@ -331,7 +358,8 @@ void matcher::merge_vtrans(transl& tr, int8_t ttag, state *st)
     switch (t->tag) {
     case EXPR::VAR:
       // matching variable symbol
-      if (ttag == 0 || ttag == t->ttag)
+      if (ttag == 0 || ttag == t->ttag ||
+	  ttag == EXPR::MATRIX && is_matrix_subtype(t->ttag))
 	merge_state(t->st, st);
       break;
     case EXPR::APP:
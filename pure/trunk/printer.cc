@@ -589,15 +589,6 @@ static bool pure_is_list(const pure_expr *x)
   return pure_is_nil(x);
 }
 
-static bool pure_is_list(const pure_expr *x, list<const pure_expr*>& xs)
-{
-  while (pure_is_cons(x)) {
-    xs.push_back(x->data.x[0]->data.x[1]);
-    x = x->data.x[1];
-  }
-  return pure_is_nil(x);
-}
-
 static prec_t pure_expr_nprec(const pure_expr *x)
 {
   assert(x);
@@ -609,6 +600,14 @@ static prec_t pure_expr_nprec(const pure_expr *x)
   case EXPR::CMATRIX:
   case EXPR::IMATRIX:
     return 100;
+  case EXPR::FMATRIX:
+  case EXPR::LMATRIX:
+  case EXPR::HMATRIX:
+  case EXPR::BMATRIX:
+  case EXPR::SDMATRIX:
+  case EXPR::SIMATRIX:
+    // printed as an application, see below
+    return 95;
   case EXPR::INT:
     if (x->data.i < 0)
       // precedence of unary minus:
@@ -669,6 +668,13 @@ ostream& operator << (ostream& os, const pure_paren& p)
     return os << p.x;
 }
 
+static inline bool have_show()
+{
+  interpreter& interp = *interpreter::g_interp;
+  int32_t f = interp.symtab.__show__sym;
+  return f > 0 && interp.globenv.find(f) != interp.globenv.end();
+}
+
 static inline bool pstr(ostream& os, pure_expr *x)
 {
   static bool recursive = false;
@@ -680,7 +686,7 @@ static inline bool pstr(ostream& os, pure_expr *x)
     return false;
   interpreter& interp = *interpreter::g_interp;
   int32_t f = interp.symtab.__show__sym;
-  if (f > 0 && interp.globenv.find(f) != interp.globenv.end()) {
+  if (have_show()) {
     assert(x->refc > 0);
     pure_exception ex; ex.e = 0; ex.sz = interp.sstk_sz;
     interp.estk.push_front(ex);
@@ -716,9 +722,19 @@ static inline bool pstr(ostream& os, pure_expr *x)
     return false;
 }
 
-static inline ostream& print_double(ostream& os, double d)
+static char *format_int(char *buf, int32_t i)
+{
+  // digits are produced backwards, starting at the end of the buffer
+  char *t = buf+12;
+  uint32_t u = i<0?-(uint32_t)i:i;
+  *--t = 0;
+  do { *--t = '0'+u%10; u /= 10; } while (u);
+  if (i<0) *--t = '-';
+  return t;
+}
+
+static char *format_double(char *buf, double d)
 {
-  char buf[64];
   if (is_inf(d))
     if (d > 0)
       strcpy(buf, "inf");
@@ -726,14 +742,148 @@ static inline ostream& print_double(ostream& os, double d)
       strcpy(buf, "-inf");
   else if (is_nan(d))
     strcpy(buf, "nan");
-  else
+  else if (d > -1e15 && d < 1e15 && d == (double)(int64_t)d) {
+    // Integral values, as they are common in numeric data. These are the
+    // ones which %0.15g prints without exponent and fraction, so we can just
+    // print the digits ourselves, which is a lot faster.
+    int64_t n = (int64_t)d;
+    uint64_t u = n<0?-(uint64_t)n:n;
+    char tmp[24], *t = tmp+sizeof(tmp), *p = buf;
+    do { *--t = '0'+u%10; u /= 10; } while (u);
+    if (n<0 || n==0 && 1.0/d < 0.0) *p++ = '-';
+    memcpy(p, t, tmp+sizeof(tmp)-t); p += tmp+sizeof(tmp)-t;
+    strcpy(p, ".0");
+  } else {
     my_formatd(buf, "%0.15g", d);
-  // make sure that the output conforms to Pure syntax
-  os << buf;
-  if (strchr("0123456789", buf[buf[0]=='-'?1:0]) &&
-      !strchr(buf, '.') && !strchr(buf, 'e') && !strchr(buf, 'E'))
-    os << ".0";
-  return os;
+    // make sure that the output conforms to Pure syntax
+    if (strchr("0123456789", buf[buf[0]=='-'?1:0]) &&
+	!strchr(buf, '.') && !strchr(buf, 'e') && !strchr(buf, 'E'))
+      strcat(buf, ".0");
+  }
+  return buf;
+}
+
+static inline ostream& print_double(ostream& os, double d)
+{
+  char buf[64];
+  return os << format_double(buf, d);
+}
+
+/* Output buffer used to print the elements of lists, tuples and matrices.
+   Numbers and strings are formatted directly into the buffer, which is
+   written to the stream in bigger chunks; other elements are flushed to the
+   general printer. If a __show__ function is defined, every element goes
+   through the general printer, so that custom print representations are
+   honored. */
+
+#define PRINTBUFSZ 0x10000
+
+struct printbuf {
+  ostream& os;
+  string buf;
+  bool show;
+  prec_t negp;
+  printbuf(ostream& _os)
+    : os(_os), show(have_show()),
+      negp(sym_nprec(interpreter::g_interp->symtab.neg_sym().f))
+  { buf.reserve(PRINTBUFSZ); }
+  ~printbuf() { flush(); }
+  void flush()
+  {
+    if (!buf.empty()) {
+      os.write(buf.data(), buf.size());
+      buf.clear();
+    }
+  }
+  printbuf& operator << (char c)
+  { buf += c; return *this; }
+  printbuf& operator << (const char *s)
+  { buf += s; return *this; }
+  printbuf& operator << (const string& s)
+  { buf += s; return *this; }
+  void put_int(int32_t i)
+  { char tmp[12]; buf += format_int(tmp, i); }
+  void put_double(double d)
+  { char tmp[64]; buf += format_double(tmp, d); }
+  void put_expr(prec_t p, const pure_expr *x);
+};
+
+#ifdef HAVE_GSL
+static inline void put_elem(printbuf& pb, double x)
+{
+  pb.put_double(x);
+}
+
+static inline void put_elem(printbuf& pb, int x)
+{
+  pb.put_int(x);
+}
+
+static inline void put_elem(printbuf& pb, int64_t x)
+{
+  if (x == (int64_t)(int32_t)x)
+    pb.put_int((int32_t)x);
+  else {
+    // bigint literal
+    char tmp[32];
+    sprintf(tmp, "%lldL", (long long)x);
+    pb << tmp;
+  }
+}
+
+/* Print one of the compact (float, int64, short, byte) matrix types as a
+   call of the corresponding conversion function in matrices.pure, so that
+   the printed matrix reads back as a matrix of the same type. */
+
+template <class M>
+static void put_compact_matrix(printbuf& pb, const char *f, const M *m)
+{
+  pb << f << " {";
+  if (m->size1>0 && m->size2>0) {
+    for (size_t i = 0; i < m->size1; i++) {
+      if (i > 0) pb << ";";
+      for (size_t j = 0; j < m->size2; j++) {
+	if (j > 0) pb << ",";
+	put_elem(pb, m->data[i * m->tda + j]);
+      }
+      if (pb.buf.size() >= PRINTBUFSZ) pb.flush();
+    }
+  }
+  pb << "}";
+}
+#endif
+
+void printbuf::put_expr(prec_t p, const pure_expr *x)
+{
+  if (!show)
+    switch (x->tag) {
+    case EXPR::INT:
+      if (x->data.i < 0 && negp < p) {
+	buf += '('; put_int(x->data.i); buf += ')';
+      } else
+	put_int(x->data.i);
+      goto done;
+    case EXPR::DBL:
+      if ((x->data.d < 0.0 || x->data.d == 0.0 && 1.0/x->data.d < 0.0) &&
+	  negp < p) {
+	buf += '('; put_double(x->data.d); buf += ')';
+      } else
+	put_double(x->data.d);
+      goto done;
+    case EXPR::STR: {
+      char *s = printstr(x->data.s);
+      buf += '"'; buf += s; buf += '"';
+      free(s);
+      goto done;
+    }
+    default:
+      break;
+    }
+  flush();
+  os << pure_paren(p, x);
+  return;
+ done:
+  if (buf.size() >= PRINTBUFSZ) flush();
 }
 
 ostream& operator << (ostream& os, const pure_expr *x)
@@ -767,60 +917,70 @@ ostream& operator << (ostream& os, const pure_expr *x)
   /* NOTE: For performance reasons, we don't do any custom representations for
      matrix elements. As a workaround, you can define __show__ on matrices as
      a whole. */
-  case EXPR::MATRIX:
-    os << "{";
+  case EXPR::MATRIX: {
+    printbuf pb(os);
+    pb << "{";
     if (x->data.mat.p) {
       gsl_matrix_symbolic *m = (gsl_matrix_symbolic*)x->data.mat.p;
       if (m->size1>0 && m->size2>0) {
 	prec_t p = sym_nprec(interpreter::g_interp->symtab.pair_sym().f) + 1;
 	for (size_t i = 0; i < m->size1; i++) {
-	  if (i > 0) os << ";";
+	  if (i > 0) pb << ";";
 	  for (size_t j = 0; j < m->size2; j++) {
-	    if (j > 0) os << ",";
-	    os << pure_paren(p, m->data[i * m->tda + j]);
+	    if (j > 0) pb << ",";
+	    pb.put_expr(p, m->data[i * m->tda + j]);
 	  }
 	}
       }
     }
-    return os << "}";
+    pb << "}";
+    return os;
+  }
 #ifdef HAVE_GSL
-  case EXPR::DMATRIX:
-    os << "{";
+  case EXPR::DMATRIX: {
+    printbuf pb(os);
+    pb << "{";
     if (x->data.mat.p) {
       gsl_matrix *m = (gsl_matrix*)x->data.mat.p;
       if (m->size1>0 && m->size2>0) {
 	for (size_t i = 0; i < m->size1; i++) {
-	  if (i > 0) os << ";";
+	  if (i > 0) pb << ";";
 	  for (size_t j = 0; j < m->size2; j++) {
-	    if (j > 0) os << ",";
-	    print_double(os, m->data[i * m->tda + j]);
+	    if (j > 0) pb << ",";
+	    pb.put_double(m->data[i * m->tda + j]);
 	  }
+	  if (pb.buf.size() >= PRINTBUFSZ) pb.flush();
 	}
       }
     }
-    return os << "}";
-  case EXPR::IMATRIX:
-    os << "{";
+    pb << "}";
+    return os;
+  }
+  case EXPR::IMATRIX: {
+    printbuf pb(os);
+    pb << "{";
     if (x->data.mat.p) {
       gsl_matrix_int *m = (gsl_matrix_int*)x->data.mat.p;
       if (m->size1>0 && m->size2>0) {
-	if (m->size1>0 && m->size2>0) {
-	  for (size_t i = 0; i < m->size1; i++) {
-	    if (i > 0) os << ";";
-	    for (size_t j = 0; j < m->size2; j++) {
-	      if (j > 0) os << ",";
-	      os << m->data[i * m->tda + j];
-	    }
+	for (size_t i = 0; i < m->size1; i++) {
+	  if (i > 0) pb << ";";
+	  for (size_t j = 0; j < m->size2; j++) {
+	    if (j > 0) pb << ",";
+	    pb.put_int(m->data[i * m->tda + j]);
 	  }
+	  if (pb.buf.size() >= PRINTBUFSZ) pb.flush();
 	}
       }
     }
-    return os << "}";
-  case EXPR::CMATRIX:
+    pb << "}";
+    return os;
+  }
+  case EXPR::CMATRIX: {
     /* Print complex values in rectangular format using the infix notation
        defined in math.pure. FIXME: We require the +: symbol to be predefined
        no matter whether math.pure has actually been loaded. */
-    os << "{";
+    printbuf pb(os);
+    pb << "{";
     if (x->data.mat.p) {
       interpreter& interp = *interpreter::g_interp;
       symbol *rect = interp.symtab.complex_rect_sym(true);
@@ -828,17 +988,40 @@ ostream& operator << (ostream& os, const pure_expr *x)
       gsl_matrix_complex *m = (gsl_matrix_complex*)x->data.mat.p;
       if (m->size1>0 && m->size2>0) {
 	for (size_t i = 0; i < m->size1; i++) {
-	  if (i > 0) os << ";";
+	  if (i > 0) pb << ";";
 	  for (size_t j = 0; j < m->size2; j++) {
-	    if (j > 0) os << ",";
-	    print_double(os, m->data[2*(i * m->tda + j)]);
-	    os << rectsym;
-	    print_double(os, m->data[2*(i * m->tda + j) + 1]);
+	    if (j > 0) pb << ",";
+	    pb.put_double(m->data[2*(i * m->tda + j)]);
+	    pb << rectsym;
+	    pb.put_double(m->data[2*(i * m->tda + j) + 1]);
 	  }
+	  if (pb.buf.size() >= PRINTBUFSZ) pb.flush();
 	}
       }
     }
-    return os << "}";
+    pb << "}";
+    return os;
+  }
+  case EXPR::FMATRIX: {
+    printbuf pb(os);
+    put_compact_matrix(pb, "fmatrix", (gsl_matrix_float*)x->data.mat.p);
+    return os;
+  }
+  case EXPR::LMATRIX: {
+    printbuf pb(os);
+    put_compact_matrix(pb, "lmatrix", (gsl_matrix_int64*)x->data.mat.p);
+    return os;
+  }
+  case EXPR::HMATRIX: {
+    printbuf pb(os);
+    put_compact_matrix(pb, "hmatrix", (gsl_matrix_short*)x->data.mat.p);
+    return os;
+  }
+  case EXPR::BMATRIX: {
+    printbuf pb(os);
+    put_compact_matrix(pb, "bmatrix", (gsl_matrix_uchar*)x->data.mat.p);
+    return os;
+  }
 #else
   case EXPR::DMATRIX:
     return os << "#<dmatrix " << x->data.mat.p << ">";
@@ -847,29 +1030,74 @@ ostream& operator << (ostream& os, const pure_expr *x)
   case EXPR::CMATRIX:
     return os << "#<cmatrix " << x->data.mat.p << ">";
 #endif
+  case EXPR::SDMATRIX:
+  case EXPR::SIMATRIX: {
+    /* Sparse matrices are printed as a call of the sparse function in
+       matrices.pure which recreates the matrix from its nonzero elements. */
+    const sparse_matrix *m = (const sparse_matrix*)x->data.mat.p;
+    printbuf pb(os);
+    pb << "sparse (";
+    pb.put_int(m->size1);
+    pb << ",";
+    pb.put_int(m->size2);
+    pb << ") [";
+    for (size_t i = 0; i < m->size1; i++)
+      for (size_t l = m->rowptr[i]; l < m->rowptr[i+1]; l++) {
+	if (l > 0) pb << ",";
+	pb << "(";
+	pb.put_int(i);
+	pb << ",";
+	pb.put_int(m->colidx[l]);
+	pb << ",";
+	if (x->tag == EXPR::SDMATRIX)
+	  pb.put_double(((const double*)m->data)[l]);
+	else
+	  pb.put_int(((const int*)m->data)[l]);
+	pb << ")";
+	if (pb.buf.size() >= PRINTBUFSZ) pb.flush();
+      }
+    pb << "]";
+    return os;
+  }
   case EXPR::APP: {
-    list<const pure_expr*> xs;
     prec_t p;
-    if (pure_is_list(x, xs)) {
+    /* Lists and tuples are printed iteratively, so that we don't run out of
+       stack space on big aggregates. */
+    if (pure_is_list(x)) {
       // proper list value
-      size_t n = xs.size();
-      os << "[";
-      if (n>1 || n==1 && pure_is_pair(xs.front())) {
+      const pure_expr *y = x->data.x[0]->data.x[1], *z = x->data.x[1];
+      if (pure_is_cons(z) || pure_is_pair(y))
 	// list elements at a precedence not larger than ',' have to be
 	// parenthesized
 	p = sym_nprec(interpreter::g_interp->symtab.pair_sym().f) + 1;
-	for (list<const pure_expr*>::const_iterator it = xs.begin();
-	     it != xs.end(); ) {
-	  os << pure_paren(p, *it);
-	  if (++it != xs.end()) os << ",";
-	}
-      } else
-	for (list<const pure_expr*>::const_iterator it = xs.begin();
-	     it != xs.end(); ) {
-	  os << *it;
-	  if (++it != xs.end()) os << ",";
-	}
-      return os << "]";
+      else
+	p = 0;
+      printbuf pb(os);
+      pb << "[";
+      for (;;) {
+	pb.put_expr(p, y);
+	if (!pure_is_cons(z)) break;
+	pb << ",";
+	y = z->data.x[0]->data.x[1]; z = z->data.x[1];
+      }
+      pb << "]";
+      return os;
+    }
+    if (pure_is_pair(x) && !have_show()) {
+      // tuple; ',' is right-associative, so only the left operands may need
+      // parens if they are tuples themselves (__show__ might be defined on
+      // the subtuples, in which case we take the general route below)
+      int32_t f = interpreter::g_interp->symtab.pair_sym().f;
+      string blank = sym_padding(f), op = blank+pname(f)+blank;
+      p = sym_nprec(f);
+      printbuf pb(os);
+      do {
+	pb.put_expr(p+1, x->data.x[0]->data.x[1]);
+	pb << op;
+	x = x->data.x[1];
+      } while (pure_is_pair(x));
+      pb.put_expr(p, x);
+      return os;
     }
     const pure_expr *u = x->data.x[0], *v = x->data.x[1], *w, *y;
     if (u->tag > 0 && (p = sym_nprec(u->tag)) < 100 && p%10 >= 3) {
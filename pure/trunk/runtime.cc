@@ -31,6 +31,7 @@ char *alloca ();
 #include <math.h>
 #include <iostream>
 #include <sstream>
+#include <algorithm>
 
 #include "config.h"
 #include "funcall.h"
@@ -38,6 +39,8 @@ char *alloca ();
 #ifdef HAVE_GSL
 #include <gsl/gsl_errno.h>
 #include <gsl/gsl_matrix.h>
+#include <gsl/gsl_blas.h>
+#include <gsl/gsl_linalg.h>
 #endif
 
 /* Implement the GSL-like operations on symbolic matrices that we need. */
@@ -110,6 +113,102 @@ gsl_matrix_symbolic_submatrix(gsl_matrix_symbolic *m,
   }
 }
 
+#ifdef HAVE_GSL
+
+/* Same for 64 bit integer matrices. */
+
+static gsl_matrix_int64*
+gsl_matrix_int64_alloc(const size_t n1, const size_t n2)
+{
+  gsl_block_int64* block;
+  gsl_matrix_int64* m;
+  if (n1 == 0 || n2 == 0)
+    return 0;
+  m = (gsl_matrix_int64*)malloc(sizeof(gsl_matrix_int64));
+  if (m == 0)
+    return 0;
+  block = (gsl_block_int64*)malloc(sizeof(gsl_block_int64));
+  if (block == 0) {
+    free(m);
+    return 0;
+  }
+  block->size = n1*n2;
+  block->data = (int64_t*)malloc(block->size*sizeof(int64_t));
+  if (block->data == 0) {
+    free(m);
+    free(block);
+    return 0;
+  }
+  m->data = block->data;
+  m->size1 = n1;
+  m->size2 = n2;
+  m->tda = n2;
+  m->block = block;
+  m->owner = 1;
+  return m;
+}
+
+static gsl_matrix_int64*
+gsl_matrix_int64_calloc(const size_t n1, const size_t n2)
+{
+  gsl_matrix_int64* m = gsl_matrix_int64_alloc(n1, n2);
+  if (m == 0) return 0;
+  memset(m->data, 0, m->block->size*sizeof(int64_t));
+  return m;
+}
+
+static void gsl_matrix_int64_free(gsl_matrix_int64 *m)
+{
+  if (m->owner) {
+    free(m->block->data);
+    free(m->block);
+  }
+  free(m);
+}
+
+static gsl_matrix_int64_view
+gsl_matrix_int64_submatrix(gsl_matrix_int64 *m,
+			   const size_t i, const size_t j,
+			   const size_t n1, const size_t n2)
+{
+  gsl_matrix_int64_view view = {{0, 0, 0, 0, 0, 0}};
+  if (i >= m->size1 || j >= m->size2 || n1 == 0 || n2 == 0 ||
+      i + n1 > m->size1 || j + n2 > m->size2)
+    return view;
+  else {
+     gsl_matrix_int64 s = {0, 0, 0, 0, 0, 0};
+     s.data = m->data + i * m->tda + j;
+     s.size1 = n1;
+     s.size2 = n2;
+     s.tda = m->tda;
+     s.block = m->block;
+     s.owner = 0;
+     view.matrix = s;
+     return view;
+  }
+}
+
+#endif
+
+/* Copy an n x m block of elements of the given size between two matrices
+   with row strides dtda and stda. The rows are copied with memcpy; if both
+   matrices are packed, the entire block is copied in one go. */
+
+static inline void
+matrix_copy_rows(void *dest, size_t dtda, const void *src, size_t stda,
+		 size_t n, size_t m, size_t size)
+{
+  if (n == 0 || m == 0) return;
+  if (dtda == m && stda == m)
+    memcpy(dest, src, n*m*size);
+  else {
+    char *d = (char*)dest;
+    const char *s = (const char*)src;
+    for (size_t i = 0; i < n; i++, d += dtda*size, s += stda*size)
+      memcpy(d, s, m*size);
+  }
+}
+
 static int
 gsl_matrix_symbolic_memcpy(gsl_matrix_symbolic *dest,
 			   const gsl_matrix_symbolic *src)
@@ -121,12 +220,8 @@ gsl_matrix_symbolic_memcpy(gsl_matrix_symbolic *dest,
   if (src_size1 != dest_size1 || src_size2 != dest_size2)
     return -1;
   else {
-    const size_t src_tda = src->tda ;
-    const size_t dest_tda = dest->tda ;
-    size_t i;
-    for (i = 0; i < src_size1 ; i++)
-      memcpy(dest->data+dest_tda*i, src->data+src_tda*i,
-	     src_size2*sizeof(pure_expr*));
+    matrix_copy_rows(dest->data, dest->tda, src->data, src->tda,
+		     src_size1, src_size2, sizeof(pure_expr*));
     return 0;
   }
 }
@@ -260,6 +355,17 @@ static inline void free_sentry(pure_expr *x)
   }
 }
 
+/* Strings don't have sentries, so the sentry slot of a string expression is
+   used to cache information about the string (size and character positions,
+   see string_info below) instead, which is computed on demand. */
+
+struct string_info;
+
+static inline string_info*& str_info(pure_expr *x)
+{
+  return *(string_info**)&x->data.x[2];
+}
+
 // Expression pointers are allocated in larger chunks for better performance.
 // NOTE: Only internal fields get initialized by new_expr(), the remaining
 // fields *must* be initialized as appropriate by the caller.
@@ -366,6 +472,16 @@ static pure_closure *pure_copy_clos(pure_closure *clos)
   return ret;
 }
 
+/* Numeric matrices may also point into a memory-mapped file (see mmap_open
+   below). These are recorded in mmap_views, keyed by their reference
+   counter, so that the mapping can be released when the last matrix sharing
+   the data is freed. */
+
+struct mmap_file;
+static map<uint32_t*,mmap_file*> mmap_views;
+static void mmap_release(uint32_t *refc);
+static void sparse_free(sparse_matrix *s);
+
 static void pure_free_matrix(pure_expr *x)
 {
   if (!x->data.mat.p) return;
@@ -404,11 +520,43 @@ static void pure_free_matrix(pure_expr *x)
     gsl_matrix_int_free(m);
     break;
   }
+  case EXPR::FMATRIX: {
+    gsl_matrix_float *m = (gsl_matrix_float*)x->data.mat.p;
+    m->owner = owner && m->block;
+    gsl_matrix_float_free(m);
+    break;
+  }
+  case EXPR::LMATRIX: {
+    gsl_matrix_int64 *m = (gsl_matrix_int64*)x->data.mat.p;
+    m->owner = owner && m->block;
+    gsl_matrix_int64_free(m);
+    break;
+  }
+  case EXPR::HMATRIX: {
+    gsl_matrix_short *m = (gsl_matrix_short*)x->data.mat.p;
+    m->owner = owner && m->block;
+    gsl_matrix_short_free(m);
+    break;
+  }
+  case EXPR::BMATRIX: {
+    gsl_matrix_uchar *m = (gsl_matrix_uchar*)x->data.mat.p;
+    m->owner = owner && m->block;
+    gsl_matrix_uchar_free(m);
+    break;
+  }
 #endif
+  case EXPR::SDMATRIX:
+  case EXPR::SIMATRIX:
+    // sparse matrices are never shared, see pure_sparse_matrix()
+    if (owner) sparse_free((sparse_matrix*)x->data.mat.p);
+    break;
   default:
     break;
   }
-  if (owner) delete x->data.mat.refc;
+  if (owner) {
+    if (!mmap_views.empty()) mmap_release(x->data.mat.refc);
+    delete x->data.mat.refc;
+  }
 }
 
 #if 1
@@ -442,11 +590,18 @@ void pure_free_internal(pure_expr *x)
       break;
     case EXPR::STR:
       free(x->data.s);
+      if (str_info(x)) free(str_info(x));
       break;
     case EXPR::MATRIX:
     case EXPR::DMATRIX:
     case EXPR::CMATRIX:
     case EXPR::IMATRIX:
+    case EXPR::FMATRIX:
+    case EXPR::LMATRIX:
+    case EXPR::HMATRIX:
+    case EXPR::BMATRIX:
+    case EXPR::SDMATRIX:
+    case EXPR::SIMATRIX:
       pure_free_matrix(x);
       break;
     default:
@@ -495,6 +650,7 @@ void pure_free_internal(pure_expr *x)
       break;
     case EXPR::STR:
       free(x->data.s);
+      if (str_info(x)) free(str_info(x));
       break;
     case EXPR::PTR:
       break;
@@ -737,6 +893,62 @@ create_int_matrix(size_t nrows, size_t ncols)
   } else
     return gsl_matrix_int_alloc(nrows, ncols);
 }
+
+static inline gsl_matrix_float*
+create_float_matrix(size_t nrows, size_t ncols)
+{
+  if (nrows == 0 || ncols == 0 ) {
+    size_t nrows1 = (nrows>0)?nrows:1;
+    size_t ncols1 = (ncols>0)?ncols:1;
+    gsl_matrix_float *m = gsl_matrix_float_calloc(nrows1, ncols1);
+    if (!m) return 0;
+    m->size1 = nrows; m->size2 = ncols;
+    return m;
+  } else
+    return gsl_matrix_float_alloc(nrows, ncols);
+}
+
+static inline gsl_matrix_int64*
+create_int64_matrix(size_t nrows, size_t ncols)
+{
+  if (nrows == 0 || ncols == 0 ) {
+    size_t nrows1 = (nrows>0)?nrows:1;
+    size_t ncols1 = (ncols>0)?ncols:1;
+    gsl_matrix_int64 *m = gsl_matrix_int64_calloc(nrows1, ncols1);
+    if (!m) return 0;
+    m->size1 = nrows; m->size2 = ncols;
+    return m;
+  } else
+    return gsl_matrix_int64_alloc(nrows, ncols);
+}
+
+static inline gsl_matrix_short*
+create_short_matrix(size_t nrows, size_t ncols)
+{
+  if (nrows == 0 || ncols == 0 ) {
+    size_t nrows1 = (nrows>0)?nrows:1;
+    size_t ncols1 = (ncols>0)?ncols:1;
+    gsl_matrix_short *m = gsl_matrix_short_calloc(nrows1, ncols1);
+    if (!m) return 0;
+    m->size1 = nrows; m->size2 = ncols;
+    return m;
+  } else
+    return gsl_matrix_short_alloc(nrows, ncols);
+}
+
+static inline gsl_matrix_uchar*
+create_byte_matrix(size_t nrows, size_t ncols)
+{
+  if (nrows == 0 || ncols == 0 ) {
+    size_t nrows1 = (nrows>0)?nrows:1;
+    size_t ncols1 = (ncols>0)?ncols:1;
+    gsl_matrix_uchar *m = gsl_matrix_uchar_calloc(nrows1, ncols1);
+    if (!m) return 0;
+    m->size1 = nrows; m->size2 = ncols;
+    return m;
+  } else
+    return gsl_matrix_uchar_alloc(nrows, ncols);
+}
 #endif
 
 static inline gsl_matrix_symbolic*
@@ -830,6 +1042,82 @@ pure_expr *pure_int_matrix(void *p)
 #endif
 }
 
+extern "C"
+pure_expr *pure_float_matrix(void *p)
+{
+#ifdef HAVE_GSL
+  gsl_matrix_float *m = (gsl_matrix_float*)p;
+  if (!m || !m->owner) return 0;
+  m->owner = 0;
+  pure_expr *x = new_expr();
+  x->tag = EXPR::FMATRIX;
+  x->data.mat.p = p;
+  x->data.mat.refc = new uint32_t;
+  *x->data.mat.refc = 1;
+  MEMDEBUG_NEW(x)
+  return x;
+#else
+  return 0;
+#endif
+}
+
+extern "C"
+pure_expr *pure_int64_matrix(void *p)
+{
+#ifdef HAVE_GSL
+  gsl_matrix_int64 *m = (gsl_matrix_int64*)p;
+  if (!m || !m->owner) return 0;
+  m->owner = 0;
+  pure_expr *x = new_expr();
+  x->tag = EXPR::LMATRIX;
+  x->data.mat.p = p;
+  x->data.mat.refc = new uint32_t;
+  *x->data.mat.refc = 1;
+  MEMDEBUG_NEW(x)
+  return x;
+#else
+  return 0;
+#endif
+}
+
+extern "C"
+pure_expr *pure_short_matrix(void *p)
+{
+#ifdef HAVE_GSL
+  gsl_matrix_short *m = (gsl_matrix_short*)p;
+  if (!m || !m->owner) return 0;
+  m->owner = 0;
+  pure_expr *x = new_expr();
+  x->tag = EXPR::HMATRIX;
+  x->data.mat.p = p;
+  x->data.mat.refc = new uint32_t;
+  *x->data.mat.refc = 1;
+  MEMDEBUG_NEW(x)
+  return x;
+#else
+  return 0;
+#endif
+}
+
+extern "C"
+pure_expr *pure_byte_matrix(void *p)
+{
+#ifdef HAVE_GSL
+  gsl_matrix_uchar *m = (gsl_matrix_uchar*)p;
+  if (!m || !m->owner) return 0;
+  m->owner = 0;
+  pure_expr *x = new_expr();
+  x->tag = EXPR::BMATRIX;
+  x->data.mat.p = p;
+  x->data.mat.refc = new uint32_t;
+  *x->data.mat.refc = 1;
+  MEMDEBUG_NEW(x)
+  return x;
+#else
+  return 0;
+#endif
+}
+
 extern "C"
 pure_expr *pure_symbolic_matrix_dup(const void *p)
 {
@@ -850,8 +1138,8 @@ pure_expr *pure_double_matrix_dup(const void *p)
   if (!m1) return 0;
   gsl_matrix *m2 = create_double_matrix(m1->size1, m1->size2);
   if (!m2) return 0;
-  if (m1->size1 > 0 && m1->size2 > 0)
-    gsl_matrix_memcpy(m2, m1);
+  matrix_copy_rows(m2->data, m2->tda, m1->data, m1->tda,
+		   m1->size1, m1->size2, sizeof(double));
   return pure_double_matrix(m2);
 #else
   return 0;
@@ -866,8 +1154,8 @@ pure_expr *pure_complex_matrix_dup(const void *p)
   if (!m1) return 0;
   gsl_matrix_complex *m2 = create_complex_matrix(m1->size1, m1->size2);
   if (!m2) return 0;
-  if (m1->size1 > 0 && m1->size2 > 0)
-    gsl_matrix_complex_memcpy(m2, m1);
+  matrix_copy_rows(m2->data, m2->tda, m1->data, m1->tda,
+		   m1->size1, m1->size2, 2*sizeof(double));
   return pure_complex_matrix(m2);
 #else
   return 0;
@@ -882,8 +1170,8 @@ pure_expr *pure_int_matrix_dup(const void *p)
   if (!m1) return 0;
   gsl_matrix_int *m2 = create_int_matrix(m1->size1, m1->size2);
   if (!m2) return 0;
-  if (m1->size1 > 0 && m1->size2 > 0)
-    gsl_matrix_int_memcpy(m2, m1);
+  matrix_copy_rows(m2->data, m2->tda, m1->data, m1->tda,
+		   m1->size1, m1->size2, sizeof(int));
   return pure_int_matrix(m2);
 #else
   return 0;
@@ -992,9 +1280,11 @@ double_matrix_rows(size_t nrows, size_t ncols, size_t n, pure_expr **xs)
       break;
     case EXPR::DMATRIX: {
       gsl_matrix *mat1 = (gsl_matrix*)x->data.mat.p;
-      if (mat1)
-	for (size_t j = 0; j < mat1->size1; i++, j++)
-	  memcpy(data+i*tda, mat1->data+j*mat1->tda, ncols*sizeof(double));
+      if (mat1) {
+	matrix_copy_rows(data+i*tda, tda, mat1->data, mat1->tda,
+			 mat1->size1, ncols, sizeof(double));
+	i += mat1->size1;
+      }
       break;
     }
     case EXPR::IMATRIX: {
@@ -1042,9 +1332,8 @@ double_matrix_columns(size_t nrows, size_t ncols, size_t n, pure_expr **xs)
     case EXPR::DMATRIX: {
       gsl_matrix *mat1 = (gsl_matrix*)x->data.mat.p;
       if (mat1)
-	for (size_t j = 0; j < mat1->size1; j++)
-	  memcpy(data+j*tda+i, mat1->data+j*mat1->tda,
-		 mat1->size2*sizeof(double));
+	matrix_copy_rows(data+i, tda, mat1->data, mat1->tda,
+			 mat1->size1, mat1->size2, sizeof(double));
       i += mat1->size2;
       break;
     }
@@ -1130,10 +1419,11 @@ complex_matrix_rows(size_t nrows, size_t ncols, size_t n, pure_expr **xs)
     }
     case EXPR::CMATRIX: {
       gsl_matrix_complex *mat1 = (gsl_matrix_complex*)x->data.mat.p;
-      if (mat1)
-	for (size_t j = 0; j < mat1->size1; i++, j++)
-	  memcpy(data+2*i*tda, mat1->data+2*j*mat1->tda,
-		 ncols*2*sizeof(double));
+      if (mat1) {
+	matrix_copy_rows(data+2*i*tda, tda, mat1->data, mat1->tda,
+			 mat1->size1, ncols, 2*sizeof(double));
+	i += mat1->size1;
+      }
       break;
     }
     case EXPR::MATRIX:
@@ -1211,9 +1501,8 @@ complex_matrix_columns(size_t nrows, size_t ncols, size_t n, pure_expr **xs)
     case EXPR::CMATRIX: {
       gsl_matrix_complex *mat1 = (gsl_matrix_complex*)x->data.mat.p;
       if (mat1)
-	for (size_t j = 0; j < mat1->size1; j++)
-	  memcpy(data+2*(j*tda+i), mat1->data+2*j*mat1->tda,
-		 mat1->size2*2*sizeof(double));
+	matrix_copy_rows(data+2*i, tda, mat1->data, mat1->tda,
+			 mat1->size1, mat1->size2, 2*sizeof(double));
       i += mat1->size2;
       break;
     }
@@ -1260,9 +1549,11 @@ int_matrix_rows(size_t nrows, size_t ncols, size_t n, pure_expr **xs)
     }
     case EXPR::IMATRIX: {
       gsl_matrix_int *mat1 = (gsl_matrix_int*)x->data.mat.p;
-      if (mat1)
-	for (size_t j = 0; j < mat1->size1; i++, j++)
-	  memcpy(data+i*tda, mat1->data+j*mat1->tda, ncols*sizeof(int));
+      if (mat1) {
+	matrix_copy_rows(data+i*tda, tda, mat1->data, mat1->tda,
+			 mat1->size1, ncols, sizeof(int));
+	i += mat1->size1;
+      }
       break;
     }
     case EXPR::CMATRIX:
@@ -1311,9 +1602,8 @@ int_matrix_columns(size_t nrows, size_t ncols, size_t n, pure_expr **xs)
     case EXPR::IMATRIX: {
       gsl_matrix_int *mat1 = (gsl_matrix_int*)x->data.mat.p;
       if (mat1)
-	for (size_t j = 0; j < mat1->size1; j++)
-	  memcpy(data+j*tda+i, mat1->data+j*mat1->tda,
-		 mat1->size2*sizeof(int));
+	matrix_copy_rows(data+i, tda, mat1->data, mat1->tda,
+			 mat1->size1, mat1->size2, sizeof(int));
       i += mat1->size2;
       break;
     }
@@ -1345,9 +1635,11 @@ symbolic_matrix_rows(size_t nrows, size_t ncols, size_t n, pure_expr **xs)
     switch (x->tag) {
     case EXPR::MATRIX: {
       gsl_matrix_symbolic *mat1 = (gsl_matrix_symbolic*)x->data.mat.p;
-      if (mat1)
-	for (size_t j = 0; j < mat1->size1; i++, j++)
-	  memcpy(data+i*tda, mat1->data+j*mat1->tda, ncols*sizeof(pure_expr*));
+      if (mat1) {
+	matrix_copy_rows(data+i*tda, tda, mat1->data, mat1->tda,
+			 mat1->size1, ncols, sizeof(pure_expr*));
+	i += mat1->size1;
+      }
       break;
     }
 #ifdef HAVE_GSL
@@ -1407,9 +1699,8 @@ symbolic_matrix_columns(size_t nrows, size_t ncols, size_t n, pure_expr **xs)
     case EXPR::MATRIX: {
       gsl_matrix_symbolic *mat1 = (gsl_matrix_symbolic*)x->data.mat.p;
       if (mat1)
-	for (size_t j = 0; j < mat1->size1; j++)
-	  memcpy(data+j*tda+i, mat1->data+j*mat1->tda,
-		 mat1->size2*sizeof(pure_expr*));
+	matrix_copy_rows(data+i, tda, mat1->data, mat1->tda,
+			 mat1->size1, mat1->size2, sizeof(pure_expr*));
       i += mat1->size2;
       break;
     }
@@ -2937,6 +3228,7 @@ pure_expr *pure_force(pure_expr *x)
       break;
     case EXPR::STR:
       x->data.s = strdup(x->data.s);
+      str_info(x) = 0;
       break;
     default:
       if (x->tag >= 0 && x->data.clos)
@@ -3565,6 +3857,22 @@ pure_expr *pure_pointerval(pure_expr *x)
     gsl_matrix_int *m = (gsl_matrix_int*)x->data.mat.p;
     return pure_pointer(m->data);
   }
+  case EXPR::FMATRIX: {
+    gsl_matrix_float *m = (gsl_matrix_float*)x->data.mat.p;
+    return pure_pointer(m->data);
+  }
+  case EXPR::LMATRIX: {
+    gsl_matrix_int64 *m = (gsl_matrix_int64*)x->data.mat.p;
+    return pure_pointer(m->data);
+  }
+  case EXPR::HMATRIX: {
+    gsl_matrix_short *m = (gsl_matrix_short*)x->data.mat.p;
+    return pure_pointer(m->data);
+  }
+  case EXPR::BMATRIX: {
+    gsl_matrix_uchar *m = (gsl_matrix_uchar*)x->data.mat.p;
+    return pure_pointer(m->data);
+  }
 #endif
   default:		return 0;
   }
@@ -4021,49 +4329,308 @@ int32_t string_index(const char* s, const char *t)
     return -1;
 }
 
-extern "C"
-char *str(const pure_expr *x)
-{
-  assert(x);
-  ostringstream os;
-  try {
-    os << x;
-    return strdup(os.str().c_str());
-  } catch (err &e) {
-    return 0;
+/* Cached string information. For each string which is subjected to one of
+   the following operations, we determine its size (in bytes and in
+   characters) and, if it contains any multibyte characters, a sparse index
+   holding the byte offset of every STRING_STEP-th character. This takes a
+   single linear scan of the string, after which the size of the string is
+   available in constant time, and any character position can be found by
+   scanning less than STRING_STEP characters. Pure ASCII strings don't need an
+   index, since character and byte positions coincide. */
+
+#define STRING_STEP 64
+
+struct string_info {
+  size_t len;			// size in bytes
+  size_t n;			// size in characters
+  bool ascii;			// ASCII only (no index needed)
+  size_t pos[1];		// offsets of characters 0, STRING_STEP, ...
+};
+
+static string_info *get_string_info(pure_expr *x)
+{
+  string_info *info = str_info(x);
+  if (info) return info;
+  const char *s = x->data.s;
+  size_t len = 0;
+  bool ascii = true;
+  for (const char *p = s; *p; p++)
+    if (((signed char)*p) < 0) {
+      ascii = false;
+      len = p-s+strlen(p);
+      break;
+    }
+  if (ascii) {
+    len = strlen(s);
+    info = (string_info*)malloc(sizeof(string_info));
+    assert(info);
+    info->len = info->n = len; info->ascii = true; info->pos[0] = 0;
+  } else {
+    size_t n = u8strlen(s), m = n>0?(n-1)/STRING_STEP+1:1;
+    info = (string_info*)malloc(sizeof(string_info)+(m-1)*sizeof(size_t));
+    assert(info);
+    info->len = len; info->n = n; info->ascii = false; info->pos[0] = 0;
+    const char *p = s;
+    for (size_t k = 1; k < m; k++) {
+      p = u8strcharpos(p, STRING_STEP);
+      info->pos[k] = p-s;
+    }
   }
+  str_info(x) = info;
+  return info;
 }
 
-extern "C"
-pure_expr *eval(const char *s)
+/* Return a pointer to the ith character of a string (or the end of the
+   string if i is out of range). */
+
+static const char *string_pos(pure_expr *x, const string_info *info, size_t i)
 {
-  assert(s);
-  interpreter& interp = *interpreter::g_interp;
-  interp.errmsg.clear();
-  pure_expr *res = interp.runstr(string(s)+";");
-  interp.result = 0;
-  if (res) pure_unref_internal(res);
-  return res;
+  const char *s = x->data.s;
+  if (i >= info->n)
+    return s+info->len;
+  else if (info->ascii)
+    return s+i;
+  else
+    return u8strcharpos(s+info->pos[i/STRING_STEP], i%STRING_STEP);
 }
 
 extern "C"
-const char *lasterr()
+uint32_t string_expr_size(pure_expr *x)
 {
-  interpreter& interp = *interpreter::g_interp;
-  return interp.errmsg.c_str();
+  assert(x && x->tag == EXPR::STR);
+  return get_string_info(x)->n;
 }
 
 extern "C"
-uint32_t matrix_size(pure_expr *x)
+pure_expr *string_expr_char_at(pure_expr *x, uint32_t n)
 {
-  switch (x->tag) {
-  case EXPR::MATRIX: {
-    gsl_matrix_symbolic *m = (gsl_matrix_symbolic*)x->data.mat.p;
-    return m->size1*m->size2;
+  assert(x && x->tag == EXPR::STR);
+  string_info *info = get_string_info(x);
+  if (n >= info->n) return 0;
+  char buf[5];
+  if (info->ascii) {
+    buf[0] = x->data.s[n]; buf[1] = 0;
+    return pure_string_dup(buf);
   }
-#ifdef HAVE_GSL
-  case EXPR::DMATRIX: {
-    gsl_matrix *m = (gsl_matrix*)x->data.mat.p;
+  unsigned long c = u8strchar(string_pos(x, info, n), 0);
+  if (c == 0) return 0;
+  return pure_string_dup(u8char(buf, c));
+}
+
+extern "C"
+pure_expr *string_expr_substr(pure_expr *x, uint32_t pos, uint32_t size)
+{
+  assert(x && x->tag == EXPR::STR);
+  string_info *info = get_string_info(x);
+  const char *p = string_pos(x, info, pos),
+    *q = string_pos(x, info, (size_t)pos+size);
+  size_t n = q-p;
+  char *buf = (char*)malloc(n+1);
+  assert(buf);
+  memcpy(buf, p, n); buf[n] = 0;
+  return pure_string(buf);
+}
+
+extern "C"
+int32_t string_expr_index(pure_expr *x, const char *t)
+{
+  assert(x && x->tag == EXPR::STR && t);
+  const char *s = x->data.s, *p = strstr(s, t);
+  if (!p) return -1;
+  string_info *info = get_string_info(x);
+  size_t k = p-s;
+  if (info->ascii) return k;
+  // binary search for the nearest indexed character position
+  size_t l = 0, r = info->n>0?(info->n-1)/STRING_STEP+1:1;
+  while (r-l > 1) {
+    size_t m = (l+r)/2;
+    if (info->pos[m] <= k) l = m; else r = m;
+  }
+  return l*STRING_STEP+u8strpos(s+info->pos[l], p);
+}
+
+/* Splitting, joining and replacing strings. These scan the input string only
+   once and build the result list directly. */
+
+static inline pure_expr *mk_string(const char *p, size_t n)
+{
+  char *buf = (char*)malloc(n+1);
+  assert(buf);
+  memcpy(buf, p, n); buf[n] = 0;
+  return pure_string(buf);
+}
+
+static pure_expr *mk_string_list(vector<pure_expr*>& xs)
+{
+  pure_expr *y = mk_nil();
+  for (size_t i = xs.size(); i-- > 0; )
+    y = mk_cons(xs[i], y);
+  return y;
+}
+
+extern "C"
+pure_expr *string_split(const char *s, const char *delim)
+{
+  assert(s && delim);
+  size_t m = strlen(delim);
+  if (m == 0) return 0;
+  vector<pure_expr*> xs;
+  if (*s) {
+    const char *p = s, *q;
+    while ((q = strstr(p, delim))) {
+      xs.push_back(mk_string(p, q-p));
+      p = q+m;
+    }
+    xs.push_back(pure_string_dup(p));
+  }
+  return mk_string_list(xs);
+}
+
+/* Check whether the character at p is one of the given delimiters and return
+   its size in bytes (0 if it isn't a delimiter). If the delimiters are all
+   ASCII, the caller uses strspn/strcspn instead, which is safe since the
+   bytes of a utf-8 multibyte character are all >= 0x80. */
+
+static size_t string_delim(const char *p, const char *delims)
+{
+  const char *q = u8strcharpos(p, 1);
+  size_t n = q-p;
+  if (n == 0) return 0;
+  for (const char *d = delims; *d; ) {
+    const char *e = u8strcharpos(d, 1);
+    if ((size_t)(e-d) == n && strncmp(p, d, n) == 0) return n;
+    d = e;
+  }
+  return 0;
+}
+
+extern "C"
+pure_expr *string_tokenize(const char *s, const char *delims)
+{
+  assert(s && delims);
+  vector<pure_expr*> xs;
+  bool ascii = true;
+  for (const char *d = delims; *d; d++)
+    if (((signed char)*d) < 0) { ascii = false; break; }
+  const char *p = s;
+  if (ascii)
+    while (*(p += strspn(p, delims))) {
+      size_t n = strcspn(p, delims);
+      xs.push_back(mk_string(p, n));
+      p += n;
+    }
+  else
+    while (*p) {
+      size_t k;
+      while ((k = string_delim(p, delims))) p += k;
+      if (!*p) break;
+      const char *q = p;
+      while (*q && !string_delim(q, delims)) q = u8strcharpos(q, 1);
+      xs.push_back(mk_string(p, q-p));
+      p = q;
+    }
+  return mk_string_list(xs);
+}
+
+extern "C"
+pure_expr *string_join(const char *delim, pure_expr *xs)
+{
+  assert(delim && xs);
+  if (is_thunk(xs)) pure_force(xs);
+  // calculate the size of the result string
+  pure_expr *ys = xs, *z, *zs;
+  size_t m = strlen(delim), n = 0, k = 0;
+  while (is_cons(ys, z, zs)) {
+    if (is_thunk(z)) pure_force(z);
+    if (z->tag != EXPR::STR) break;
+    n += strlen(z->data.s); k++;
+    ys = zs;
+    if (is_thunk(ys)) pure_force(ys);
+  }
+  if (!is_nil(ys)) return 0;
+  if (k > 0) n += (k-1)*m;
+  // allocate the result string
+  char *buf = (char*)malloc(n+1);
+  assert(buf);
+  // concatenate
+  ys = xs; n = 0;
+  while (is_cons(ys, z, zs) && z->tag == EXPR::STR) {
+    if (ys != xs) { memcpy(buf+n, delim, m); n += m; }
+    size_t l = strlen(z->data.s);
+    memcpy(buf+n, z->data.s, l); n += l;
+    ys = zs;
+  }
+  buf[n] = 0;
+  return pure_string(buf);
+}
+
+extern "C"
+pure_expr *string_replace(const char *s, const char *t, const char *u)
+{
+  assert(s && t && u);
+  size_t l = strlen(t), m = strlen(u);
+  if (l == 0) return 0;
+  // count the occurrences of t to determine the size of the result string
+  size_t k = 0, n = strlen(s);
+  for (const char *p = s; (p = strstr(p, t)); p += l) k++;
+  if (k == 0) return pure_string_dup(s);
+  n = n-k*l+k*m;
+  char *buf = (char*)malloc(n+1);
+  assert(buf);
+  char *r = buf;
+  const char *p = s, *q;
+  while ((q = strstr(p, t))) {
+    memcpy(r, p, q-p); r += q-p;
+    memcpy(r, u, m); r += m;
+    p = q+l;
+  }
+  strcpy(r, p);
+  return pure_string(buf);
+}
+
+extern "C"
+char *str(const pure_expr *x)
+{
+  assert(x);
+  ostringstream os;
+  try {
+    os << x;
+    return strdup(os.str().c_str());
+  } catch (err &e) {
+    return 0;
+  }
+}
+
+extern "C"
+pure_expr *eval(const char *s)
+{
+  assert(s);
+  interpreter& interp = *interpreter::g_interp;
+  interp.errmsg.clear();
+  pure_expr *res = interp.runstr(string(s)+";");
+  interp.result = 0;
+  if (res) pure_unref_internal(res);
+  return res;
+}
+
+extern "C"
+const char *lasterr()
+{
+  interpreter& interp = *interpreter::g_interp;
+  return interp.errmsg.c_str();
+}
+
+extern "C"
+uint32_t matrix_size(pure_expr *x)
+{
+  switch (x->tag) {
+  case EXPR::MATRIX: {
+    gsl_matrix_symbolic *m = (gsl_matrix_symbolic*)x->data.mat.p;
+    return m->size1*m->size2;
+  }
+#ifdef HAVE_GSL
+  case EXPR::DMATRIX: {
+    gsl_matrix *m = (gsl_matrix*)x->data.mat.p;
     return m->size1*m->size2;
   }
   case EXPR::CMATRIX: {
@@ -4074,7 +4641,28 @@ uint32_t matrix_size(pure_expr *x)
     gsl_matrix_int *m = (gsl_matrix_int*)x->data.mat.p;
     return m->size1*m->size2;
   }
+  case EXPR::FMATRIX: {
+    gsl_matrix_float *m = (gsl_matrix_float*)x->data.mat.p;
+    return m->size1*m->size2;
+  }
+  case EXPR::LMATRIX: {
+    gsl_matrix_int64 *m = (gsl_matrix_int64*)x->data.mat.p;
+    return m->size1*m->size2;
+  }
+  case EXPR::HMATRIX: {
+    gsl_matrix_short *m = (gsl_matrix_short*)x->data.mat.p;
+    return m->size1*m->size2;
+  }
+  case EXPR::BMATRIX: {
+    gsl_matrix_uchar *m = (gsl_matrix_uchar*)x->data.mat.p;
+    return m->size1*m->size2;
+  }
 #endif
+  case EXPR::SDMATRIX:
+  case EXPR::SIMATRIX: {
+    sparse_matrix *m = (sparse_matrix*)x->data.mat.p;
+    return m->size1*m->size2;
+  }
   default:
     return 0;
   }
@@ -4101,7 +4689,28 @@ pure_expr *matrix_dim(pure_expr *x)
     gsl_matrix_int *m = (gsl_matrix_int*)x->data.mat.p;
     return pure_tuplel(2, pure_int(m->size1), pure_int(m->size2));
   }
+  case EXPR::FMATRIX: {
+    gsl_matrix_float *m = (gsl_matrix_float*)x->data.mat.p;
+    return pure_tuplel(2, pure_int(m->size1), pure_int(m->size2));
+  }
+  case EXPR::LMATRIX: {
+    gsl_matrix_int64 *m = (gsl_matrix_int64*)x->data.mat.p;
+    return pure_tuplel(2, pure_int(m->size1), pure_int(m->size2));
+  }
+  case EXPR::HMATRIX: {
+    gsl_matrix_short *m = (gsl_matrix_short*)x->data.mat.p;
+    return pure_tuplel(2, pure_int(m->size1), pure_int(m->size2));
+  }
+  case EXPR::BMATRIX: {
+    gsl_matrix_uchar *m = (gsl_matrix_uchar*)x->data.mat.p;
+    return pure_tuplel(2, pure_int(m->size1), pure_int(m->size2));
+  }
 #endif
+  case EXPR::SDMATRIX:
+  case EXPR::SIMATRIX: {
+    sparse_matrix *m = (sparse_matrix*)x->data.mat.p;
+    return pure_tuplel(2, pure_int(m->size1), pure_int(m->size2));
+  }
   default:
     return 0;
   }
@@ -4128,12 +4737,33 @@ uint32_t matrix_stride(pure_expr *x)
     gsl_matrix_int *m = (gsl_matrix_int*)x->data.mat.p;
     return m->tda;
   }
+  case EXPR::FMATRIX: {
+    gsl_matrix_float *m = (gsl_matrix_float*)x->data.mat.p;
+    return m->tda;
+  }
+  case EXPR::LMATRIX: {
+    gsl_matrix_int64 *m = (gsl_matrix_int64*)x->data.mat.p;
+    return m->tda;
+  }
+  case EXPR::HMATRIX: {
+    gsl_matrix_short *m = (gsl_matrix_short*)x->data.mat.p;
+    return m->tda;
+  }
+  case EXPR::BMATRIX: {
+    gsl_matrix_uchar *m = (gsl_matrix_uchar*)x->data.mat.p;
+    return m->tda;
+  }
 #endif
   default:
     return 0;
   }
 }
 
+static inline bool is_dense_matrix(pure_expr *x)
+{
+  return ((uint32_t)x->tag&0xfffffff0) == (uint32_t)EXPR::MATRIX;
+}
+
 extern "C"
 int32_t matrix_type(pure_expr *x)
 {
@@ -4141,10 +4771,20 @@ int32_t matrix_type(pure_expr *x)
   if ((t&0xfffffff0) == (uint32_t)EXPR::MATRIX)
     // the lowest nibble is the subtype tag
     return (int32_t)(t&0xf);
+  else if (x->tag == EXPR::SDMATRIX)
+    return 0x11;
+  else if (x->tag == EXPR::SIMATRIX)
+    return 0x13;
   else
     return -1;
 }
 
+// an int64 value as an int, or a bigint if it doesn't fit into an int
+static inline pure_expr *int64_value(int64_t r)
+{
+  return (r == (int64_t)(int)r)?pure_int((int)r):pure_long(r);
+}
+
 extern "C"
 pure_expr *matrix_elem_at(pure_expr *x, int32_t _i)
 {
@@ -4184,6 +4824,38 @@ pure_expr *matrix_elem_at(pure_expr *x, int32_t _i)
     } else
       return pure_int(m->data[_i]);
   }
+  case EXPR::FMATRIX: {
+    gsl_matrix_float *m = (gsl_matrix_float*)x->data.mat.p;
+    if (m->tda > m->size2) {
+      const size_t i = _i/m->size2, j = _i%m->size2, k = i*m->tda+j;
+      return pure_double(m->data[k]);
+    } else
+      return pure_double(m->data[_i]);
+  }
+  case EXPR::LMATRIX: {
+    gsl_matrix_int64 *m = (gsl_matrix_int64*)x->data.mat.p;
+    if (m->tda > m->size2) {
+      const size_t i = _i/m->size2, j = _i%m->size2, k = i*m->tda+j;
+      return int64_value(m->data[k]);
+    } else
+      return int64_value(m->data[_i]);
+  }
+  case EXPR::HMATRIX: {
+    gsl_matrix_short *m = (gsl_matrix_short*)x->data.mat.p;
+    if (m->tda > m->size2) {
+      const size_t i = _i/m->size2, j = _i%m->size2, k = i*m->tda+j;
+      return pure_int(m->data[k]);
+    } else
+      return pure_int(m->data[_i]);
+  }
+  case EXPR::BMATRIX: {
+    gsl_matrix_uchar *m = (gsl_matrix_uchar*)x->data.mat.p;
+    if (m->tda > m->size2) {
+      const size_t i = _i/m->size2, j = _i%m->size2, k = i*m->tda+j;
+      return pure_int(m->data[k]);
+    } else
+      return pure_int(m->data[_i]);
+  }
 #endif
   default:
     return 0;
@@ -4215,6 +4887,26 @@ pure_expr *matrix_elem_at2(pure_expr *x, int32_t i, int32_t j)
     const size_t k = i*m->tda+j;
     return pure_int(m->data[k]);
   }
+  case EXPR::FMATRIX: {
+    gsl_matrix_float *m = (gsl_matrix_float*)x->data.mat.p;
+    const size_t k = i*m->tda+j;
+    return pure_double(m->data[k]);
+  }
+  case EXPR::LMATRIX: {
+    gsl_matrix_int64 *m = (gsl_matrix_int64*)x->data.mat.p;
+    const size_t k = i*m->tda+j;
+    return int64_value(m->data[k]);
+  }
+  case EXPR::HMATRIX: {
+    gsl_matrix_short *m = (gsl_matrix_short*)x->data.mat.p;
+    const size_t k = i*m->tda+j;
+    return pure_int(m->data[k]);
+  }
+  case EXPR::BMATRIX: {
+    gsl_matrix_uchar *m = (gsl_matrix_uchar*)x->data.mat.p;
+    const size_t k = i*m->tda+j;
+    return pure_int(m->data[k]);
+  }
 #endif
   default:
     return 0;
@@ -4297,6 +4989,78 @@ pure_expr *matrix_slice(pure_expr *x, int32_t i1, int32_t j1,
     p = m1;
     break;
   }
+  case EXPR::FMATRIX: {
+    gsl_matrix_float *m = (gsl_matrix_float*)x->data.mat.p;
+    if (i2 >= (int)m->size1) i2 = m->size1-1;
+    if (j2 >= (int)m->size2) j2 = m->size2-1;
+    size_t n1 = (i1<(int)m->size1 && i2>=i1)?(i2+1-i1):0,
+      n2 = (j1<(int)m->size2 && j2>=j1)?(j2+1-j1):0;
+    if (n1 == 0 || n2 == 0) // empty matrix
+      return pure_float_matrix(create_float_matrix(n1, n2));
+    gsl_matrix_float_view v =
+      gsl_matrix_float_submatrix(m, i1, j1, n1, n2);
+    // take a copy of the view matrix
+    gsl_matrix_float *m1 =
+      (gsl_matrix_float*)malloc(sizeof(gsl_matrix_float));
+    assert(m1 && v.matrix.data);
+    *m1 = v.matrix;
+    p = m1;
+    break;
+  }
+  case EXPR::LMATRIX: {
+    gsl_matrix_int64 *m = (gsl_matrix_int64*)x->data.mat.p;
+    if (i2 >= (int)m->size1) i2 = m->size1-1;
+    if (j2 >= (int)m->size2) j2 = m->size2-1;
+    size_t n1 = (i1<(int)m->size1 && i2>=i1)?(i2+1-i1):0,
+      n2 = (j1<(int)m->size2 && j2>=j1)?(j2+1-j1):0;
+    if (n1 == 0 || n2 == 0) // empty matrix
+      return pure_int64_matrix(create_int64_matrix(n1, n2));
+    gsl_matrix_int64_view v =
+      gsl_matrix_int64_submatrix(m, i1, j1, n1, n2);
+    // take a copy of the view matrix
+    gsl_matrix_int64 *m1 =
+      (gsl_matrix_int64*)malloc(sizeof(gsl_matrix_int64));
+    assert(m1 && v.matrix.data);
+    *m1 = v.matrix;
+    p = m1;
+    break;
+  }
+  case EXPR::HMATRIX: {
+    gsl_matrix_short *m = (gsl_matrix_short*)x->data.mat.p;
+    if (i2 >= (int)m->size1) i2 = m->size1-1;
+    if (j2 >= (int)m->size2) j2 = m->size2-1;
+    size_t n1 = (i1<(int)m->size1 && i2>=i1)?(i2+1-i1):0,
+      n2 = (j1<(int)m->size2 && j2>=j1)?(j2+1-j1):0;
+    if (n1 == 0 || n2 == 0) // empty matrix
+      return pure_short_matrix(create_short_matrix(n1, n2));
+    gsl_matrix_short_view v =
+      gsl_matrix_short_submatrix(m, i1, j1, n1, n2);
+    // take a copy of the view matrix
+    gsl_matrix_short *m1 =
+      (gsl_matrix_short*)malloc(sizeof(gsl_matrix_short));
+    assert(m1 && v.matrix.data);
+    *m1 = v.matrix;
+    p = m1;
+    break;
+  }
+  case EXPR::BMATRIX: {
+    gsl_matrix_uchar *m = (gsl_matrix_uchar*)x->data.mat.p;
+    if (i2 >= (int)m->size1) i2 = m->size1-1;
+    if (j2 >= (int)m->size2) j2 = m->size2-1;
+    size_t n1 = (i1<(int)m->size1 && i2>=i1)?(i2+1-i1):0,
+      n2 = (j1<(int)m->size2 && j2>=j1)?(j2+1-j1):0;
+    if (n1 == 0 || n2 == 0) // empty matrix
+      return pure_byte_matrix(create_byte_matrix(n1, n2));
+    gsl_matrix_uchar_view v =
+      gsl_matrix_uchar_submatrix(m, i1, j1, n1, n2);
+    // take a copy of the view matrix
+    gsl_matrix_uchar *m1 =
+      (gsl_matrix_uchar*)malloc(sizeof(gsl_matrix_uchar));
+    assert(m1 && v.matrix.data);
+    *m1 = v.matrix;
+    p = m1;
+    break;
+  }
 #endif
   default:
     return 0;
@@ -4563,23 +5327,119 @@ pure_expr *matrix_redim(pure_expr *x, int32_t n, int32_t m)
     }
     break;
   }
-#endif
-  default:
-    return 0;
+  case EXPR::FMATRIX: {
+    gsl_matrix_float *m = (gsl_matrix_float*)x->data.mat.p;
+    if (n1*n2!=m->size1*m->size2) return 0;
+    if (m->tda == (m->size2>0?m->size2:1)) {
+      // No copying necessary, just create a new view of this matrix.
+      gsl_matrix_float *m1 =
+	(gsl_matrix_float*)malloc(sizeof(gsl_matrix_float));
+      assert(m1);
+      *m1 = *m;
+      m1->size1 = n1; m1->tda = m1->size2 = n2;
+      if (m1->tda == 0) m1->tda = 1;
+      p = m1;
+    } else {
+      // Create a packed copy of the matrix.
+      pure_expr *y = matrix_float(x);
+      if (y) {
+	gsl_matrix_float *m = (gsl_matrix_float*)y->data.mat.p;
+	m->size1 = n1; m->tda = m->size2 = n2;
+	if (m->tda == 0) m->tda = 1;
+      }
+      return y;
+    }
+    break;
   }
-  pure_expr *y = new_expr();
-  y->tag = x->tag;
-  y->data.mat.p = p;
-  y->data.mat.refc = x->data.mat.refc;
-  (*y->data.mat.refc)++;
-  MEMDEBUG_NEW(y)
-  return y;
-}
-
-static pure_expr *matrix_rowsv(uint32_t n, pure_expr **xs)
-{
-  int k = -1;
-  size_t nrows = 0, ncols = 0;
+  case EXPR::LMATRIX: {
+    gsl_matrix_int64 *m = (gsl_matrix_int64*)x->data.mat.p;
+    if (n1*n2!=m->size1*m->size2) return 0;
+    if (m->tda == (m->size2>0?m->size2:1)) {
+      // No copying necessary, just create a new view of this matrix.
+      gsl_matrix_int64 *m1 =
+	(gsl_matrix_int64*)malloc(sizeof(gsl_matrix_int64));
+      assert(m1);
+      *m1 = *m;
+      m1->size1 = n1; m1->tda = m1->size2 = n2;
+      if (m1->tda == 0) m1->tda = 1;
+      p = m1;
+    } else {
+      // Create a packed copy of the matrix.
+      pure_expr *y = matrix_int64(x);
+      if (y) {
+	gsl_matrix_int64 *m = (gsl_matrix_int64*)y->data.mat.p;
+	m->size1 = n1; m->tda = m->size2 = n2;
+	if (m->tda == 0) m->tda = 1;
+      }
+      return y;
+    }
+    break;
+  }
+  case EXPR::HMATRIX: {
+    gsl_matrix_short *m = (gsl_matrix_short*)x->data.mat.p;
+    if (n1*n2!=m->size1*m->size2) return 0;
+    if (m->tda == (m->size2>0?m->size2:1)) {
+      // No copying necessary, just create a new view of this matrix.
+      gsl_matrix_short *m1 =
+	(gsl_matrix_short*)malloc(sizeof(gsl_matrix_short));
+      assert(m1);
+      *m1 = *m;
+      m1->size1 = n1; m1->tda = m1->size2 = n2;
+      if (m1->tda == 0) m1->tda = 1;
+      p = m1;
+    } else {
+      // Create a packed copy of the matrix.
+      pure_expr *y = matrix_short(x);
+      if (y) {
+	gsl_matrix_short *m = (gsl_matrix_short*)y->data.mat.p;
+	m->size1 = n1; m->tda = m->size2 = n2;
+	if (m->tda == 0) m->tda = 1;
+      }
+      return y;
+    }
+    break;
+  }
+  case EXPR::BMATRIX: {
+    gsl_matrix_uchar *m = (gsl_matrix_uchar*)x->data.mat.p;
+    if (n1*n2!=m->size1*m->size2) return 0;
+    if (m->tda == (m->size2>0?m->size2:1)) {
+      // No copying necessary, just create a new view of this matrix.
+      gsl_matrix_uchar *m1 =
+	(gsl_matrix_uchar*)malloc(sizeof(gsl_matrix_uchar));
+      assert(m1);
+      *m1 = *m;
+      m1->size1 = n1; m1->tda = m1->size2 = n2;
+      if (m1->tda == 0) m1->tda = 1;
+      p = m1;
+    } else {
+      // Create a packed copy of the matrix.
+      pure_expr *y = matrix_byte(x);
+      if (y) {
+	gsl_matrix_uchar *m = (gsl_matrix_uchar*)y->data.mat.p;
+	m->size1 = n1; m->tda = m->size2 = n2;
+	if (m->tda == 0) m->tda = 1;
+      }
+      return y;
+    }
+    break;
+  }
+#endif
+  default:
+    return 0;
+  }
+  pure_expr *y = new_expr();
+  y->tag = x->tag;
+  y->data.mat.p = p;
+  y->data.mat.refc = x->data.mat.refc;
+  (*y->data.mat.refc)++;
+  MEMDEBUG_NEW(y)
+  return y;
+}
+
+static pure_expr *matrix_rowsv(uint32_t n, pure_expr **xs)
+{
+  int k = -1;
+  size_t nrows = 0, ncols = 0;
   int32_t target = 0;
   bool have_matrix = false;
   pure_expr *x = 0;
@@ -4816,17 +5676,37 @@ pure_expr *matrix_columns(pure_expr *xs)
     return 0;
 }
 
+/* Cache-blocked transpose. The matrix is processed in square tiles which are
+   small enough so that both the source rows and the destination columns of
+   a tile stay in the cache, instead of walking down an entire column of the
+   destination for each source row. */
+
+#define TRANSPOSE_BLOCK 32
+
+#define BLOCKED_TRANSPOSE(T, dest, dtda, src, stda, n, m)		\
+  for (size_t i0 = 0; i0 < n; i0 += TRANSPOSE_BLOCK) {			\
+    const size_t i1 = (n-i0 > TRANSPOSE_BLOCK)?i0+TRANSPOSE_BLOCK:n;	\
+    for (size_t j0 = 0; j0 < m; j0 += TRANSPOSE_BLOCK) {		\
+      const size_t j1 = (m-j0 > TRANSPOSE_BLOCK)?j0+TRANSPOSE_BLOCK:m;	\
+      for (size_t i = i0; i < i1; i++) {				\
+	const T *sp = src+i*stda;					\
+	T *dp = dest+i;							\
+	for (size_t j = j0; j < j1; j++)				\
+	  dp[j*dtda] = sp[j];						\
+      }									\
+    }									\
+  }
+
 extern "C"
 pure_expr *matrix_transpose(pure_expr *x)
 {
   switch (x->tag) {
   case EXPR::MATRIX: {
+    // pure_symbolic_matrix takes care of counting the references
     gsl_matrix_symbolic *m1 = (gsl_matrix_symbolic*)x->data.mat.p;
     size_t n = m1->size1, m = m1->size2;
     gsl_matrix_symbolic *m2 = create_symbolic_matrix(m, n);
-    for (size_t i = 0; i < n; i++)
-      for (size_t j = 0; j < m; j++)
-	m2->data[j*m2->tda+i] = pure_new_internal(m1->data[i*m1->tda+j]);
+    BLOCKED_TRANSPOSE(pure_expr*, m2->data, m2->tda, m1->data, m1->tda, n, m);
     return pure_symbolic_matrix(m2);
   }
 #ifdef HAVE_GSL
@@ -4834,38 +5714,138 @@ pure_expr *matrix_transpose(pure_expr *x)
     gsl_matrix *m1 = (gsl_matrix*)x->data.mat.p;
     size_t n = m1->size1, m = m1->size2;
     gsl_matrix *m2 = create_double_matrix(m, n);
-    for (size_t i = 0; i < n; i++)
-      for (size_t j = 0; j < m; j++)
-	m2->data[j*m2->tda+i] = m1->data[i*m1->tda+j];
+    BLOCKED_TRANSPOSE(double, m2->data, m2->tda, m1->data, m1->tda, n, m);
     return pure_double_matrix(m2);
   }
   case EXPR::CMATRIX: {
+    // move the real and imaginary parts of an element in one go
     gsl_matrix_complex *m1 = (gsl_matrix_complex*)x->data.mat.p;
     size_t n = m1->size1, m = m1->size2;
     gsl_matrix_complex *m2 = create_complex_matrix(m, n);
-    for (size_t i = 0; i < n; i++)
-      for (size_t j = 0; j < m; j++) {
-	size_t k = 2*(i*m1->tda+j), l = 2*(j*m2->tda+i);
-	m2->data[l] = m1->data[k];
-	m2->data[l+1] = m1->data[k+1];
-      }
+    gsl_complex *z1 = (gsl_complex*)m1->data, *z2 = (gsl_complex*)m2->data;
+    BLOCKED_TRANSPOSE(gsl_complex, z2, m2->tda, z1, m1->tda, n, m);
     return pure_complex_matrix(m2);
   }
   case EXPR::IMATRIX: {
     gsl_matrix_int *m1 = (gsl_matrix_int*)x->data.mat.p;
     size_t n = m1->size1, m = m1->size2;
     gsl_matrix_int *m2 = create_int_matrix(m, n);
-    for (size_t i = 0; i < n; i++)
-      for (size_t j = 0; j < m; j++)
-	m2->data[j*m2->tda+i] = m1->data[i*m1->tda+j];
+    BLOCKED_TRANSPOSE(int, m2->data, m2->tda, m1->data, m1->tda, n, m);
     return pure_int_matrix(m2);
   }
+  case EXPR::FMATRIX: {
+    gsl_matrix_float *m1 = (gsl_matrix_float*)x->data.mat.p;
+    size_t n = m1->size1, m = m1->size2;
+    gsl_matrix_float *m2 = create_float_matrix(m, n);
+    BLOCKED_TRANSPOSE(float, m2->data, m2->tda, m1->data, m1->tda, n, m);
+    return pure_float_matrix(m2);
+  }
+  case EXPR::LMATRIX: {
+    gsl_matrix_int64 *m1 = (gsl_matrix_int64*)x->data.mat.p;
+    size_t n = m1->size1, m = m1->size2;
+    gsl_matrix_int64 *m2 = create_int64_matrix(m, n);
+    BLOCKED_TRANSPOSE(int64_t, m2->data, m2->tda, m1->data, m1->tda, n, m);
+    return pure_int64_matrix(m2);
+  }
+  case EXPR::HMATRIX: {
+    gsl_matrix_short *m1 = (gsl_matrix_short*)x->data.mat.p;
+    size_t n = m1->size1, m = m1->size2;
+    gsl_matrix_short *m2 = create_short_matrix(m, n);
+    BLOCKED_TRANSPOSE(short, m2->data, m2->tda, m1->data, m1->tda, n, m);
+    return pure_short_matrix(m2);
+  }
+  case EXPR::BMATRIX: {
+    gsl_matrix_uchar *m1 = (gsl_matrix_uchar*)x->data.mat.p;
+    size_t n = m1->size1, m = m1->size2;
+    gsl_matrix_uchar *m2 = create_byte_matrix(m, n);
+    BLOCKED_TRANSPOSE(unsigned char, m2->data, m2->tda, m1->data, m1->tda,
+		      n, m);
+    return pure_byte_matrix(m2);
+  }
 #endif
   default:
     return 0;
   }
 }
 
+#ifdef HAVE_GSL
+/* Elementwise conversions between the real matrix types. T is the element
+   type of the target matrix. */
+
+template <class T, class M2, class M1>
+static void convert_matrix(M2 *m2, const M1 *m1)
+{
+  const size_t n = m1->size1, m = m1->size2;
+  for (size_t i = 0; i < n; i++) {
+    T *p = m2->data+i*m2->tda;
+    for (size_t j = 0; j < m; j++)
+      p[j] = (T)m1->data[i*m1->tda+j];
+  }
+}
+
+/* Convert a symbolic matrix of ints, bigints and doubles. */
+
+template <class T, class M2>
+static bool convert_symbolic_matrix(M2 *m2, const gsl_matrix_symbolic *m1)
+{
+  const size_t n = m1->size1, m = m1->size2;
+  for (size_t i = 0; i < n; i++) {
+    T *p = m2->data+i*m2->tda;
+    for (size_t j = 0; j < m; j++) {
+      pure_expr *y = m1->data[i*m1->tda+j];
+      switch (y->tag) {
+      case EXPR::INT:
+	p[j] = (T)y->data.i;
+	break;
+      case EXPR::BIGINT:
+	p[j] = (T)pure_get_long(y);
+	break;
+      case EXPR::DBL:
+	p[j] = (T)y->data.d;
+	break;
+      default:
+	return false;
+      }
+    }
+  }
+  return true;
+}
+
+/* Fill m2 with the converted elements of x, which must have the same
+   dimensions. Returns false if x can't be converted (complex matrices, and
+   symbolic matrices with non-numeric elements). */
+
+template <class T, class M2>
+static bool convert_matrix_from(M2 *m2, pure_expr *x)
+{
+  void *p = x->data.mat.p;
+  switch (x->tag) {
+  case EXPR::MATRIX:
+    return convert_symbolic_matrix<T>(m2, (gsl_matrix_symbolic*)p);
+  case EXPR::DMATRIX:
+    convert_matrix<T>(m2, (gsl_matrix*)p);
+    return true;
+  case EXPR::IMATRIX:
+    convert_matrix<T>(m2, (gsl_matrix_int*)p);
+    return true;
+  case EXPR::FMATRIX:
+    convert_matrix<T>(m2, (gsl_matrix_float*)p);
+    return true;
+  case EXPR::LMATRIX:
+    convert_matrix<T>(m2, (gsl_matrix_int64*)p);
+    return true;
+  case EXPR::HMATRIX:
+    convert_matrix<T>(m2, (gsl_matrix_short*)p);
+    return true;
+  case EXPR::BMATRIX:
+    convert_matrix<T>(m2, (gsl_matrix_uchar*)p);
+    return true;
+  default:
+    return false;
+  }
+}
+#endif
+
 extern "C"
 pure_expr *matrix_double(pure_expr *x)
 {
@@ -4895,6 +5875,16 @@ pure_expr *matrix_double(pure_expr *x)
       }
     return pure_double_matrix(m2);
   }
+  case EXPR::FMATRIX:
+  case EXPR::LMATRIX:
+  case EXPR::HMATRIX:
+  case EXPR::BMATRIX: {
+    // the dimensions are at the same place in all matrix structs
+    gsl_matrix *m1 = (gsl_matrix*)x->data.mat.p;
+    gsl_matrix *m2 = create_double_matrix(m1->size1, m1->size2);
+    convert_matrix_from<double>(m2, x);
+    return pure_double_matrix(m2);
+  }
   default:
     return 0;
   }
@@ -4934,6 +5924,15 @@ pure_expr *matrix_complex(pure_expr *x)
   }
   case EXPR::CMATRIX:
     return x;
+  case EXPR::FMATRIX:
+  case EXPR::LMATRIX:
+  case EXPR::HMATRIX:
+  case EXPR::BMATRIX: {
+    // go through a double matrix
+    pure_expr *y = matrix_double(x), *z = matrix_complex(y);
+    pure_freenew(y);
+    return z;
+  }
   default:
     return 0;
   }
@@ -4971,6 +5970,15 @@ pure_expr *matrix_int(pure_expr *x)
       }
     return pure_int_matrix(m2);
   }
+  case EXPR::FMATRIX:
+  case EXPR::LMATRIX:
+  case EXPR::HMATRIX:
+  case EXPR::BMATRIX: {
+    gsl_matrix *m1 = (gsl_matrix*)x->data.mat.p;
+    gsl_matrix_int *m2 = create_int_matrix(m1->size1, m1->size2);
+    convert_matrix_from<int>(m2, x);
+    return pure_int_matrix(m2);
+  }
   default:
     return 0;
   }
@@ -4979,6 +5987,78 @@ pure_expr *matrix_int(pure_expr *x)
 #endif
 }
 
+extern "C"
+pure_expr *matrix_float(pure_expr *x)
+{
+#ifdef HAVE_GSL
+  if (!is_dense_matrix(x)) return 0;
+  gsl_matrix *m1 = (gsl_matrix*)x->data.mat.p;
+  gsl_matrix_float *m2 = create_float_matrix(m1->size1, m1->size2);
+  if (!m2) return 0;
+  if (!convert_matrix_from<float>(m2, x)) {
+    gsl_matrix_float_free(m2);
+    return 0;
+  }
+  return pure_float_matrix(m2);
+#else
+  return 0;
+#endif
+}
+
+extern "C"
+pure_expr *matrix_int64(pure_expr *x)
+{
+#ifdef HAVE_GSL
+  if (!is_dense_matrix(x)) return 0;
+  gsl_matrix *m1 = (gsl_matrix*)x->data.mat.p;
+  gsl_matrix_int64 *m2 = create_int64_matrix(m1->size1, m1->size2);
+  if (!m2) return 0;
+  if (!convert_matrix_from<int64_t>(m2, x)) {
+    gsl_matrix_int64_free(m2);
+    return 0;
+  }
+  return pure_int64_matrix(m2);
+#else
+  return 0;
+#endif
+}
+
+extern "C"
+pure_expr *matrix_short(pure_expr *x)
+{
+#ifdef HAVE_GSL
+  if (!is_dense_matrix(x)) return 0;
+  gsl_matrix *m1 = (gsl_matrix*)x->data.mat.p;
+  gsl_matrix_short *m2 = create_short_matrix(m1->size1, m1->size2);
+  if (!m2) return 0;
+  if (!convert_matrix_from<short>(m2, x)) {
+    gsl_matrix_short_free(m2);
+    return 0;
+  }
+  return pure_short_matrix(m2);
+#else
+  return 0;
+#endif
+}
+
+extern "C"
+pure_expr *matrix_byte(pure_expr *x)
+{
+#ifdef HAVE_GSL
+  if (!is_dense_matrix(x)) return 0;
+  gsl_matrix *m1 = (gsl_matrix*)x->data.mat.p;
+  gsl_matrix_uchar *m2 = create_byte_matrix(m1->size1, m1->size2);
+  if (!m2) return 0;
+  if (!convert_matrix_from<unsigned char>(m2, x)) {
+    gsl_matrix_uchar_free(m2);
+    return 0;
+  }
+  return pure_byte_matrix(m2);
+#else
+  return 0;
+#endif
+}
+
 extern "C"
 pure_expr *matrix_re(pure_expr *x)
 {
@@ -5764,657 +6844,5652 @@ void *matrix_to_byte_array(void *p, pure_expr *x)
 #endif
 }
 
-static uint32_t mpz_hash(const mpz_t z)
+/* Copy-on-write updates of matrices (see matrices.pure). If neither the
+   matrix expression nor its data is shared (both have a reference count of
+   1, which is the case if the matrix is a temporary which is passed directly
+   to one of these operations), the elements are modified in place and the
+   same matrix is returned. Otherwise the operations work on a copy. A
+   numeric matrix is converted to the type needed to hold the new values
+   (int -> double -> complex -> symbolic) along the way. Views of
+   memory-mapped files are never modified in place. Short and byte matrices
+   are always widened to int, float matrices to double, and int64 matrices
+   to symbolic matrices (which keep the values exact). */
+
+// rank of the matrix types in the conversion order above
+static inline int matrix_rank(int32_t tag)
 {
-  uint32_t h = 0;
-  int i, len = z->_mp_size;
-  if (len < 0) len = -len;
-  if (sizeof(mp_limb_t) == 8) {
-    for (i=0; i<len; i++) {
-      h ^= (uint32_t)(uint64_t)z->_mp_d[i];
-      h ^= (uint32_t)(((uint64_t)z->_mp_d[i])>>32);
-    }
-  } else {
-    for (i=0; i<len; i++)
-      h ^= z->_mp_d[i];
+  switch (tag) {
+  case EXPR::IMATRIX:
+  case EXPR::HMATRIX:
+  case EXPR::BMATRIX: return 0;
+  case EXPR::DMATRIX:
+  case EXPR::FMATRIX: return 1;
+  case EXPR::CMATRIX: return 2;
+  default: return 3;
   }
-  if (z->_mp_size < 0)
-    h = -h;
-  return h;
 }
 
-static uint32_t double_hash(double d)
+static const int32_t matrix_rank_tag[] =
+  { EXPR::IMATRIX, EXPR::DMATRIX, EXPR::CMATRIX, EXPR::MATRIX };
+
+// rank of the matrix type needed to store the value y
+static inline int matrix_value_rank(pure_expr *y)
 {
-  uint32_t h;
-  char *c;
-  size_t i;
-  c = (char*)&d;
-  for (h=0, i=0; i<sizeof(double); i++) {
-    h += c[i] * 971;
+#ifdef HAVE_GSL
+  double a, b;
+  switch (y->tag) {
+  case EXPR::INT: return 0;
+  case EXPR::DBL: return 1;
+  default: return get_complex(y, a, b)?2:3;
   }
-  return h;
+#else
+  return 3;
+#endif
 }
 
-static uint32_t string_hash(char *s)
+static inline bool matrix_unshared(pure_expr *x)
 {
-  uint32_t h = 0, g;
-  while (*s) {
-    h = (h<<4)+*(s++);
-    if ((g = (h & 0xf0000000)))	{
-      h = h^(g>>24);
-      h = h^g;
-    }
+  return x->refc == 1 && *x->data.mat.refc == 1 &&
+    (mmap_views.empty() ||
+     mmap_views.find(x->data.mat.refc) == mmap_views.end());
+}
+
+/* Return a matrix of the given type with the same elements as x, which can
+   be modified in place. This is either x itself or a new matrix. */
+
+static pure_expr *matrix_writable(pure_expr *x, int32_t tag)
+{
+  if (tag == x->tag)
+    if (matrix_unshared(x))
+      return x;
+    else
+      switch (tag) {
+      case EXPR::MATRIX:
+	return pure_symbolic_matrix_dup(x->data.mat.p);
+#ifdef HAVE_GSL
+      case EXPR::DMATRIX:
+	return pure_double_matrix_dup(x->data.mat.p);
+      case EXPR::CMATRIX:
+	return pure_complex_matrix_dup(x->data.mat.p);
+      case EXPR::IMATRIX:
+	return pure_int_matrix_dup(x->data.mat.p);
+#endif
+      default:
+	return 0;
+      }
+  switch (tag) {
+#ifdef HAVE_GSL
+  case EXPR::IMATRIX:
+    return matrix_int(x);
+  case EXPR::DMATRIX:
+    return matrix_double(x);
+  case EXPR::CMATRIX:
+    return matrix_complex(x);
+#endif
+  case EXPR::MATRIX: {
+    // pure_symbolic_matrix takes care of counting the references
+    gsl_matrix *m1 = (gsl_matrix*)x->data.mat.p;
+    const size_t n = m1->size1, m = m1->size2;
+    gsl_matrix_symbolic *m2 = create_symbolic_matrix(n, m);
+    if (!m2) return 0;
+    for (size_t i = 0; i < n; i++)
+      for (size_t j = 0; j < m; j++)
+	m2->data[i*m2->tda+j] = matrix_elem_at2(x, i, j);
+    return pure_symbolic_matrix(m2);
+  }
+  default:
+    return 0;
   }
-  return h;
 }
 
-extern "C"
-uint32_t hash(pure_expr *x)
+/* Store y at the given offset k (in elements, taking into account the
+   stride) of a matrix which is known to be able to hold y. */
+
+static void matrix_store(pure_expr *x, size_t k, pure_expr *y)
 {
-  char test;
-  if (is_thunk(x)) pure_force(x);
   switch (x->tag) {
-  case EXPR::INT:
-    return (uint32_t)x->data.i;
-  case EXPR::BIGINT:
-    return mpz_hash(x->data.z);
-  case EXPR::DBL:
-    return double_hash(x->data.d);
-  case EXPR::STR:
-    return string_hash(x->data.s);
-  case EXPR::PTR:
-#if SIZEOF_VOID_P==8
-    return ((uint32_t)(uint64_t)x->data.p) ^ ((uint32_t)(((uint64_t)x->data.p)>>32));
-#else
-    return (uint32_t)x->data.p;
-#endif
-  case EXPR::APP: {
-    checkstk(test);
-    int h;
-    h = hash(x->data.x[0]);
-    h = (h<<1) | (h<0 ? 1 : 0);
-    h ^= hash(x->data.x[1]);
-    return (uint32_t)h;
+  case EXPR::MATRIX: {
+    gsl_matrix_symbolic *m = (gsl_matrix_symbolic*)x->data.mat.p;
+    pure_expr *old = m->data[k];
+    m->data[k] = pure_new_internal(y);
+    pure_free_internal(old);
+    break;
+  }
+#ifdef HAVE_GSL
+  case EXPR::DMATRIX: {
+    gsl_matrix *m = (gsl_matrix*)x->data.mat.p;
+    m->data[k] = (y->tag == EXPR::INT)?(double)y->data.i:y->data.d;
+    break;
   }
+  case EXPR::CMATRIX: {
+    gsl_matrix_complex *m = (gsl_matrix_complex*)x->data.mat.p;
+    double a = 0.0, b = 0.0;
+    if (y->tag == EXPR::INT)
+      a = (double)y->data.i;
+    else if (y->tag == EXPR::DBL)
+      a = y->data.d;
+    else
+      get_complex(y, a, b);
+    m->data[2*k] = a; m->data[2*k+1] = b;
+    break;
+  }
+  case EXPR::IMATRIX: {
+    gsl_matrix_int *m = (gsl_matrix_int*)x->data.mat.p;
+    m->data[k] = y->data.i;
+    break;
+  }
+#endif
   default:
-    return (uint32_t)x->tag;
+    break;
   }
 }
 
 extern "C"
-bool same(pure_expr *x, pure_expr *y)
+pure_expr *matrix_update(pure_expr *x, int32_t i, pure_expr *y)
 {
-  char test;
-  if (x == y)
-    return 1;
-  if (is_thunk(x)) pure_force(x);
-  if (is_thunk(y)) pure_force(y);
-  if (x->tag != y->tag)
-    return 0;
-  else if (x->tag >= 0 && y->tag >= 0)
-    if (x->data.clos && y->data.clos)
-      /* Note that for global functions the function pointers may differ in
-	 some cases (specifically in the case of an external which may chain
-	 to a Pure definition of the same global). However, in that case we
-	 may safely assume that the functions are the same anyway, since they
-	 are referred to by the same global symbol. */
-      return !x->data.clos->local && !y->data.clos->local ||
-	x->data.clos->fp == y->data.clos->fp;
-    else
-      return x->data.clos == y->data.clos;
-  else {
-    switch (x->tag) {
-    case EXPR::APP: {
-      checkstk(test);
-      return same(x->data.x[0], y->data.x[0]) &&
-	same(x->data.x[1], y->data.x[1]);
-    }
-    case EXPR::INT:
-      return x->data.i == y->data.i;
-    case EXPR::BIGINT:
-      return mpz_cmp(x->data.z, y->data.z) == 0;
-    case EXPR::DBL:
-      return x->data.d == y->data.d || is_nan(x->data.d) && is_nan(y->data.d);
-    case EXPR::STR:
-      return strcmp(x->data.s, y->data.s) == 0;
-    case EXPR::PTR:
-      return x->data.p == y->data.p;
+  if (!is_dense_matrix(x)) return 0;
+  gsl_matrix *m = (gsl_matrix*)x->data.mat.p;
+  if (i < 0 || (size_t)i >= m->size1*m->size2) return 0;
+  int r = max(matrix_rank(x->tag), matrix_value_rank(y));
+  pure_expr *z = matrix_writable(x, matrix_rank_tag[r]);
+  if (!z) return 0;
+  m = (gsl_matrix*)z->data.mat.p;
+  matrix_store(z, (i/m->size2)*m->tda+i%m->size2, y);
+  return z;
+}
+
+extern "C"
+pure_expr *matrix_update2(pure_expr *x, int32_t i, int32_t j, pure_expr *y)
+{
+  if (!is_dense_matrix(x)) return 0;
+  gsl_matrix *m = (gsl_matrix*)x->data.mat.p;
+  if (i < 0 || (size_t)i >= m->size1 || j < 0 || (size_t)j >= m->size2)
+    return 0;
+  int r = max(matrix_rank(x->tag), matrix_value_rank(y));
+  pure_expr *z = matrix_writable(x, matrix_rank_tag[r]);
+  if (!z) return 0;
+  m = (gsl_matrix*)z->data.mat.p;
+  matrix_store(z, i*m->tda+j, y);
+  return z;
+}
+
+extern "C"
+pure_expr *matrix_fill(pure_expr *x, pure_expr *y)
+{
+  if (!is_dense_matrix(x)) return 0;
+  // all elements get replaced, so only the type of y matters here
+  const int32_t tag = matrix_rank_tag[matrix_value_rank(y)];
+  pure_expr *z = x;
+  gsl_matrix *m = (gsl_matrix*)x->data.mat.p;
+  const size_t n = m->size1, k = m->size2;
+  if (tag != x->tag || !matrix_unshared(x)) {
+    switch (tag) {
     case EXPR::MATRIX: {
-      gsl_matrix_symbolic *m1 = (gsl_matrix_symbolic*)x->data.mat.p;
-      gsl_matrix_symbolic *m2 = (gsl_matrix_symbolic*)y->data.mat.p;
-      const size_t tda1 = m1->tda, tda2 = m2->tda;
-      if (m1->size1 != m2->size1 || m1->size2 != m2->size2)
-	return 0;
-      checkstk(test);
-      for (size_t i = 0; i < m1->size1; i++)
-	for (size_t j = 0; j < m1->size2; j++)
-	  if (!same(m1->data[i*tda1+j], m2->data[i*tda2+j]))
-	    return 0;
-      return 1;
+      gsl_matrix_symbolic *m1 = create_symbolic_matrix(n, k);
+      if (!m1) return 0;
+      for (size_t i = 0; i < n; i++)
+	for (size_t j = 0; j < k; j++)
+	  m1->data[i*m1->tda+j] = y;
+      return pure_symbolic_matrix(m1);
     }
 #ifdef HAVE_GSL
     case EXPR::DMATRIX: {
-      gsl_matrix *m1 = (gsl_matrix*)x->data.mat.p;
-      gsl_matrix *m2 = (gsl_matrix*)y->data.mat.p;
-      const size_t tda1 = m1->tda, tda2 = m2->tda;
-      if (m1->size1 != m2->size1 || m1->size2 != m2->size2)
-	return 0;
-      for (size_t i = 0; i < m1->size1; i++)
-	for (size_t j = 0; j < m1->size2; j++)
-	  if (m1->data[i*tda1+j] != m2->data[i*tda2+j])
-	    return 0;
-      return 1;
+      gsl_matrix *m1 = create_double_matrix(n, k);
+      z = m1?pure_double_matrix(m1):0;
+      break;
     }
     case EXPR::CMATRIX: {
-      gsl_matrix_complex *m1 = (gsl_matrix_complex*)x->data.mat.p;
-      gsl_matrix_complex *m2 = (gsl_matrix_complex*)y->data.mat.p;
-      const size_t tda1 = m1->tda, tda2 = m2->tda;
-      if (m1->size1 != m2->size1 || m1->size2 != m2->size2)
-	return 0;
-      for (size_t i = 0; i < m1->size1; i++)
-	for (size_t j = 0; j < m1->size2; j++) {
-	  const size_t k1 = 2*(i*tda1+j), k2 = 2*(i*tda2+j);
-	  if (m1->data[k1] != m2->data[k2] ||
-	      m1->data[k1+1] != m2->data[k2+1])
-	    return 0;
-	}
-      return 1;
+      gsl_matrix_complex *m1 = create_complex_matrix(n, k);
+      z = m1?pure_complex_matrix(m1):0;
+      break;
     }
     case EXPR::IMATRIX: {
-      gsl_matrix_int *m1 = (gsl_matrix_int*)x->data.mat.p;
-      gsl_matrix_int *m2 = (gsl_matrix_int*)y->data.mat.p;
-      const size_t tda1 = m1->tda, tda2 = m2->tda;
-      if (m1->size1 != m2->size1 || m1->size2 != m2->size2)
-	return 0;
-      for (size_t i = 0; i < m1->size1; i++)
-	for (size_t j = 0; j < m1->size2; j++)
-	  if (m1->data[i*tda1+j] != m2->data[i*tda2+j])
-	    return 0;
-      return 1;
+      gsl_matrix_int *m1 = create_int_matrix(n, k);
+      z = m1?pure_int_matrix(m1):0;
+      break;
     }
 #endif
     default:
-      return 1;
+      return 0;
     }
+    if (!z) return 0;
+    m = (gsl_matrix*)z->data.mat.p;
   }
+  for (size_t i = 0; i < n; i++)
+    for (size_t j = 0; j < k; j++)
+      matrix_store(z, i*m->tda+j, y);
+  return z;
 }
 
 extern "C"
-bool funp(const pure_expr *x)
+pure_expr *matrix_scatter(pure_expr *x, pure_expr *is, pure_expr *ys)
 {
-  return (x->tag > 0 && x->data.clos);
+  if (!is_dense_matrix(x) || !is_dense_matrix(is) || !is_dense_matrix(ys))
+    return 0;
+  const size_t l = matrix_size(is);
+  if (l == 0) return x;
+  if (is->tag != EXPR::IMATRIX || matrix_size(ys) != l) return 0;
+#ifdef HAVE_GSL
+  gsl_matrix *m = (gsl_matrix*)x->data.mat.p;
+  gsl_matrix_int *mi = (gsl_matrix_int*)is->data.mat.p;
+  const size_t n = m->size1*m->size2, k = mi->size2;
+  // check the indices first, so that we don't modify x if one is bad
+  for (size_t i = 0; i < l; i++) {
+    const int idx = mi->data[(i/k)*mi->tda+i%k];
+    if (idx < 0 || (size_t)idx >= n) return 0;
+  }
+  int r = matrix_rank(x->tag);
+  if (ys->tag == EXPR::MATRIX)
+    // symbolic values, find the type of the result
+    for (size_t i = 0; i < l && r < 3; i++)
+      r = max(r, matrix_value_rank(matrix_elem_at(ys, i)));
+  else
+    r = max(r, matrix_rank(ys->tag));
+  pure_expr *z = matrix_writable(x, matrix_rank_tag[r]);
+  if (!z) return 0;
+  m = (gsl_matrix*)z->data.mat.p;
+  const size_t cols = m->size2;
+  const bool direct = z->tag == ys->tag && z->tag != EXPR::MATRIX;
+  for (size_t i = 0; i < l; i++) {
+    const size_t idx = mi->data[(i/k)*mi->tda+i%k];
+    const size_t off = (idx/cols)*m->tda+idx%cols;
+    if (direct) {
+      // same numeric type, copy the element directly
+      gsl_matrix *my = (gsl_matrix*)ys->data.mat.p;
+      const size_t ky = my->size2, offy = (i/ky)*my->tda+i%ky;
+      switch (z->tag) {
+      case EXPR::DMATRIX:
+	m->data[off] = my->data[offy];
+	break;
+      case EXPR::CMATRIX: {
+	double *p = ((gsl_matrix_complex*)m)->data,
+	  *q = ((gsl_matrix_complex*)my)->data;
+	p[2*off] = q[2*offy]; p[2*off+1] = q[2*offy+1];
+	break;
+      }
+      case EXPR::IMATRIX:
+	((gsl_matrix_int*)m)->data[off] = ((gsl_matrix_int*)my)->data[offy];
+	break;
+      }
+    } else {
+      pure_expr *y = matrix_elem_at(ys, i);
+      matrix_store(z, off, y);
+      pure_freenew(y);
+    }
+  }
+  return z;
+#else
+  return 0;
+#endif
+}
+
+/* Native map, zipwith and fold operations on matrices (see matrices.pure).
+   These access the matrix elements directly, instead of converting the
+   matrix to a list first. The results of map and zipwith are stored in a
+   numeric matrix as long as they are all ints, all doubles or all complex
+   values in rectangular double format. When a value of a different type
+   shows up, the values collected so far are moved to a symbolic matrix, and
+   the result is then constructed with matrix_columnsv, just as colcat would
+   do it. The result is always a row vector, matrices.pure takes care of
+   reshaping it. The partial result is kept on the shadow stack while we
+   call back into Pure, so that it gets collected if an exception is
+   raised. */
+
+struct matrix_builder {
+  size_t n, k;			// size of the result, number of values so far
+  size_t slot;			// shadow stack slot of the partial result
+  pure_expr *x;			// partial result (0 if no values yet)
+};
+
+static inline bool is_rect_double(pure_expr *x)
+{
+  if (x->tag != EXPR::APP || x->data.x[1]->tag != EXPR::DBL) return false;
+  pure_expr *u = x->data.x[0];
+  if (u->tag != EXPR::APP || u->data.x[1]->tag != EXPR::DBL) return false;
+  symbol *rect = interpreter::g_interp->symtab.complex_rect_sym();
+  return rect && u->data.x[0]->tag == rect->f;
+}
+
+static bool matrix_builder_add(matrix_builder& b, pure_expr *y)
+{
+  interpreter& interp = *interpreter::g_interp;
+  if (!b.x) {
+    // first value, this determines the type of the result
+    pure_expr *x = 0;
+    switch (y->tag) {
+#ifdef HAVE_GSL
+    case EXPR::INT: {
+      gsl_matrix_int *m = create_int_matrix(1, b.n);
+      if (m) x = pure_int_matrix(m);
+      break;
+    }
+    case EXPR::DBL: {
+      gsl_matrix *m = create_double_matrix(1, b.n);
+      if (m) x = pure_double_matrix(m);
+      break;
+    }
+#endif
+    default:
+#ifdef HAVE_GSL
+      if (is_rect_double(y)) {
+	gsl_matrix_complex *m = create_complex_matrix(1, b.n);
+	if (m) x = pure_complex_matrix(m);
+      } else
+#endif
+      {
+	gsl_matrix_symbolic *m = create_symbolic_matrix(1, b.n);
+	if (m) {
+	  m->size2 = 0;
+	  x = pure_symbolic_matrix(m);
+	}
+      }
+      break;
+    }
+    if (!x) {
+      pure_freenew(y);
+      return false;
+    }
+    b.x = pure_new_internal(x);
+    b.slot = interp.sstk_sz;
+    resize_sstk(interp.sstk, interp.sstk_cap, interp.sstk_sz, 1);
+    interp.sstk[interp.sstk_sz++] = b.x;
+  }
+  switch (b.x->tag) {
+  case EXPR::MATRIX: {
+    gsl_matrix_symbolic *m = (gsl_matrix_symbolic*)b.x->data.mat.p;
+    m->data[b.k++] = pure_new_internal(y);
+    m->size2 = b.k;
+    return true;
+  }
+#ifdef HAVE_GSL
+  case EXPR::DMATRIX:
+    if (y->tag == EXPR::DBL) {
+      gsl_matrix *m = (gsl_matrix*)b.x->data.mat.p;
+      m->data[b.k++] = y->data.d;
+      pure_freenew(y);
+      return true;
+    }
+    break;
+  case EXPR::CMATRIX:
+    if (is_rect_double(y)) {
+      gsl_matrix_complex *m = (gsl_matrix_complex*)b.x->data.mat.p;
+      m->data[2*b.k] = y->data.x[0]->data.x[1]->data.d;
+      m->data[2*b.k+1] = y->data.x[1]->data.d;
+      b.k++;
+      pure_freenew(y);
+      return true;
+    }
+    break;
+  case EXPR::IMATRIX:
+    if (y->tag == EXPR::INT) {
+      gsl_matrix_int *m = (gsl_matrix_int*)b.x->data.mat.p;
+      m->data[b.k++] = y->data.i;
+      pure_freenew(y);
+      return true;
+    }
+    break;
+#endif
+  default:
+    break;
+  }
+  // type mismatch, switch to a symbolic matrix
+  gsl_matrix_symbolic *m = create_symbolic_matrix(1, b.n);
+  if (!m) {
+    pure_freenew(y);
+    return false;
+  }
+  for (size_t i = 0; i < b.k; i++)
+    m->data[i] = matrix_elem_at(b.x, i);
+  m->data[b.k++] = y;
+  m->size2 = b.k;
+  // this also counts references on the elements
+  pure_expr *x = pure_new_internal(pure_symbolic_matrix(m));
+  interp.sstk[b.slot] = x;
+  pure_free_internal(b.x);
+  b.x = x;
+  return true;
+}
+
+static pure_expr *matrix_builder_result(matrix_builder& b, bool ok = true)
+{
+  interpreter& interp = *interpreter::g_interp;
+  if (!b.x) return ok?matrix_columnsv(0, 0):0;
+  pure_expr *y = 0;
+  if (ok) {
+    if (b.x->tag == EXPR::MATRIX) {
+      gsl_matrix_symbolic *m = (gsl_matrix_symbolic*)b.x->data.mat.p;
+      y = matrix_columnsv(b.k, m->data);
+    } else
+      y = b.x;
+  }
+  if (y) pure_new_internal(y);
+  assert(b.slot == interp.sstk_sz-1 && interp.sstk[b.slot] == b.x);
+  interp.sstk_sz--;
+  pure_free_internal(b.x);
+  if (y) pure_unref_internal(y);
+  return y;
 }
 
 extern "C"
-bool lambdap(const pure_expr *x)
+pure_expr *matrix_map(pure_expr *f, pure_expr *x)
 {
-  return (x->tag == 0 && x->data.clos && x->data.clos->n > 0);
+  matrix_builder b = { matrix_size(x), 0, 0, 0 };
+  for (size_t i = 0; i < b.n; i++)
+    if (!matrix_builder_add(b, pure_apply2(f, matrix_elem_at(x, i))))
+      return matrix_builder_result(b, false);
+  return matrix_builder_result(b);
+}
+
+extern "C"
+pure_expr *matrix_zipwith(pure_expr *f, pure_expr *x, pure_expr *y)
+{
+  matrix_builder b = { min(matrix_size(x), matrix_size(y)), 0, 0, 0 };
+  for (size_t i = 0; i < b.n; i++) {
+    pure_expr *u = pure_apply2(pure_apply2(f, matrix_elem_at(x, i)),
+			       matrix_elem_at(y, i));
+    if (!matrix_builder_add(b, u))
+      return matrix_builder_result(b, false);
+  }
+  return matrix_builder_result(b);
+}
+
+extern "C"
+pure_expr *matrix_zipwith3(pure_expr *f, pure_expr *x, pure_expr *y,
+			   pure_expr *z)
+{
+  matrix_builder b =
+    { min(matrix_size(x), min(matrix_size(y), matrix_size(z))), 0, 0, 0 };
+  for (size_t i = 0; i < b.n; i++) {
+    pure_expr *u = pure_apply2(pure_apply2(pure_apply2(f,
+						       matrix_elem_at(x, i)),
+					   matrix_elem_at(y, i)),
+			       matrix_elem_at(z, i));
+    if (!matrix_builder_add(b, u))
+      return matrix_builder_result(b, false);
+  }
+  return matrix_builder_result(b);
+}
+
+/* Helpers for matrix comprehensions (see mkmatcomp_expr in interpreter.cc).
+   These map f over a list or the int range n..m, storing the results in a
+   row vector which is allocated in advance, instead of consing up a list of
+   the results and handing it to colcat. */
+
+extern "C"
+pure_expr *matrix_colcatmap(pure_expr *f, pure_expr *xs)
+{
+  size_t n;
+  if (!pure_is_listv(xs, &n, 0)) return 0;
+  matrix_builder b = { n, 0, 0, 0 };
+  pure_expr *u = xs, *y, *z;
+  while (is_cons(u, y, z)) {
+    if (!matrix_builder_add(b, pure_apply2(f, y)))
+      return matrix_builder_result(b, false);
+    u = z;
+  }
+  return matrix_builder_result(b);
+}
+
+extern "C"
+pure_expr *matrix_rangemap(pure_expr *f, int n, int m)
+{
+  matrix_builder b = { (m>=n)?(size_t)((int64_t)m-n+1):0, 0, 0, 0 };
+  for (size_t i = 0; i < b.n; i++)
+    if (!matrix_builder_add(b, pure_apply2(f, pure_int((int)(n+(int64_t)i)))))
+      return matrix_builder_result(b, false);
+  return matrix_builder_result(b);
+}
+
+extern "C"
+pure_expr *matrix_foldl(pure_expr *f, pure_expr *a, pure_expr *x)
+{
+  for (size_t i = 0, n = matrix_size(x); i < n; i++)
+    a = pure_apply2(pure_apply2(f, a), matrix_elem_at(x, i));
+  return a;
+}
+
+extern "C"
+pure_expr *matrix_foldl1(pure_expr *f, pure_expr *x)
+{
+  size_t n = matrix_size(x);
+  if (n == 0) return 0;
+  pure_expr *a = matrix_elem_at(x, 0);
+  for (size_t i = 1; i < n; i++)
+    a = pure_apply2(pure_apply2(f, a), matrix_elem_at(x, i));
+  return a;
+}
+
+extern "C"
+pure_expr *matrix_foldr(pure_expr *f, pure_expr *a, pure_expr *x)
+{
+  for (size_t i = matrix_size(x); i-- > 0; )
+    a = pure_apply2(pure_apply2(f, matrix_elem_at(x, i)), a);
+  return a;
+}
+
+extern "C"
+pure_expr *matrix_foldr1(pure_expr *f, pure_expr *x)
+{
+  size_t n = matrix_size(x);
+  if (n == 0) return 0;
+  pure_expr *a = matrix_elem_at(x, n-1);
+  for (size_t i = n-1; i-- > 0; )
+    a = pure_apply2(pure_apply2(f, matrix_elem_at(x, i)), a);
+  return a;
+}
+
+/* Elementwise arithmetic and comparisons on numeric matrices (see
+   matrices.pure and math.pure). Each operand is either a matrix or a scalar
+   which gets broadcast over the other operand. Both operands are first
+   converted to a common element type (int, double or complex), then the
+   result is computed row by row. The rows of the operands and the result
+   may have different strides, so that slices of a matrix are handled
+   without packing them first. The inner loops are simple enough for the
+   compiler to vectorize them. */
+
+#ifdef HAVE_GSL
+enum {
+  MATRIX_ADD, MATRIX_SUB, MATRIX_MUL, MATRIX_DIV,
+  MATRIX_LT, MATRIX_LE, MATRIX_GT, MATRIX_GE, MATRIX_EQ, MATRIX_NE
+};
+
+enum { ELEM_INT, ELEM_DOUBLE, ELEM_COMPLEX };
+
+struct matrix_operand {
+  int type;			// element type
+  pure_expr *x;			// matrix, 0 if scalar
+  size_t n, m, tda;		// dimensions and stride of the matrix
+  int i; double re, im;		// scalar value
+};
+
+static bool get_matrix_operand(pure_expr *x, matrix_operand& a)
+{
+  a.x = 0; a.tda = 0;
+  switch (x->tag) {
+  case EXPR::IMATRIX: {
+    gsl_matrix_int *m = (gsl_matrix_int*)x->data.mat.p;
+    a.type = ELEM_INT; a.x = x;
+    a.n = m->size1; a.m = m->size2; a.tda = m->tda;
+    return true;
+  }
+  case EXPR::DMATRIX: {
+    gsl_matrix *m = (gsl_matrix*)x->data.mat.p;
+    a.type = ELEM_DOUBLE; a.x = x;
+    a.n = m->size1; a.m = m->size2; a.tda = m->tda;
+    return true;
+  }
+  case EXPR::CMATRIX: {
+    gsl_matrix_complex *m = (gsl_matrix_complex*)x->data.mat.p;
+    a.type = ELEM_COMPLEX; a.x = x;
+    a.n = m->size1; a.m = m->size2; a.tda = m->tda;
+    return true;
+  }
+  case EXPR::INT:
+    a.type = ELEM_INT;
+    a.i = x->data.i; a.re = (double)x->data.i; a.im = 0.0;
+    return true;
+  case EXPR::DBL:
+    a.type = ELEM_DOUBLE;
+    a.re = x->data.d; a.im = 0.0;
+    return true;
+  default:
+    if (get_complex(x, a.re, a.im)) {
+      a.type = ELEM_COMPLEX;
+      return true;
+    } else
+      return false;
+  }
+}
+
+/* Convert a matrix operand to the given element type. The converted matrix
+   is a new temporary which the caller has to free. */
+
+static void convert_matrix_operand(matrix_operand& a, int type)
+{
+  if (!a.x || a.type == type) return;
+  if (type == ELEM_DOUBLE) {
+    a.x = pure_new_internal(matrix_double(a.x));
+    a.tda = ((gsl_matrix*)a.x->data.mat.p)->tda;
+  } else {
+    a.x = pure_new_internal(matrix_complex(a.x));
+    a.tda = ((gsl_matrix_complex*)a.x->data.mat.p)->tda;
+  }
+  a.type = type;
+}
+
+/* Loop over the rows and columns of the result matrix (n x m, with data
+   pointer zd and stride ztda), evaluating EXPR for each pair of operand
+   values x and y of type T. The case distinction is done outside of the
+   inner loop, so that each inner loop is a plain traversal of contiguous
+   memory. */
+
+#define MATRIX_ELEMWISE(TZ, zd, ztda, T, ad, a, bd, b, EXPR)		\
+  for (size_t i = 0; i < n; i++) {					\
+    TZ *zr = zd+i*ztda;							\
+    if (!a.x) {								\
+      const T x = ad[0], *yr = bd+i*b.tda;				\
+      for (size_t j = 0; j < m; j++) {					\
+	const T y = yr[j]; zr[j] = (EXPR);				\
+      }									\
+    } else if (!b.x) {							\
+      const T *xr = ad+i*a.tda, y = bd[0];				\
+      for (size_t j = 0; j < m; j++) {					\
+	const T x = xr[j]; zr[j] = (EXPR);				\
+      }									\
+    } else {								\
+      const T *xr = ad+i*a.tda, *yr = bd+i*b.tda;			\
+      for (size_t j = 0; j < m; j++) {					\
+	const T x = xr[j], y = yr[j]; zr[j] = (EXPR);			\
+      }									\
+    }									\
+  }
+
+/* Same for complex operands, which are stored as pairs of doubles. BODY
+   computes the result from the real and imaginary parts x1, y1 and x2, y2
+   of the operands, storing it at zr[K*j] (K = 2 for complex results, 1 for
+   comparisons). */
+
+#define CMATRIX_ELEMWISE(TZ, zd, ztda, K, ad, a, bd, b, BODY)		\
+  for (size_t i = 0; i < n; i++) {					\
+    TZ *zr = zd+K*i*ztda;						\
+    const double *xr = ad+2*i*a.tda, *yr = bd+2*i*b.tda;		\
+    const size_t xk = a.x?2:0, yk = b.x?2:0;				\
+    for (size_t j = 0; j < m; j++) {					\
+      const double x1 = xr[xk*j], y1 = xr[xk*j+1];			\
+      const double x2 = yr[yk*j], y2 = yr[yk*j+1];			\
+      BODY;								\
+    }									\
+  }
+
+static pure_expr *int_matrix_binop(int op, size_t n, size_t m,
+				   const matrix_operand& a,
+				   const matrix_operand& b)
+{
+  const int *ad = a.x?((gsl_matrix_int*)a.x->data.mat.p)->data:&a.i;
+  const int *bd = b.x?((gsl_matrix_int*)b.x->data.mat.p)->data:&b.i;
+  gsl_matrix_int *z = create_int_matrix(n, m);
+  if (!z) return 0;
+  int *zd = z->data; const size_t ztda = z->tda;
+  // Integer arithmetic wraps around, as it does with scalar ints.
+  switch (op) {
+  case MATRIX_ADD:
+    MATRIX_ELEMWISE(int, zd, ztda, int, ad, a, bd, b,
+		    (int)((unsigned)x+(unsigned)y));
+    break;
+  case MATRIX_SUB:
+    MATRIX_ELEMWISE(int, zd, ztda, int, ad, a, bd, b,
+		    (int)((unsigned)x-(unsigned)y));
+    break;
+  case MATRIX_MUL:
+    MATRIX_ELEMWISE(int, zd, ztda, int, ad, a, bd, b,
+		    (int)((unsigned)x*(unsigned)y));
+    break;
+  case MATRIX_LT:
+    MATRIX_ELEMWISE(int, zd, ztda, int, ad, a, bd, b, x<y);
+    break;
+  case MATRIX_LE:
+    MATRIX_ELEMWISE(int, zd, ztda, int, ad, a, bd, b, x<=y);
+    break;
+  case MATRIX_GT:
+    MATRIX_ELEMWISE(int, zd, ztda, int, ad, a, bd, b, x>y);
+    break;
+  case MATRIX_GE:
+    MATRIX_ELEMWISE(int, zd, ztda, int, ad, a, bd, b, x>=y);
+    break;
+  case MATRIX_EQ:
+    MATRIX_ELEMWISE(int, zd, ztda, int, ad, a, bd, b, x==y);
+    break;
+  case MATRIX_NE:
+    MATRIX_ELEMWISE(int, zd, ztda, int, ad, a, bd, b, x!=y);
+    break;
+  default:
+    gsl_matrix_int_free(z);
+    return 0;
+  }
+  return pure_int_matrix(z);
+}
+
+static pure_expr *double_matrix_binop(int op, size_t n, size_t m,
+				      const matrix_operand& a,
+				      const matrix_operand& b)
+{
+  const double *ad = a.x?((gsl_matrix*)a.x->data.mat.p)->data:&a.re;
+  const double *bd = b.x?((gsl_matrix*)b.x->data.mat.p)->data:&b.re;
+  if (op >= MATRIX_LT) {
+    gsl_matrix_int *z = create_int_matrix(n, m);
+    if (!z) return 0;
+    int *zd = z->data; const size_t ztda = z->tda;
+    switch (op) {
+    case MATRIX_LT:
+      MATRIX_ELEMWISE(int, zd, ztda, double, ad, a, bd, b, x<y);
+      break;
+    case MATRIX_LE:
+      MATRIX_ELEMWISE(int, zd, ztda, double, ad, a, bd, b, x<=y);
+      break;
+    case MATRIX_GT:
+      MATRIX_ELEMWISE(int, zd, ztda, double, ad, a, bd, b, x>y);
+      break;
+    case MATRIX_GE:
+      MATRIX_ELEMWISE(int, zd, ztda, double, ad, a, bd, b, x>=y);
+      break;
+    case MATRIX_EQ:
+      MATRIX_ELEMWISE(int, zd, ztda, double, ad, a, bd, b, x==y);
+      break;
+    case MATRIX_NE:
+      MATRIX_ELEMWISE(int, zd, ztda, double, ad, a, bd, b, x!=y);
+      break;
+    default:
+      gsl_matrix_int_free(z);
+      return 0;
+    }
+    return pure_int_matrix(z);
+  }
+  gsl_matrix *z = create_double_matrix(n, m);
+  if (!z) return 0;
+  double *zd = z->data; const size_t ztda = z->tda;
+  switch (op) {
+  case MATRIX_ADD:
+    MATRIX_ELEMWISE(double, zd, ztda, double, ad, a, bd, b, x+y);
+    break;
+  case MATRIX_SUB:
+    MATRIX_ELEMWISE(double, zd, ztda, double, ad, a, bd, b, x-y);
+    break;
+  case MATRIX_MUL:
+    MATRIX_ELEMWISE(double, zd, ztda, double, ad, a, bd, b, x*y);
+    break;
+  case MATRIX_DIV:
+    MATRIX_ELEMWISE(double, zd, ztda, double, ad, a, bd, b, x/y);
+    break;
+  default:
+    gsl_matrix_free(z);
+    return 0;
+  }
+  return pure_double_matrix(z);
+}
+
+static pure_expr *complex_matrix_binop(int op, size_t n, size_t m,
+				       const matrix_operand& a,
+				       const matrix_operand& b)
+{
+  double as[2] = { a.re, a.im }, bs[2] = { b.re, b.im };
+  const double *ad = a.x?((gsl_matrix_complex*)a.x->data.mat.p)->data:as;
+  const double *bd = b.x?((gsl_matrix_complex*)b.x->data.mat.p)->data:bs;
+  if (op == MATRIX_EQ || op == MATRIX_NE) {
+    gsl_matrix_int *z = create_int_matrix(n, m);
+    if (!z) return 0;
+    int *zd = z->data; const size_t ztda = z->tda;
+    if (op == MATRIX_EQ) {
+      CMATRIX_ELEMWISE(int, zd, ztda, 1, ad, a, bd, b,
+		       zr[j] = x1==x2 && y1==y2);
+    } else {
+      CMATRIX_ELEMWISE(int, zd, ztda, 1, ad, a, bd, b,
+		       zr[j] = x1!=x2 || y1!=y2);
+    }
+    return pure_int_matrix(z);
+  }
+  gsl_matrix_complex *z = create_complex_matrix(n, m);
+  if (!z) return 0;
+  double *zd = z->data; const size_t ztda = z->tda;
+  // These are the same formulas as in math.pure.
+  switch (op) {
+  case MATRIX_ADD:
+    CMATRIX_ELEMWISE(double, zd, ztda, 2, ad, a, bd, b,
+		     zr[2*j] = x1+x2; zr[2*j+1] = y1+y2);
+    break;
+  case MATRIX_SUB:
+    CMATRIX_ELEMWISE(double, zd, ztda, 2, ad, a, bd, b,
+		     zr[2*j] = x1-x2; zr[2*j+1] = y1-y2);
+    break;
+  case MATRIX_MUL:
+    CMATRIX_ELEMWISE(double, zd, ztda, 2, ad, a, bd, b,
+		     zr[2*j] = x1*x2-y1*y2; zr[2*j+1] = x1*y2+y1*x2);
+    break;
+  case MATRIX_DIV:
+    CMATRIX_ELEMWISE(double, zd, ztda, 2, ad, a, bd, b,
+		     const double d = x2*x2+y2*y2;
+		     zr[2*j] = (x1*x2+y1*y2)/d; zr[2*j+1] = (y1*x2-x1*y2)/d);
+    break;
+  default:
+    gsl_matrix_complex_free(z);
+    return 0;
+  }
+  return pure_complex_matrix(z);
+}
+#endif
+
+extern "C"
+int matrix_scalarp(pure_expr *x)
+{
+  double a, b;
+  switch (x->tag) {
+  case EXPR::INT:
+  case EXPR::DBL:
+    return 1;
+  default:
+    return get_complex(x, a, b)?2:0;
+  }
+}
+
+extern "C"
+pure_expr *matrix_binop(int op, pure_expr *x, pure_expr *y)
+{
+#ifdef HAVE_GSL
+  matrix_operand a, b;
+  if (!get_matrix_operand(x, a) || !get_matrix_operand(y, b) ||
+      (!a.x && !b.x))
+    return 0;
+  if (a.x && b.x && (a.n != b.n || a.m != b.m))
+    return 0;
+  size_t n = a.x?a.n:b.n, m = a.x?a.m:b.m;
+  int type = (a.type>b.type)?a.type:b.type;
+  if (op == MATRIX_DIV && type == ELEM_INT)
+    type = ELEM_DOUBLE;
+  else if (type == ELEM_COMPLEX && op >= MATRIX_LT && op <= MATRIX_GE)
+    // complex numbers aren't ordered
+    return 0;
+  pure_expr *x0 = a.x, *y0 = b.x;
+  convert_matrix_operand(a, type);
+  convert_matrix_operand(b, type);
+  pure_expr *z;
+  switch (type) {
+  case ELEM_INT:
+    z = int_matrix_binop(op, n, m, a, b);
+    break;
+  case ELEM_DOUBLE:
+    z = double_matrix_binop(op, n, m, a, b);
+    break;
+  default:
+    z = complex_matrix_binop(op, n, m, a, b);
+    break;
+  }
+  if (a.x != x0) pure_free_internal(a.x);
+  if (b.x != y0) pure_free_internal(b.x);
+  return z;
+#else
+  return 0;
+#endif
+}
+
+extern "C"
+pure_expr *matrix_neg(pure_expr *x)
+{
+#ifdef HAVE_GSL
+  switch (x->tag) {
+  case EXPR::IMATRIX: {
+    gsl_matrix_int *m1 = (gsl_matrix_int*)x->data.mat.p;
+    size_t n = m1->size1, m = m1->size2;
+    gsl_matrix_int *m2 = create_int_matrix(n, m);
+    if (!m2) return 0;
+    for (size_t i = 0; i < n; i++) {
+      const int *xr = m1->data+i*m1->tda;
+      int *zr = m2->data+i*m2->tda;
+      for (size_t j = 0; j < m; j++)
+	zr[j] = (int)(0u-(unsigned)xr[j]);
+    }
+    return pure_int_matrix(m2);
+  }
+  case EXPR::DMATRIX: {
+    gsl_matrix *m1 = (gsl_matrix*)x->data.mat.p;
+    size_t n = m1->size1, m = m1->size2;
+    gsl_matrix *m2 = create_double_matrix(n, m);
+    if (!m2) return 0;
+    for (size_t i = 0; i < n; i++) {
+      const double *xr = m1->data+i*m1->tda;
+      double *zr = m2->data+i*m2->tda;
+      for (size_t j = 0; j < m; j++)
+	zr[j] = -xr[j];
+    }
+    return pure_double_matrix(m2);
+  }
+  case EXPR::CMATRIX: {
+    gsl_matrix_complex *m1 = (gsl_matrix_complex*)x->data.mat.p;
+    size_t n = m1->size1, m = m1->size2;
+    gsl_matrix_complex *m2 = create_complex_matrix(n, m);
+    if (!m2) return 0;
+    for (size_t i = 0; i < n; i++) {
+      const double *xr = m1->data+2*i*m1->tda;
+      double *zr = m2->data+2*i*m2->tda;
+      for (size_t j = 0; j < 2*m; j++)
+	zr[j] = -xr[j];
+    }
+    return pure_complex_matrix(m2);
+  }
+  default:
+    return 0;
+  }
+#else
+  return 0;
+#endif
+}
+
+extern "C"
+pure_expr *matrix_abs(pure_expr *x)
+{
+#ifdef HAVE_GSL
+  switch (x->tag) {
+  case EXPR::IMATRIX: {
+    gsl_matrix_int *m1 = (gsl_matrix_int*)x->data.mat.p;
+    size_t n = m1->size1, m = m1->size2;
+    gsl_matrix_int *m2 = create_int_matrix(n, m);
+    if (!m2) return 0;
+    for (size_t i = 0; i < n; i++) {
+      const int *xr = m1->data+i*m1->tda;
+      int *zr = m2->data+i*m2->tda;
+      for (size_t j = 0; j < m; j++)
+	zr[j] = (xr[j]<0)?(int)(0u-(unsigned)xr[j]):xr[j];
+    }
+    return pure_int_matrix(m2);
+  }
+  case EXPR::DMATRIX: {
+    gsl_matrix *m1 = (gsl_matrix*)x->data.mat.p;
+    size_t n = m1->size1, m = m1->size2;
+    gsl_matrix *m2 = create_double_matrix(n, m);
+    if (!m2) return 0;
+    for (size_t i = 0; i < n; i++) {
+      const double *xr = m1->data+i*m1->tda;
+      double *zr = m2->data+i*m2->tda;
+      for (size_t j = 0; j < m; j++)
+	zr[j] = fabs(xr[j]);
+    }
+    return pure_double_matrix(m2);
+  }
+  case EXPR::CMATRIX: {
+    // modulus of each element, as computed by abs in math.pure
+    gsl_matrix_complex *m1 = (gsl_matrix_complex*)x->data.mat.p;
+    size_t n = m1->size1, m = m1->size2;
+    gsl_matrix *m2 = create_double_matrix(n, m);
+    if (!m2) return 0;
+    for (size_t i = 0; i < n; i++) {
+      const double *xr = m1->data+2*i*m1->tda;
+      double *zr = m2->data+i*m2->tda;
+      for (size_t j = 0; j < m; j++)
+	zr[j] = sqrt(xr[2*j]*xr[2*j]+xr[2*j+1]*xr[2*j+1]);
+    }
+    return pure_double_matrix(m2);
+  }
+  default:
+    return 0;
+  }
+#else
+  return 0;
+#endif
+}
+
+/* Elementwise math functions on int and double matrices. The function is
+   given by its index in the following table, the result is always a double
+   matrix. (Complex matrices are handled in math.pure.) */
+
+#ifdef HAVE_GSL
+static double matrix_log10(double x)
+{
+  // same as log in math.pure
+  return log(x)/log(10.0);
+}
+
+static double (*matrix_math_fun[])(double) = {
+  sqrt, exp, log, matrix_log10, sin, cos, tan, asin, acos, atan,
+  sinh, cosh, tanh
+};
+#endif
+
+extern "C"
+pure_expr *matrix_math(int fn, pure_expr *x)
+{
+#ifdef HAVE_GSL
+  const int nfuns = sizeof(matrix_math_fun)/sizeof(matrix_math_fun[0]);
+  if (fn < 0 || fn >= nfuns) return 0;
+  double (*f)(double) = matrix_math_fun[fn];
+  switch (x->tag) {
+  case EXPR::IMATRIX: {
+    gsl_matrix_int *m1 = (gsl_matrix_int*)x->data.mat.p;
+    size_t n = m1->size1, m = m1->size2;
+    gsl_matrix *m2 = create_double_matrix(n, m);
+    if (!m2) return 0;
+    for (size_t i = 0; i < n; i++) {
+      const int *xr = m1->data+i*m1->tda;
+      double *zr = m2->data+i*m2->tda;
+      for (size_t j = 0; j < m; j++)
+	zr[j] = f((double)xr[j]);
+    }
+    return pure_double_matrix(m2);
+  }
+  case EXPR::DMATRIX: {
+    gsl_matrix *m1 = (gsl_matrix*)x->data.mat.p;
+    size_t n = m1->size1, m = m1->size2;
+    gsl_matrix *m2 = create_double_matrix(n, m);
+    if (!m2) return 0;
+    for (size_t i = 0; i < n; i++) {
+      const double *xr = m1->data+i*m1->tda;
+      double *zr = m2->data+i*m2->tda;
+      for (size_t j = 0; j < m; j++)
+	zr[j] = f(xr[j]);
+    }
+    return pure_double_matrix(m2);
+  }
+  default:
+    return 0;
+  }
+#else
+  return 0;
+#endif
+}
+
+/* Dense linear algebra on numeric matrices (see matrices.pure), using the
+   BLAS and linear algebra routines of the GSL. Int matrices are converted to
+   double matrices first, except in products of two int matrices. The results
+   are computed directly in newly allocated GSL matrices which then become
+   the Pure result; the input is only copied where the GSL works in place
+   (solve and the decompositions), in which case the copy is the result. */
+
+#ifdef HAVE_GSL
+static inline bool linalg_operand(pure_expr *x, matrix_operand& a)
+{
+  return get_matrix_operand(x, a) && a.x;
+}
+
+static inline int linalg_type(const matrix_operand& a)
+{
+  return (a.type==ELEM_COMPLEX)?ELEM_COMPLEX:ELEM_DOUBLE;
+}
+
+static inline void linalg_free(const matrix_operand& a, pure_expr *x)
+{
+  if (a.x != x) pure_free_internal(a.x);
+}
+
+static gsl_matrix *linalg_copy(const gsl_matrix *m1)
+{
+  gsl_matrix *m2 = create_double_matrix(m1->size1, m1->size2);
+  if (m2)
+    matrix_copy_rows(m2->data, m2->tda, m1->data, m1->tda,
+		     m1->size1, m1->size2, sizeof(double));
+  return m2;
+}
+
+static gsl_matrix_complex *linalg_complex_copy(const gsl_matrix_complex *m1)
+{
+  gsl_matrix_complex *m2 = create_complex_matrix(m1->size1, m1->size2);
+  if (m2)
+    matrix_copy_rows(m2->data, m2->tda, m1->data, m1->tda,
+		     m1->size1, m1->size2, 2*sizeof(double));
+  return m2;
+}
+
+/* The BLAS level 1 routines want their input as vectors. A matrix can be
+   viewed as a vector of its elements in row-major order if it is a row or
+   column vector, or if it is packed. Otherwise we have to pack it first. */
+
+static bool linalg_stride(size_t n, size_t m, size_t tda, size_t& stride)
+{
+  if (n == 1 || m == tda)
+    stride = 1;
+  else if (m == 1)
+    stride = tda;
+  else
+    return false;
+  return true;
+}
+
+static pure_expr *linalg_vector(pure_expr *x, size_t& stride)
+{
+  if (x->tag == EXPR::DMATRIX) {
+    gsl_matrix *m = (gsl_matrix*)x->data.mat.p;
+    if (linalg_stride(m->size1, m->size2, m->tda, stride)) return x;
+    stride = 1;
+    return pure_new_internal(pure_double_matrix(linalg_copy(m)));
+  } else {
+    gsl_matrix_complex *m = (gsl_matrix_complex*)x->data.mat.p;
+    if (linalg_stride(m->size1, m->size2, m->tda, stride)) return x;
+    stride = 1;
+    return pure_new_internal(pure_complex_matrix(linalg_complex_copy(m)));
+  }
+}
+
+/* Products of two int matrices are computed directly, so that the result is
+   an int matrix (or int) again, as with sparse int matrices. As with scalar
+   ints, the arithmetic wraps around. */
+
+static pure_expr *int_matmul(const gsl_matrix_int *m1,
+			     const gsl_matrix_int *m2)
+{
+  const size_t n = m1->size1, k = m1->size2, m = m2->size2;
+  gsl_matrix_int *m3 = create_int_matrix(n, m);
+  if (!m3) return 0;
+  for (size_t i = 0; i < n; i++) {
+    const int *xr = m1->data+i*m1->tda;
+    unsigned *zr = (unsigned*)m3->data+i*m3->tda;
+    for (size_t j = 0; j < m; j++) zr[j] = 0;
+    for (size_t l = 0; l < k; l++) {
+      const unsigned v = xr[l];
+      if (v == 0) continue;
+      const int *yr = m2->data+l*m2->tda;
+      for (size_t j = 0; j < m; j++) zr[j] += v*(unsigned)yr[j];
+    }
+  }
+  return pure_int_matrix(m3);
+}
+
+static pure_expr *int_dot(const gsl_matrix_int *m1, const gsl_matrix_int *m2)
+{
+  const size_t n = m1->size1*m1->size2;
+  size_t i1 = 0, j1 = 0, i2 = 0, j2 = 0;
+  unsigned d = 0;
+  for (size_t l = 0; l < n; l++) {
+    d += (unsigned)m1->data[i1*m1->tda+j1]*(unsigned)m2->data[i2*m2->tda+j2];
+    if (++j1 == m1->size2) { j1 = 0; i1++; }
+    if (++j2 == m2->size2) { j2 = 0; i2++; }
+  }
+  return pure_int((int)d);
+}
+#endif
+
+extern "C"
+pure_expr *matrix_matmul(pure_expr *x, pure_expr *y)
+{
+#ifdef HAVE_GSL
+  matrix_operand a, b;
+  if (!linalg_operand(x, a) || !linalg_operand(y, b) || a.m != b.n)
+    return 0;
+  if (a.type == ELEM_INT && b.type == ELEM_INT)
+    return int_matmul((gsl_matrix_int*)x->data.mat.p,
+		      (gsl_matrix_int*)y->data.mat.p);
+  int type = (linalg_type(a)>linalg_type(b))?linalg_type(a):linalg_type(b);
+  pure_expr *x0 = a.x, *y0 = b.x, *z = 0;
+  convert_matrix_operand(a, type);
+  convert_matrix_operand(b, type);
+  const size_t n = a.n, k = a.m, m = b.m;
+  if (type == ELEM_DOUBLE) {
+    gsl_matrix *m1 = (gsl_matrix*)a.x->data.mat.p;
+    gsl_matrix *m2 = (gsl_matrix*)b.x->data.mat.p;
+    gsl_matrix *m3 = create_double_matrix(n, m);
+    if (m3) {
+      if (n > 0 && m > 0 && k > 0)
+	gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, m1, m2, 0.0, m3);
+      else if (n > 0 && m > 0)
+	gsl_matrix_set_zero(m3);
+      z = pure_double_matrix(m3);
+    }
+  } else {
+    gsl_matrix_complex *m1 = (gsl_matrix_complex*)a.x->data.mat.p;
+    gsl_matrix_complex *m2 = (gsl_matrix_complex*)b.x->data.mat.p;
+    gsl_matrix_complex *m3 = create_complex_matrix(n, m);
+    if (m3) {
+      if (n > 0 && m > 0 && k > 0) {
+	gsl_complex alpha, beta;
+	GSL_SET_COMPLEX(&alpha, 1.0, 0.0);
+	GSL_SET_COMPLEX(&beta, 0.0, 0.0);
+	gsl_blas_zgemm(CblasNoTrans, CblasNoTrans, alpha, m1, m2, beta, m3);
+      } else if (n > 0 && m > 0)
+	gsl_matrix_complex_set_zero(m3);
+      z = pure_complex_matrix(m3);
+    }
+  }
+  linalg_free(a, x0);
+  linalg_free(b, y0);
+  return z;
+#else
+  return 0;
+#endif
+}
+
+extern "C"
+pure_expr *matrix_dot(pure_expr *x, pure_expr *y)
+{
+#ifdef HAVE_GSL
+  matrix_operand a, b;
+  if (!linalg_operand(x, a) || !linalg_operand(y, b) ||
+      a.n*a.m != b.n*b.m)
+    return 0;
+  if (a.type == ELEM_INT && b.type == ELEM_INT)
+    return int_dot((gsl_matrix_int*)x->data.mat.p,
+		   (gsl_matrix_int*)y->data.mat.p);
+  const size_t n = a.n*a.m;
+  int type = (linalg_type(a)>linalg_type(b))?linalg_type(a):linalg_type(b);
+  if (n == 0)
+    return (type == ELEM_DOUBLE)?pure_double(0.0):make_complex(0.0, 0.0);
+  pure_expr *x0 = a.x, *y0 = b.x, *z;
+  convert_matrix_operand(a, type);
+  convert_matrix_operand(b, type);
+  size_t s1, s2;
+  pure_expr *u = linalg_vector(a.x, s1), *v = linalg_vector(b.x, s2);
+  if (type == ELEM_DOUBLE) {
+    double *p1 = ((gsl_matrix*)u->data.mat.p)->data;
+    double *p2 = ((gsl_matrix*)v->data.mat.p)->data;
+    gsl_vector_const_view v1 =
+      gsl_vector_const_view_array_with_stride(p1, s1, n);
+    gsl_vector_const_view v2 =
+      gsl_vector_const_view_array_with_stride(p2, s2, n);
+    double d;
+    gsl_blas_ddot(&v1.vector, &v2.vector, &d);
+    z = pure_double(d);
+  } else {
+    double *p1 = ((gsl_matrix_complex*)u->data.mat.p)->data;
+    double *p2 = ((gsl_matrix_complex*)v->data.mat.p)->data;
+    gsl_vector_complex_const_view v1 =
+      gsl_vector_complex_const_view_array_with_stride(p1, s1, n);
+    gsl_vector_complex_const_view v2 =
+      gsl_vector_complex_const_view_array_with_stride(p2, s2, n);
+    gsl_complex d;
+    gsl_blas_zdotu(&v1.vector, &v2.vector, &d);
+    z = make_complex(GSL_REAL(d), GSL_IMAG(d));
+  }
+  if (u != a.x) pure_free_internal(u);
+  if (v != b.x) pure_free_internal(v);
+  linalg_free(a, x0);
+  linalg_free(b, y0);
+  return z;
+#else
+  return 0;
+#endif
+}
+
+extern "C"
+pure_expr *matrix_norm(pure_expr *x)
+{
+#ifdef HAVE_GSL
+  matrix_operand a;
+  if (!linalg_operand(x, a)) return 0;
+  const size_t n = a.n*a.m;
+  if (n == 0) return pure_double(0.0);
+  pure_expr *x0 = a.x;
+  convert_matrix_operand(a, linalg_type(a));
+  size_t s;
+  pure_expr *u = linalg_vector(a.x, s);
+  double d;
+  if (a.type == ELEM_DOUBLE) {
+    double *p = ((gsl_matrix*)u->data.mat.p)->data;
+    gsl_vector_const_view v = gsl_vector_const_view_array_with_stride(p, s, n);
+    d = gsl_blas_dnrm2(&v.vector);
+  } else {
+    double *p = ((gsl_matrix_complex*)u->data.mat.p)->data;
+    gsl_vector_complex_const_view v =
+      gsl_vector_complex_const_view_array_with_stride(p, s, n);
+    d = gsl_blas_dznrm2(&v.vector);
+  }
+  if (u != a.x) pure_free_internal(u);
+  linalg_free(a, x0);
+  return pure_double(d);
+#else
+  return 0;
+#endif
+}
+
+#ifdef HAVE_GSL
+/* The LU decomposition of GSL 1.x doesn't report a singular matrix, so we
+   check the diagonal of the u factor for a zero pivot ourselves. */
+
+static bool lu_singular(const gsl_matrix *lu)
+{
+  for (size_t i = 0; i < lu->size1; i++)
+    if (lu->data[i*lu->tda+i] == 0.0) return true;
+  return false;
+}
+
+static bool lu_singular(const gsl_matrix_complex *lu)
+{
+  for (size_t i = 0; i < lu->size1; i++) {
+    const double *z = lu->data+2*(i*lu->tda+i);
+    if (z[0] == 0.0 && z[1] == 0.0) return true;
+  }
+  return false;
+}
+#endif
+
+extern "C"
+pure_expr *matrix_solve(pure_expr *x, pure_expr *y)
+{
+#ifdef HAVE_GSL
+  matrix_operand a, b;
+  if (!linalg_operand(x, a) || !linalg_operand(y, b) ||
+      a.n != a.m || a.n != b.n)
+    return 0;
+  int type = (linalg_type(a)>linalg_type(b))?linalg_type(a):linalg_type(b);
+  pure_expr *x0 = a.x, *y0 = b.x, *z = 0;
+  convert_matrix_operand(a, type);
+  convert_matrix_operand(b, type);
+  const size_t n = a.n, k = b.m;
+  int ok = 1, s;
+  if (type == ELEM_DOUBLE) {
+    // The solution overwrites a copy of the right-hand side, column by
+    // column.
+    gsl_matrix *lu = linalg_copy((gsl_matrix*)a.x->data.mat.p);
+    gsl_matrix *m = linalg_copy((gsl_matrix*)b.x->data.mat.p);
+    gsl_permutation *p = (n>0)?gsl_permutation_alloc(n):0;
+    if (lu && m && (n == 0 || p)) {
+      if (n > 0 && (gsl_linalg_LU_decomp(lu, p, &s) || lu_singular(lu)))
+	ok = 0;
+      for (size_t j = 0; ok && n > 0 && j < k; j++) {
+	gsl_vector_view c = gsl_matrix_column(m, j);
+	ok = !gsl_linalg_LU_svx(lu, p, &c.vector);
+      }
+      if (ok) {
+	z = pure_double_matrix(m);
+	m = 0;
+      }
+    }
+    if (lu) gsl_matrix_free(lu);
+    if (m) gsl_matrix_free(m);
+    if (p) gsl_permutation_free(p);
+  } else {
+    gsl_matrix_complex *lu =
+      linalg_complex_copy((gsl_matrix_complex*)a.x->data.mat.p);
+    gsl_matrix_complex *m =
+      linalg_complex_copy((gsl_matrix_complex*)b.x->data.mat.p);
+    gsl_permutation *p = (n>0)?gsl_permutation_alloc(n):0;
+    if (lu && m && (n == 0 || p)) {
+      if (n > 0 &&
+	  (gsl_linalg_complex_LU_decomp(lu, p, &s) || lu_singular(lu)))
+	ok = 0;
+      for (size_t j = 0; ok && n > 0 && j < k; j++) {
+	gsl_vector_complex_view c = gsl_matrix_complex_column(m, j);
+	ok = !gsl_linalg_complex_LU_svx(lu, p, &c.vector);
+      }
+      if (ok) {
+	z = pure_complex_matrix(m);
+	m = 0;
+      }
+    }
+    if (lu) gsl_matrix_complex_free(lu);
+    if (m) gsl_matrix_complex_free(m);
+    if (p) gsl_permutation_free(p);
+  }
+  linalg_free(a, x0);
+  linalg_free(b, y0);
+  return z;
+#else
+  return 0;
+#endif
+}
+
+#ifdef HAVE_GSL
+static pure_expr *linalg_permutation(const gsl_permutation *p, size_t n)
+{
+  gsl_matrix_int *m = create_int_matrix(1, n);
+  if (!m) return 0;
+  for (size_t i = 0; i < n; i++)
+    m->data[i] = (int)gsl_permutation_get(p, i);
+  return pure_int_matrix(m);
+}
+#endif
+
+extern "C"
+pure_expr *matrix_lu(pure_expr *x)
+{
+#ifdef HAVE_GSL
+  matrix_operand a;
+  if (!linalg_operand(x, a) || a.n != a.m || a.n == 0) return 0;
+  pure_expr *x0 = a.x, *z = 0, *perm;
+  convert_matrix_operand(a, linalg_type(a));
+  const size_t n = a.n;
+  int s;
+  gsl_permutation *p = gsl_permutation_alloc(n);
+  if (p && a.type == ELEM_DOUBLE) {
+    gsl_matrix *lu = linalg_copy((gsl_matrix*)a.x->data.mat.p);
+    if (lu && !gsl_linalg_LU_decomp(lu, p, &s) && !lu_singular(lu) &&
+	(perm = linalg_permutation(p, n)))
+      z = pure_tuplel(2, pure_double_matrix(lu), perm);
+    else if (lu)
+      gsl_matrix_free(lu);
+  } else if (p) {
+    gsl_matrix_complex *lu =
+      linalg_complex_copy((gsl_matrix_complex*)a.x->data.mat.p);
+    if (lu && !gsl_linalg_complex_LU_decomp(lu, p, &s) && !lu_singular(lu) &&
+	(perm = linalg_permutation(p, n)))
+      z = pure_tuplel(2, pure_complex_matrix(lu), perm);
+    else if (lu)
+      gsl_matrix_complex_free(lu);
+  }
+  if (p) gsl_permutation_free(p);
+  linalg_free(a, x0);
+  return z;
+#else
+  return 0;
+#endif
+}
+
+extern "C"
+pure_expr *matrix_qr(pure_expr *x)
+{
+#ifdef HAVE_GSL
+  matrix_operand a;
+  if (!linalg_operand(x, a) || a.type == ELEM_COMPLEX ||
+      a.n == 0 || a.m == 0)
+    return 0;
+  pure_expr *x0 = a.x, *z = 0;
+  convert_matrix_operand(a, ELEM_DOUBLE);
+  const size_t n = a.n, m = a.m;
+  gsl_matrix *qr = linalg_copy((gsl_matrix*)a.x->data.mat.p);
+  gsl_vector *tau = gsl_vector_alloc((n<m)?n:m);
+  gsl_matrix *q = create_double_matrix(n, n), *r = create_double_matrix(n, m);
+  if (qr && tau && q && r && !gsl_linalg_QR_decomp(qr, tau) &&
+      !gsl_linalg_QR_unpack(qr, tau, q, r)) {
+    z = pure_tuplel(2, pure_double_matrix(q), pure_double_matrix(r));
+    q = r = 0;
+  }
+  if (qr) gsl_matrix_free(qr);
+  if (tau) gsl_vector_free(tau);
+  if (q) gsl_matrix_free(q);
+  if (r) gsl_matrix_free(r);
+  linalg_free(a, x0);
+  return z;
+#else
+  return 0;
+#endif
+}
+
+extern "C"
+pure_expr *matrix_chol(pure_expr *x)
+{
+#ifdef HAVE_GSL
+  matrix_operand a;
+  if (!linalg_operand(x, a) || a.type == ELEM_COMPLEX ||
+      a.n != a.m || a.n == 0)
+    return 0;
+  pure_expr *x0 = a.x, *z = 0;
+  convert_matrix_operand(a, ELEM_DOUBLE);
+  const size_t n = a.n;
+  gsl_matrix *l = linalg_copy((gsl_matrix*)a.x->data.mat.p);
+  if (l && !gsl_linalg_cholesky_decomp(l)) {
+    // The upper triangle holds the transpose of the factor, clear it.
+    for (size_t i = 0; i < n; i++)
+      for (size_t j = i+1; j < n; j++)
+	l->data[i*l->tda+j] = 0.0;
+    z = pure_double_matrix(l);
+  } else if (l)
+    gsl_matrix_free(l);
+  linalg_free(a, x0);
+  return z;
+#else
+  return 0;
+#endif
+}
+
+/* Reductions (sum, product, minimum, maximum and mean) of numeric matrices
+   (see matrices.pure), either over the entire matrix, or along the columns
+   or rows, which gives a row or column vector. Sums of doubles are computed
+   with pairwise summation, which keeps the rounding error at O(log n)
+   instead of O(n) at about the same speed as a simple loop, while int
+   matrices are summed up using 64 bit integers. Columns are reduced by
+   combining entire rows of the matrix with a vector of partial results,
+   so that the data is traversed in memory order and the inner loops can be
+   vectorized. */
+
+#ifdef HAVE_GSL
+enum { MATRIX_SUM, MATRIX_PROD, MATRIX_MIN, MATRIX_MAX, MATRIX_MEAN };
+
+#define PAIRWISE_BLOCK 128
+
+static double pairwise_sum(const double *p, size_t n, size_t s)
+{
+  if (n > PAIRWISE_BLOCK) {
+    size_t k = n/2;
+    k -= k%8;
+    return pairwise_sum(p, k, s) + pairwise_sum(p+k*s, n-k, s);
+  } else if (s == 1) {
+    // use several partial sums to break the dependency chain
+    double a[8] = { 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0 };
+    size_t i = 0;
+    for (; i+8 <= n; i += 8)
+      for (size_t k = 0; k < 8; k++)
+	a[k] += p[i+k];
+    double r = ((a[0]+a[1])+(a[2]+a[3]))+((a[4]+a[5])+(a[6]+a[7]));
+    for (; i < n; i++)
+      r += p[i];
+    return r;
+  } else {
+    double r = 0.0;
+    for (size_t i = 0; i < n; i++)
+      r += p[i*s];
+    return r;
+  }
+}
+
+static double double_reduce(int op, const double *p, size_t n, size_t s)
+{
+  double r;
+  switch (op) {
+  case MATRIX_SUM:
+  case MATRIX_MEAN:
+    return pairwise_sum(p, n, s);
+  case MATRIX_PROD:
+    r = 1.0;
+    for (size_t i = 0; i < n; i++)
+      r *= p[i*s];
+    return r;
+  case MATRIX_MIN:
+    r = p[0];
+    for (size_t i = 1; i < n; i++)
+      r = (p[i*s]<r)?p[i*s]:r;
+    return r;
+  default:
+    r = p[0];
+    for (size_t i = 1; i < n; i++)
+      r = (p[i*s]>r)?p[i*s]:r;
+    return r;
+  }
+}
+
+static bool double_reduce_cols(int op, const double *p, size_t n, size_t m,
+			       size_t tda, double *z)
+{
+  if ((op == MATRIX_SUM || op == MATRIX_MEAN) && n > PAIRWISE_BLOCK) {
+    // Sum up blocks of rows, then add up the partial sums pairwise.
+    const size_t nb = (n+PAIRWISE_BLOCK-1)/PAIRWISE_BLOCK;
+    double *b = (double*)malloc((m>0?nb*m:1)*sizeof(double));
+    if (!b) return false;
+    for (size_t k = 0; k < nb; k++) {
+      size_t i = k*PAIRWISE_BLOCK;
+      size_t l = (n-i > PAIRWISE_BLOCK)?PAIRWISE_BLOCK:n-i;
+      double_reduce_cols(MATRIX_SUM, p+i*tda, l, m, tda, b+k*m);
+    }
+    for (size_t j = 0; j < m; j++)
+      z[j] = pairwise_sum(b+j, nb, m);
+    free(b);
+    return true;
+  }
+  size_t i = 0;
+  switch (op) {
+  case MATRIX_SUM:
+  case MATRIX_MEAN:
+    for (size_t j = 0; j < m; j++) z[j] = 0.0;
+    for (; i < n; i++) {
+      const double *r = p+i*tda;
+      for (size_t j = 0; j < m; j++) z[j] += r[j];
+    }
+    break;
+  case MATRIX_PROD:
+    for (size_t j = 0; j < m; j++) z[j] = 1.0;
+    for (; i < n; i++) {
+      const double *r = p+i*tda;
+      for (size_t j = 0; j < m; j++) z[j] *= r[j];
+    }
+    break;
+  case MATRIX_MIN:
+    for (size_t j = 0; j < m; j++) z[j] = p[j];
+    for (i = 1; i < n; i++) {
+      const double *r = p+i*tda;
+      for (size_t j = 0; j < m; j++) z[j] = (r[j]<z[j])?r[j]:z[j];
+    }
+    break;
+  default:
+    for (size_t j = 0; j < m; j++) z[j] = p[j];
+    for (i = 1; i < n; i++) {
+      const double *r = p+i*tda;
+      for (size_t j = 0; j < m; j++) z[j] = (r[j]>z[j])?r[j]:z[j];
+    }
+    break;
+  }
+  return true;
+}
+
+/* Int sums are computed with 64 bit ints, which can't overflow unless the
+   matrix has 2^32 elements or more. Products are done separately below. */
+
+static int64_t int_reduce(int op, const int *p, size_t n, size_t s)
+{
+  int64_t r;
+  switch (op) {
+  case MATRIX_SUM:
+  case MATRIX_MEAN:
+    r = 0;
+    for (size_t i = 0; i < n; i++)
+      r += p[i*s];
+    return r;
+  case MATRIX_MIN:
+    r = p[0];
+    for (size_t i = 1; i < n; i++)
+      r = (p[i*s]<r)?p[i*s]:r;
+    return r;
+  default:
+    r = p[0];
+    for (size_t i = 1; i < n; i++)
+      r = (p[i*s]>r)?p[i*s]:r;
+    return r;
+  }
+}
+
+static void int_reduce_cols(int op, const int *p, size_t n, size_t m,
+			    size_t tda, int64_t *z)
+{
+  size_t i = 0;
+  switch (op) {
+  case MATRIX_SUM:
+  case MATRIX_MEAN:
+    for (size_t j = 0; j < m; j++) z[j] = 0;
+    for (; i < n; i++) {
+      const int *r = p+i*tda;
+      for (size_t j = 0; j < m; j++) z[j] += r[j];
+    }
+    break;
+  case MATRIX_MIN:
+    for (size_t j = 0; j < m; j++) z[j] = p[j];
+    for (i = 1; i < n; i++) {
+      const int *r = p+i*tda;
+      for (size_t j = 0; j < m; j++) z[j] = (r[j]<z[j])?r[j]:z[j];
+    }
+    break;
+  default:
+    for (size_t j = 0; j < m; j++) z[j] = p[j];
+    for (i = 1; i < n; i++) {
+      const int *r = p+i*tda;
+      for (size_t j = 0; j < m; j++) z[j] = (r[j]>z[j])?r[j]:z[j];
+    }
+    break;
+  }
+}
+
+/* Int products are exact. They are computed with 64 bit ints as long as
+   possible; if the product overflows, int_prod continues with a bigint,
+   while the row and column products (int_prod_vector) continue with a
+   double, since these yield a double matrix anyway. */
+
+static inline bool int64_mul(int64_t& r, int x)
+{
+  const int64_t max = (int64_t)(~(uint64_t)0>>1);
+  const int64_t a = (r<0)?-r:r, b = (x<0)?-(int64_t)x:x;
+  if (b != 0 && a > max/b) return false;
+  r *= x;
+  return true;
+}
+
+static pure_expr *int_prod(const int *p, size_t n, size_t m, size_t tda)
+{
+  int64_t r = 1;
+  bool big = false;
+  mpz_t z;
+  for (size_t i = 0; i < n; i++) {
+    const int *q = p+i*tda;
+    for (size_t j = 0; j < m; j++)
+      if (big)
+	mpz_mul_si(z, z, q[j]);
+      else if (!int64_mul(r, q[j])) {
+	// long may only have 32 bits, so set the high and low word separately
+	big = true;
+	mpz_init_set_si(z, (long)(r>>32));
+	mpz_mul_2exp(z, z, 32);
+	mpz_add_ui(z, z, (unsigned long)(uint32_t)r);
+	mpz_mul_si(z, z, q[j]);
+      }
+  }
+  if (!big) return int64_value(r);
+  // the product may still become zero
+  pure_expr *ret = (mpz_sgn(z) == 0)?pure_int(0):pure_mpz(z);
+  mpz_clear(z);
+  return ret;
+}
+
+struct int_prod_t {
+  int64_t r;
+  double d;
+  bool big;
+};
+
+static inline void int_prod_step(int_prod_t& a, int x)
+{
+  if (a.big)
+    a.d *= x;
+  else if (!int64_mul(a.r, x)) {
+    a.big = true; a.d = (double)a.r*x;
+  }
+}
+
+static pure_expr *int_prod_vector(int dim, const int *p, size_t n, size_t m,
+				  size_t tda)
+{
+  // number of results
+  const size_t k = (dim==1)?m:n;
+  int_prod_t *z = (int_prod_t*)malloc((k>0?k:1)*sizeof(int_prod_t));
+  if (!z) return 0;
+  for (size_t l = 0; l < k; l++) {
+    z[l].r = 1; z[l].big = false;
+  }
+  for (size_t i = 0; i < n; i++) {
+    const int *r = p+i*tda;
+    if (dim == 1)
+      for (size_t j = 0; j < m; j++) int_prod_step(z[j], r[j]);
+    else
+      for (size_t j = 0; j < m; j++) int_prod_step(z[i], r[j]);
+  }
+  bool fits = true;
+  for (size_t l = 0; fits && l < k; l++)
+    fits = !z[l].big && z[l].r == (int64_t)(int)z[l].r;
+  const size_t n1 = (dim==2)?n:1, m1 = (dim==1)?m:1;
+  pure_expr *ret = 0;
+  if (fits) {
+    gsl_matrix_int *mat = create_int_matrix(n1, m1);
+    if (mat) {
+      for (size_t l = 0; l < k; l++)
+	mat->data[l] = (int)z[l].r;
+      ret = pure_int_matrix(mat);
+    }
+  } else {
+    gsl_matrix *mat = create_double_matrix(n1, m1);
+    if (mat) {
+      for (size_t l = 0; l < k; l++)
+	mat->data[l] = z[l].big?z[l].d:(double)z[l].r;
+      ret = pure_double_matrix(mat);
+    }
+  }
+  free(z);
+  return ret;
+}
+
+/* Complex values are only summed up and multiplied, p points to the real
+   part of the first value, z receives the real and imaginary part of the
+   result. Sums are done on the real and imaginary parts separately. */
+
+static void complex_reduce(int op, const double *p, size_t n, size_t s,
+			   double *z)
+{
+  if (op == MATRIX_PROD) {
+    double x = 1.0, y = 0.0;
+    for (size_t i = 0; i < n; i++) {
+      const double x1 = p[2*i*s], y1 = p[2*i*s+1], x2 = x;
+      x = x2*x1-y*y1; y = x2*y1+y*x1;
+    }
+    z[0] = x; z[1] = y;
+  } else {
+    z[0] = pairwise_sum(p, n, 2*s);
+    z[1] = pairwise_sum(p+1, n, 2*s);
+  }
+}
+
+static bool complex_reduce_cols(int op, const double *p, size_t n, size_t m,
+				size_t tda, double *z)
+{
+  if (op == MATRIX_PROD) {
+    for (size_t j = 0; j < m; j++) {
+      z[2*j] = 1.0; z[2*j+1] = 0.0;
+    }
+    for (size_t i = 0; i < n; i++) {
+      const double *r = p+2*i*tda;
+      for (size_t j = 0; j < m; j++) {
+	const double x1 = r[2*j], y1 = r[2*j+1], x = z[2*j], y = z[2*j+1];
+	z[2*j] = x*x1-y*y1; z[2*j+1] = x*y1+y*x1;
+      }
+    }
+    return true;
+  } else
+    // a row of complex values is just a row of twice as many doubles here
+    return double_reduce_cols(MATRIX_SUM, p, n, 2*m, 2*tda, z);
+}
+
+/* Create the result of an int reduction along rows or columns. Sums which
+   don't fit into an int give a double matrix. */
+
+static pure_expr *int64_vector(int op, const int64_t *z, size_t n, size_t m,
+			       double count)
+{
+  bool fits = op == MATRIX_MIN || op == MATRIX_MAX;
+  if (op == MATRIX_SUM) {
+    fits = true;
+    for (size_t i = 0; fits && i < n*m; i++)
+      fits = z[i] == (int64_t)(int)z[i];
+  }
+  if (fits) {
+    gsl_matrix_int *mat = create_int_matrix(n, m);
+    if (!mat) return 0;
+    for (size_t i = 0; i < n*m; i++)
+      mat->data[i] = (int)z[i];
+    return pure_int_matrix(mat);
+  } else {
+    gsl_matrix *mat = create_double_matrix(n, m);
+    if (!mat) return 0;
+    for (size_t i = 0; i < n*m; i++)
+      mat->data[i] = (op == MATRIX_MEAN)?(double)z[i]/count:(double)z[i];
+    return pure_double_matrix(mat);
+  }
+}
+#endif
+
+extern "C"
+pure_expr *matrix_reduce(int op, int dim, pure_expr *x)
+{
+#ifdef HAVE_GSL
+  size_t n, m, tda;
+  switch (x->tag) {
+  case EXPR::DMATRIX: case EXPR::CMATRIX: case EXPR::IMATRIX: {
+    gsl_matrix *mat = (gsl_matrix*)x->data.mat.p;
+    n = mat->size1; m = mat->size2; tda = mat->tda;
+    break;
+  }
+  default:
+    return 0;
+  }
+  if (op < MATRIX_SUM || op > MATRIX_MEAN || dim < 0 || dim > 2)
+    return 0;
+  if (x->tag == EXPR::CMATRIX && (op == MATRIX_MIN || op == MATRIX_MAX))
+    return 0;
+  // number of values in each reduction, the minimum and maximum are
+  // undefined if there aren't any
+  const size_t count = (dim==0)?n*m:(dim==1)?n:m;
+  if (count == 0 && (op == MATRIX_MIN || op == MATRIX_MAX))
+    return 0;
+  // dimensions of the result
+  const size_t n1 = (dim==2)?n:1, m1 = (dim==1)?m:1;
+  // The partial results of the rows if we need to reduce an entire matrix
+  // which isn't packed.
+  const bool byrows = dim == 0 && n > 1 && m != tda;
+  pure_expr *ret = 0;
+  switch (x->tag) {
+  case EXPR::DMATRIX: {
+    const double *p = ((gsl_matrix*)x->data.mat.p)->data;
+    gsl_matrix *z = create_double_matrix(byrows?n:n1, m1);
+    if (!z) return 0;
+    if (dim == 1) {
+      if (!double_reduce_cols(op, p, n, m, tda, z->data)) {
+	gsl_matrix_free(z);
+	return 0;
+      }
+    } else if (dim == 2 || byrows)
+      for (size_t i = 0; i < n; i++)
+	z->data[i] = double_reduce(op, p+i*tda, m, 1);
+    else
+      z->data[0] = double_reduce(op, p, n*m, 1);
+    if (byrows) z->data[0] = double_reduce(op, z->data, n, 1);
+    if (op == MATRIX_MEAN)
+      for (size_t i = 0; i < n1*m1; i++) z->data[i] /= (double)count;
+    if (dim == 0) {
+      ret = pure_double(z->data[0]);
+      gsl_matrix_free(z);
+    } else
+      ret = pure_double_matrix(z);
+    break;
+  }
+  case EXPR::IMATRIX: {
+    const int *p = ((gsl_matrix_int*)x->data.mat.p)->data;
+    if (op == MATRIX_PROD) {
+      ret = (dim == 0)?int_prod(p, n, m, tda):
+	int_prod_vector(dim, p, n, m, tda);
+      break;
+    }
+    int64_t *z = (int64_t*)malloc((byrows?n:n1*m1)*sizeof(int64_t));
+    if (!z) return 0;
+    if (dim == 1)
+      int_reduce_cols(op, p, n, m, tda, z);
+    else if (dim == 2 || byrows)
+      for (size_t i = 0; i < n; i++)
+	z[i] = int_reduce(op, p+i*tda, m, 1);
+    else
+      z[0] = int_reduce(op, p, n*m, 1);
+    if (byrows) {
+      // combine the results of the rows
+      int64_t r = z[0];
+      for (size_t i = 1; i < n; i++)
+	switch (op) {
+	case MATRIX_MIN:
+	  r = (z[i]<r)?z[i]:r;
+	  break;
+	case MATRIX_MAX:
+	  r = (z[i]>r)?z[i]:r;
+	  break;
+	default:
+	  r += z[i];
+	  break;
+	}
+      z[0] = r;
+    }
+    if (dim != 0)
+      ret = int64_vector(op, z, n1, m1, (double)count);
+    else if (op == MATRIX_MEAN)
+      ret = pure_double((double)z[0]/(double)count);
+    else
+      ret = int64_value(z[0]);
+    free(z);
+    break;
+  }
+  case EXPR::CMATRIX: {
+    const double *p = ((gsl_matrix_complex*)x->data.mat.p)->data;
+    gsl_matrix_complex *z = create_complex_matrix(byrows?n:n1, m1);
+    if (!z) return 0;
+    if (dim == 1) {
+      if (!complex_reduce_cols(op, p, n, m, tda, z->data)) {
+	gsl_matrix_complex_free(z);
+	return 0;
+      }
+    } else if (dim == 2 || byrows)
+      for (size_t i = 0; i < n; i++)
+	complex_reduce(op, p+2*i*tda, m, 1, z->data+2*i);
+    else
+      complex_reduce(op, p, n*m, 1, z->data);
+    if (byrows) {
+      double r[2];
+      complex_reduce(op, z->data, n, 1, r);
+      z->data[0] = r[0]; z->data[1] = r[1];
+    }
+    if (op == MATRIX_MEAN)
+      for (size_t i = 0; i < 2*n1*m1; i++) z->data[i] /= (double)count;
+    if (dim == 0) {
+      ret = make_complex(z->data[0], z->data[1]);
+      gsl_matrix_complex_free(z);
+    } else
+      ret = pure_complex_matrix(z);
+    break;
+  }
+  }
+  return ret;
+#else
+  return 0;
+#endif
+}
+
+/* Sparse matrices (see matrices.pure). These are stored in compressed sparse
+   row (CSR) format, see runtime.h for details. Sparse matrices are
+   immutable, so the storage is never shared between different matrices. */
+
+static void sparse_free(sparse_matrix *s)
+{
+  if (s) {
+    free(s->rowptr); free(s->colidx); free(s->data);
+    free(s);
+  }
+}
+
+static sparse_matrix *sparse_alloc(size_t n, size_t m, size_t nnz,
+				   size_t size)
+{
+  sparse_matrix *s = (sparse_matrix*)malloc(sizeof(sparse_matrix));
+  if (!s) return 0;
+  s->size1 = n; s->size2 = m; s->nnz = nnz;
+  s->rowptr = (size_t*)calloc(n+1, sizeof(size_t));
+  s->colidx = (size_t*)malloc((nnz>0?nnz:1)*sizeof(size_t));
+  s->data = malloc((nnz>0?nnz:1)*size);
+  if (!s->rowptr || !s->colidx || !s->data) {
+    sparse_free(s);
+    return 0;
+  }
+  return s;
+}
+
+static pure_expr *pure_sparse_matrix(int32_t tag, sparse_matrix *s)
+{
+  if (!s) return 0;
+  pure_expr *x = new_expr();
+  x->tag = tag;
+  x->data.mat.p = s;
+  x->data.mat.refc = new uint32_t;
+  *x->data.mat.refc = 1;
+  MEMDEBUG_NEW(x)
+  return x;
+}
+
+static inline bool is_sparse(pure_expr *x)
+{
+  return x->tag == EXPR::SDMATRIX || x->tag == EXPR::SIMATRIX;
+}
+
+/* Triplets (i,j,v) read from a list or a matrix. */
+
+struct sparse_entry {
+  size_t i, j;
+  double d;
+  int32_t k;
+};
+
+static bool sparse_entry_less(const sparse_entry& a, const sparse_entry& b)
+{
+  return a.i < b.i || (a.i == b.i && a.j < b.j);
+}
+
+static inline bool get_sparse_index(pure_expr *x, size_t& i)
+{
+  if (x->tag != EXPR::INT || x->data.i < 0) return false;
+  i = x->data.i;
+  return true;
+}
+
+static bool get_sparse_entries(pure_expr *xs, vector<sparse_entry>& es,
+			       bool& dbl)
+{
+  size_t n;
+  pure_expr **elems;
+  dbl = false;
+  if (pure_is_listv(xs, &n, &elems)) {
+    es.resize(n);
+    bool ok = true;
+    for (size_t l = 0; ok && l < n; l++) {
+      size_t k;
+      pure_expr **t;
+      sparse_entry& e = es[l];
+      pure_is_tuplev(elems[l], &k, &t);
+      ok = k == 3 && get_sparse_index(t[0], e.i) &&
+	get_sparse_index(t[1], e.j);
+      if (ok && t[2]->tag == EXPR::INT) {
+	e.k = t[2]->data.i; e.d = (double)e.k;
+      } else if (ok && t[2]->tag == EXPR::DBL) {
+	e.d = t[2]->data.d; e.k = 0; dbl = true;
+      } else
+	ok = false;
+      free(t);
+    }
+    if (elems) free(elems);
+    return ok;
+  }
+#ifdef HAVE_GSL
+  // a matrix with one triplet per row
+  switch (xs->tag) {
+  case EXPR::IMATRIX: {
+    gsl_matrix_int *m = (gsl_matrix_int*)xs->data.mat.p;
+    if (m->size1 > 0 && m->size2 != 3) return false;
+    es.resize(m->size1);
+    for (size_t l = 0; l < m->size1; l++) {
+      const int *p = m->data+l*m->tda;
+      if (p[0] < 0 || p[1] < 0) return false;
+      es[l].i = p[0]; es[l].j = p[1];
+      es[l].k = p[2]; es[l].d = (double)p[2];
+    }
+    return true;
+  }
+  case EXPR::DMATRIX: {
+    gsl_matrix *m = (gsl_matrix*)xs->data.mat.p;
+    if (m->size1 > 0 && m->size2 != 3) return false;
+    es.resize(m->size1);
+    for (size_t l = 0; l < m->size1; l++) {
+      const double *p = m->data+l*m->tda;
+      // indices must be nonnegative integral values
+      if (!(p[0] >= 0.0 && p[1] >= 0.0 && p[0] < 2147483648.0 &&
+	    p[1] < 2147483648.0) || p[0] != floor(p[0]) || p[1] != floor(p[1]))
+	return false;
+      es[l].i = (size_t)p[0]; es[l].j = (size_t)p[1];
+      es[l].d = p[2]; es[l].k = 0;
+    }
+    dbl = true;
+    return true;
+  }
+  default:
+    break;
+  }
+#endif
+  return false;
+}
+
+extern "C"
+pure_expr *sparse_from_triplets(int32_t n, int32_t m, pure_expr *xs)
+{
+  vector<sparse_entry> es;
+  bool dbl;
+  if (n < 0 || m < 0 || !get_sparse_entries(xs, es, dbl)) return 0;
+  for (size_t l = 0; l < es.size(); l++)
+    if (es[l].i >= (size_t)n || es[l].j >= (size_t)m) return 0;
+  stable_sort(es.begin(), es.end(), sparse_entry_less);
+  // add up duplicates
+  size_t nnz = 0;
+  for (size_t l = 0; l < es.size(); ) {
+    sparse_entry e = es[l++];
+    for (; l < es.size() && es[l].i == e.i && es[l].j == e.j; l++) {
+      e.d += es[l].d; e.k += es[l].k;
+    }
+    if (dbl?e.d != 0.0:e.k != 0) es[nnz++] = e;
+  }
+  sparse_matrix *s = sparse_alloc(n, m, nnz, dbl?sizeof(double):sizeof(int));
+  if (!s) return 0;
+  for (size_t l = 0; l < nnz; l++) {
+    s->rowptr[es[l].i+1]++;
+    s->colidx[l] = es[l].j;
+    if (dbl)
+      ((double*)s->data)[l] = es[l].d;
+    else
+      ((int*)s->data)[l] = es[l].k;
+  }
+  for (size_t i = 0; i < (size_t)n; i++)
+    s->rowptr[i+1] += s->rowptr[i];
+  return pure_sparse_matrix(dbl?EXPR::SDMATRIX:EXPR::SIMATRIX, s);
+}
+
+#ifdef HAVE_GSL
+#define SPARSE_FROM_DENSE(T, m, s)					\
+  do {									\
+    const size_t n = m->size1, k = m->size2;				\
+    size_t nnz = 0;							\
+    for (size_t i = 0; i < n; i++)					\
+      for (size_t j = 0; j < k; j++)					\
+	nnz += m->data[i*m->tda+j] != 0;				\
+    s = sparse_alloc(n, k, nnz, sizeof(T));				\
+    if (!s) return 0;							\
+    T *q = (T*)s->data;							\
+    size_t l = 0;							\
+    for (size_t i = 0; i < n; i++) {					\
+      const T *p = m->data+i*m->tda;					\
+      for (size_t j = 0; j < k; j++)					\
+	if (p[j] != 0) {						\
+	  s->colidx[l] = j; q[l++] = p[j];				\
+	}								\
+      s->rowptr[i+1] = l;						\
+    }									\
+  } while (0)
+#endif
+
+extern "C"
+pure_expr *sparse_from_matrix(pure_expr *x)
+{
+#ifdef HAVE_GSL
+  sparse_matrix *s;
+  switch (x->tag) {
+  case EXPR::DMATRIX: {
+    gsl_matrix *m = (gsl_matrix*)x->data.mat.p;
+    SPARSE_FROM_DENSE(double, m, s);
+    return pure_sparse_matrix(EXPR::SDMATRIX, s);
+  }
+  case EXPR::IMATRIX: {
+    gsl_matrix_int *m = (gsl_matrix_int*)x->data.mat.p;
+    SPARSE_FROM_DENSE(int, m, s);
+    return pure_sparse_matrix(EXPR::SIMATRIX, s);
+  }
+  default:
+    return 0;
+  }
+#else
+  return 0;
+#endif
+}
+
+extern "C"
+pure_expr *sparse_to_matrix(pure_expr *x)
+{
+#ifdef HAVE_GSL
+  if (!is_sparse(x)) return 0;
+  sparse_matrix *s = (sparse_matrix*)x->data.mat.p;
+  const size_t n = s->size1, m = s->size2;
+  if (x->tag == EXPR::SDMATRIX) {
+    gsl_matrix *m1 = create_double_matrix(n, m);
+    if (!m1) return 0;
+    const double *q = (double*)s->data;
+    for (size_t i = 0; i < n; i++) {
+      double *p = m1->data+i*m1->tda;
+      for (size_t j = 0; j < m; j++) p[j] = 0.0;
+      for (size_t l = s->rowptr[i]; l < s->rowptr[i+1]; l++)
+	p[s->colidx[l]] = q[l];
+    }
+    return pure_double_matrix(m1);
+  } else {
+    gsl_matrix_int *m1 = create_int_matrix(n, m);
+    if (!m1) return 0;
+    const int *q = (int*)s->data;
+    for (size_t i = 0; i < n; i++) {
+      int *p = m1->data+i*m1->tda;
+      for (size_t j = 0; j < m; j++) p[j] = 0;
+      for (size_t l = s->rowptr[i]; l < s->rowptr[i+1]; l++)
+	p[s->colidx[l]] = q[l];
+    }
+    return pure_int_matrix(m1);
+  }
+#else
+  return 0;
+#endif
+}
+
+extern "C"
+pure_expr *sparse_triplets(pure_expr *x)
+{
+  if (!is_sparse(x)) return 0;
+  sparse_matrix *s = (sparse_matrix*)x->data.mat.p;
+  pure_expr **xs = (pure_expr**)malloc((s->nnz>0?s->nnz:1)*sizeof(pure_expr*));
+  if (!xs) return 0;
+  for (size_t i = 0; i < s->size1; i++)
+    for (size_t l = s->rowptr[i]; l < s->rowptr[i+1]; l++) {
+      pure_expr *v = (x->tag == EXPR::SDMATRIX)?
+	pure_double(((double*)s->data)[l]):pure_int(((int*)s->data)[l]);
+      xs[l] = pure_tuplel(3, pure_int(i), pure_int(s->colidx[l]), v);
+    }
+  pure_expr *ys = pure_listv(s->nnz, xs);
+  free(xs);
+  return ys;
+}
+
+extern "C"
+uint32_t sparse_nnz(pure_expr *x)
+{
+  return is_sparse(x)?((sparse_matrix*)x->data.mat.p)->nnz:0;
+}
+
+extern "C"
+pure_expr *sparse_transpose(pure_expr *x)
+{
+  if (!is_sparse(x)) return 0;
+  sparse_matrix *s = (sparse_matrix*)x->data.mat.p;
+  const size_t size = (x->tag == EXPR::SDMATRIX)?sizeof(double):sizeof(int);
+  sparse_matrix *t = sparse_alloc(s->size2, s->size1, s->nnz, size);
+  if (!t) return 0;
+  // count the elements in each column, then scatter the rows into place
+  // (this visits the rows in order, so the columns stay sorted)
+  for (size_t l = 0; l < s->nnz; l++)
+    t->rowptr[s->colidx[l]+1]++;
+  for (size_t j = 0; j < s->size2; j++)
+    t->rowptr[j+1] += t->rowptr[j];
+  size_t *next = (size_t*)malloc((s->size2>0?s->size2:1)*sizeof(size_t));
+  if (!next) {
+    sparse_free(t);
+    return 0;
+  }
+  memcpy(next, t->rowptr, s->size2*sizeof(size_t));
+  for (size_t i = 0; i < s->size1; i++)
+    for (size_t l = s->rowptr[i]; l < s->rowptr[i+1]; l++) {
+      const size_t k = next[s->colidx[l]]++;
+      t->colidx[k] = i;
+      memcpy((char*)t->data+k*size, (char*)s->data+l*size, size);
+    }
+  free(next);
+  return pure_sparse_matrix(x->tag, t);
+}
+
+/* Products of sparse and dense matrices. With a sparse matrix on the left,
+   each row of the result is a linear combination of rows of the dense
+   matrix, with a sparse matrix on the right, each row of the dense matrix
+   scales rows of the sparse matrix. Either way, the dense data is traversed
+   in row order. */
+
+#ifdef HAVE_GSL
+template <class T, class S, class U>
+static void sparse_dense_mul(const sparse_matrix *s, const S *sd,
+			     const U *d, size_t dtda, size_t k,
+			     T *z, size_t ztda)
+{
+  for (size_t i = 0; i < s->size1; i++) {
+    T *r = z+i*ztda;
+    for (size_t j = 0; j < k; j++) r[j] = 0;
+    for (size_t l = s->rowptr[i]; l < s->rowptr[i+1]; l++) {
+      const T v = sd[l];
+      const U *q = d+s->colidx[l]*dtda;
+      for (size_t j = 0; j < k; j++) r[j] += v*q[j];
+    }
+  }
+}
+
+template <class T, class S, class U>
+static void dense_sparse_mul(const U *d, size_t dtda, size_t n,
+			     const sparse_matrix *s, const S *sd,
+			     T *z, size_t ztda)
+{
+  for (size_t r = 0; r < n; r++) {
+    T *p = z+r*ztda;
+    const U *q = d+r*dtda;
+    for (size_t j = 0; j < s->size2; j++) p[j] = 0;
+    for (size_t i = 0; i < s->size1; i++) {
+      const T v = q[i];
+      if (v == 0) continue;
+      for (size_t l = s->rowptr[i]; l < s->rowptr[i+1]; l++)
+	p[s->colidx[l]] += v*sd[l];
+    }
+  }
+}
+#endif
+
+extern "C"
+pure_expr *sparse_mul(pure_expr *x, pure_expr *y)
+{
+#ifdef HAVE_GSL
+  const bool left = is_sparse(x);
+  pure_expr *sx = left?x:y, *dx = left?y:x;
+  if (!is_sparse(sx) ||
+      (dx->tag != EXPR::DMATRIX && dx->tag != EXPR::IMATRIX))
+    return 0;
+  sparse_matrix *s = (sparse_matrix*)sx->data.mat.p;
+  // dimensions and stride of the dense operand
+  gsl_matrix *dm = (gsl_matrix*)dx->data.mat.p;
+  const size_t dn = dm->size1, dk = dm->size2, dtda = dm->tda;
+  if (left?dn != s->size2:dk != s->size1) return 0;
+  const size_t n = left?s->size1:dn, m = left?dk:s->size2;
+  if (sx->tag == EXPR::SIMATRIX && dx->tag == EXPR::IMATRIX) {
+    // int result
+    gsl_matrix_int *z = create_int_matrix(n, m);
+    if (!z) return 0;
+    const int *sd = (int*)s->data, *d = ((gsl_matrix_int*)dm)->data;
+    // unsigned arithmetic, so that the result wraps around like int_matmul
+    unsigned *zd = (unsigned*)z->data;
+    if (left)
+      sparse_dense_mul(s, sd, d, dtda, dk, zd, z->tda);
+    else
+      dense_sparse_mul(d, dtda, dn, s, sd, zd, z->tda);
+    return pure_int_matrix(z);
+  }
+  gsl_matrix *z = create_double_matrix(n, m);
+  if (!z) return 0;
+  if (sx->tag == EXPR::SDMATRIX) {
+    const double *sd = (double*)s->data;
+    if (dx->tag == EXPR::DMATRIX) {
+      const double *d = dm->data;
+      if (left)
+	sparse_dense_mul(s, sd, d, dtda, dk, z->data, z->tda);
+      else
+	dense_sparse_mul(d, dtda, dn, s, sd, z->data, z->tda);
+    } else {
+      const int *d = ((gsl_matrix_int*)dm)->data;
+      if (left)
+	sparse_dense_mul(s, sd, d, dtda, dk, z->data, z->tda);
+      else
+	dense_sparse_mul(d, dtda, dn, s, sd, z->data, z->tda);
+    }
+  } else {
+    const int *sd = (int*)s->data;
+    const double *d = dm->data;
+    if (left)
+      sparse_dense_mul(s, sd, d, dtda, dk, z->data, z->tda);
+    else
+      dense_sparse_mul(d, dtda, dn, s, sd, z->data, z->tda);
+  }
+  return pure_double_matrix(z);
+#else
+  return 0;
+#endif
+}
+
+/* Bulk parsing of numeric data. The input is scanned only once, collecting
+   the values in a growing buffer which is copied to the matrix at the end.
+   Field delimiters, blanks and line ends are looked up in a character class
+   table. */
+
+enum { PARSE_OTHER, PARSE_BLANK, PARSE_DELIM, PARSE_EOL };
+
+static inline bool parse_int(const char *&s, const char *end, int *x)
+{
+  const char *p = s;
+  bool neg = false;
+  if (p < end && (*p == '+' || *p == '-')) neg = *p++ == '-';
+  if (p >= end || *p < '0' || *p > '9') return false;
+  int64_t v = 0;
+  while (p < end && *p >= '0' && *p <= '9') {
+    v = 10*v + (*p++ - '0');
+    if (v > (int64_t)INT_MAX+1) return false;
+  }
+  if (neg) v = -v;
+  if (v > INT_MAX) return false;
+  *x = (int)v; s = p;
+  return true;
+}
+
+static inline bool parse_double(const char *&s, const char *end, double *x)
+{
+  char *p;
+  *x = my_strntod(s, end-s, &p);
+  if (p == s) return false;
+  s = p;
+  return true;
+}
+
+static pure_expr *parse_matrix(const void *buf, int64_t n,
+			       const char *delims, bool dbl)
+{
+#ifdef HAVE_GSL
+  const char *s = (const char*)buf, *end = s+(n<0?strlen(s):n);
+  char cls[256];
+  memset(cls, PARSE_OTHER, sizeof(cls));
+  cls[(unsigned char)' '] = cls[(unsigned char)'\t'] =
+    cls[(unsigned char)'\r'] = PARSE_BLANK;
+  for (const char *d = delims; *d; d++)
+    cls[(unsigned char)*d] = PARSE_DELIM;
+  cls[(unsigned char)'\n'] = PARSE_EOL;
+  const size_t size = dbl?sizeof(double):sizeof(int);
+  size_t nrows = 0, ncols = 0, k = 0, len = 0, cap = 1024;
+  char *data = (char*)malloc(cap*size);
+  bool field = false; // delimiter seen, another field is expected
+  if (!data) return 0;
+  for (;;) {
+    while (s < end && cls[(unsigned char)*s] == PARSE_BLANK) s++;
+    if (s >= end || *s == '\n') {
+      // end of row
+      if (field) goto err;
+      if (k > 0) {
+	if (nrows == 0)
+	  ncols = k;
+	else if (k != ncols)
+	  goto err;
+	nrows++; k = 0;
+      }
+      if (s++ >= end) break;
+      continue;
+    }
+    if (cls[(unsigned char)*s] == PARSE_DELIM) goto err; // empty field
+    if (len == cap) {
+      char *data1 = (char*)realloc(data, 2*cap*size);
+      if (!data1) goto err;
+      data = data1; cap *= 2;
+    }
+    if (!(dbl?parse_double(s, end, (double*)data+len):
+	  parse_int(s, end, (int*)data+len)))
+      goto err;
+    len++; k++; field = false;
+    // the number must be followed by a delimiter or the line end, or by a
+    // blank if there are no delimiters
+    const char *t = s;
+    while (s < end && cls[(unsigned char)*s] == PARSE_BLANK) s++;
+    if (s < end) {
+      switch (cls[(unsigned char)*s]) {
+      case PARSE_DELIM:
+	s++; field = true;
+	break;
+      case PARSE_OTHER:
+	if (*delims || s == t) goto err;
+      }
+    }
+  }
+  {
+    pure_expr *x;
+    if (dbl) {
+      gsl_matrix *m = create_double_matrix(nrows, ncols);
+      if (!m) goto err;
+      if (len > 0) memcpy(m->data, data, len*size);
+      x = pure_double_matrix(m);
+    } else {
+      gsl_matrix_int *m = create_int_matrix(nrows, ncols);
+      if (!m) goto err;
+      if (len > 0) memcpy(m->data, data, len*size);
+      x = pure_int_matrix(m);
+    }
+    free(data);
+    return x;
+  }
+ err:
+  free(data);
+  return 0;
+#else
+  return 0;
+#endif
+}
+
+extern "C"
+pure_expr *matrix_parse_int(const void *p, int64_t n, const char *delims)
+{
+  return parse_matrix(p, n, delims, false);
+}
+
+extern "C"
+pure_expr *matrix_parse_double(const void *p, int64_t n, const char *delims)
+{
+  return parse_matrix(p, n, delims, true);
+}
+
+/* Hash functions. These all compute a 64 bit hash value which is folded to
+   32 bits only at the very end, in hash() below. The mixing steps are those
+   of the 64 bit finalizer of MurmurHash3 and FNV-1a, which are cheap and give
+   a good distribution even for keys which differ only in a few bits. */
+
+static inline uint64_t hash_mix(uint64_t h)
+{
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static inline uint64_t hash_combine(uint64_t h, uint64_t k)
+{
+  h ^= hash_mix(k);
+  h *= 0x9e3779b97f4a7c15ULL;
+  return h ^ (h >> 29);
+}
+
+static uint64_t mpz_hash(const mpz_t z)
+{
+  uint64_t h = 0;
+  int i, len = z->_mp_size;
+  if (len < 0) len = -len;
+  for (i=0; i<len; i++)
+    h = hash_combine(h, (uint64_t)z->_mp_d[i]);
+  if (z->_mp_size < 0)
+    h = ~h;
+  return h;
+}
+
+static uint64_t double_hash(double d)
+{
+  /* Values which are considered the same by same() must get the same hash
+     code, so we normalize -0.0 to 0.0 and all NaNs to a single value. */
+  union { double d; uint64_t u; } v;
+  if (d == 0.0)
+    v.d = 0.0;
+  else if (is_nan(d))
+    return 0x7ff8000000000000ULL;
+  else
+    v.d = d;
+  return hash_mix(v.u);
+}
+
+static uint64_t string_hash(const char *s)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+  while (*s) {
+    h ^= (unsigned char)*(s++);
+    h *= 0x100000001b3ULL;
+  }
+  return hash_mix(h);
+}
+
+/* Hash an atomic (non-application) expression. */
+
+static inline uint64_t atom_hash(pure_expr *x)
+{
+  switch (x->tag) {
+  case EXPR::INT:
+    return (uint64_t)(int64_t)x->data.i;
+  case EXPR::BIGINT:
+    return mpz_hash(x->data.z);
+  case EXPR::DBL:
+    return double_hash(x->data.d);
+  case EXPR::STR:
+    return string_hash(x->data.s);
+  case EXPR::PTR:
+    return (uint64_t)(size_t)x->data.p;
+  default:
+    return (uint64_t)(int64_t)x->tag;
+  }
+}
+
+/* Both hash() and same() traverse their arguments using an explicit stack
+   rather than recursion, so that they work with arbitrarily deep expressions
+   (such as long lists) without running into a stack fault. Only the argument
+   parts of applications are pushed on the stack, so for right-recursive
+   structures like lists and tuples the stack never grows beyond a few
+   elements. */
+
+extern "C"
+uint32_t hash(pure_expr *x)
+{
+  vector<pure_expr*> stk;
+  uint64_t h = 0;
+  for (;;) {
+    if (is_thunk(x)) pure_force(x);
+    if (x->tag == EXPR::APP) {
+      /* Applications are hashed in prefix order, with a marker for each
+	 application node, so that different tree shapes with the same leaves
+	 get different hash values. */
+      h = hash_combine(h, (uint64_t)(int64_t)EXPR::APP);
+      stk.push_back(x->data.x[1]);
+      x = x->data.x[0];
+      continue;
+    }
+    h = hash_combine(h, atom_hash(x));
+    if (stk.empty()) break;
+    x = stk.back(); stk.pop_back();
+  }
+  h = hash_mix(h);
+  return (uint32_t)(h ^ (h>>32));
+}
+
+/* Compare two atomic (non-application, non-symbolic-matrix) expressions of
+   the same type. */
+
+#ifdef HAVE_GSL
+template <class M>
+static bool same_matrix(const M *m1, const M *m2)
+{
+  const size_t tda1 = m1->tda, tda2 = m2->tda;
+  if (m1->size1 != m2->size1 || m1->size2 != m2->size2)
+    return 0;
+  for (size_t i = 0; i < m1->size1; i++)
+    for (size_t j = 0; j < m1->size2; j++)
+      if (m1->data[i*tda1+j] != m2->data[i*tda2+j])
+	return 0;
+  return 1;
+}
+#endif
+
+static bool atom_same(pure_expr *x, pure_expr *y)
+{
+  if (x->tag >= 0 && y->tag >= 0)
+    if (x->data.clos && y->data.clos)
+      /* Note that for global functions the function pointers may differ in
+	 some cases (specifically in the case of an external which may chain
+	 to a Pure definition of the same global). However, in that case we
+	 may safely assume that the functions are the same anyway, since they
+	 are referred to by the same global symbol. */
+      return !x->data.clos->local && !y->data.clos->local ||
+	x->data.clos->fp == y->data.clos->fp;
+    else
+      return x->data.clos == y->data.clos;
+  else {
+    switch (x->tag) {
+    case EXPR::INT:
+      return x->data.i == y->data.i;
+    case EXPR::BIGINT:
+      return mpz_cmp(x->data.z, y->data.z) == 0;
+    case EXPR::DBL:
+      return x->data.d == y->data.d || is_nan(x->data.d) && is_nan(y->data.d);
+    case EXPR::STR:
+      return strcmp(x->data.s, y->data.s) == 0;
+    case EXPR::PTR:
+      return x->data.p == y->data.p;
+#ifdef HAVE_GSL
+    case EXPR::DMATRIX: {
+      gsl_matrix *m1 = (gsl_matrix*)x->data.mat.p;
+      gsl_matrix *m2 = (gsl_matrix*)y->data.mat.p;
+      const size_t tda1 = m1->tda, tda2 = m2->tda;
+      if (m1->size1 != m2->size1 || m1->size2 != m2->size2)
+	return 0;
+      for (size_t i = 0; i < m1->size1; i++)
+	for (size_t j = 0; j < m1->size2; j++)
+	  if (m1->data[i*tda1+j] != m2->data[i*tda2+j])
+	    return 0;
+      return 1;
+    }
+    case EXPR::CMATRIX: {
+      gsl_matrix_complex *m1 = (gsl_matrix_complex*)x->data.mat.p;
+      gsl_matrix_complex *m2 = (gsl_matrix_complex*)y->data.mat.p;
+      const size_t tda1 = m1->tda, tda2 = m2->tda;
+      if (m1->size1 != m2->size1 || m1->size2 != m2->size2)
+	return 0;
+      for (size_t i = 0; i < m1->size1; i++)
+	for (size_t j = 0; j < m1->size2; j++) {
+	  const size_t k1 = 2*(i*tda1+j), k2 = 2*(i*tda2+j);
+	  if (m1->data[k1] != m2->data[k2] ||
+	      m1->data[k1+1] != m2->data[k2+1])
+	    return 0;
+	}
+      return 1;
+    }
+    case EXPR::IMATRIX: {
+      gsl_matrix_int *m1 = (gsl_matrix_int*)x->data.mat.p;
+      gsl_matrix_int *m2 = (gsl_matrix_int*)y->data.mat.p;
+      const size_t tda1 = m1->tda, tda2 = m2->tda;
+      if (m1->size1 != m2->size1 || m1->size2 != m2->size2)
+	return 0;
+      for (size_t i = 0; i < m1->size1; i++)
+	for (size_t j = 0; j < m1->size2; j++)
+	  if (m1->data[i*tda1+j] != m2->data[i*tda2+j])
+	    return 0;
+      return 1;
+    }
+    case EXPR::FMATRIX:
+      return same_matrix((gsl_matrix_float*)x->data.mat.p,
+			 (gsl_matrix_float*)y->data.mat.p);
+    case EXPR::LMATRIX:
+      return same_matrix((gsl_matrix_int64*)x->data.mat.p,
+			 (gsl_matrix_int64*)y->data.mat.p);
+    case EXPR::HMATRIX:
+      return same_matrix((gsl_matrix_short*)x->data.mat.p,
+			 (gsl_matrix_short*)y->data.mat.p);
+    case EXPR::BMATRIX:
+      return same_matrix((gsl_matrix_uchar*)x->data.mat.p,
+			 (gsl_matrix_uchar*)y->data.mat.p);
+#endif
+    case EXPR::SDMATRIX:
+    case EXPR::SIMATRIX: {
+      sparse_matrix *m1 = (sparse_matrix*)x->data.mat.p;
+      sparse_matrix *m2 = (sparse_matrix*)y->data.mat.p;
+      // zeros are never stored, so equal matrices have the same layout
+      if (m1->size1 != m2->size1 || m1->size2 != m2->size2 ||
+	  m1->nnz != m2->nnz ||
+	  memcmp(m1->rowptr, m2->rowptr, (m1->size1+1)*sizeof(size_t)) != 0 ||
+	  memcmp(m1->colidx, m2->colidx, m1->nnz*sizeof(size_t)) != 0)
+	return 0;
+      if (x->tag == EXPR::SIMATRIX)
+	return memcmp(m1->data, m2->data, m1->nnz*sizeof(int)) == 0;
+      // compare doubles like the dense matrices above
+      const double *d1 = (double*)m1->data, *d2 = (double*)m2->data;
+      for (size_t k = 0; k < m1->nnz; k++)
+	if (d1[k] != d2[k])
+	  return 0;
+      return 1;
+    }
+    default:
+      return 1;
+    }
+  }
+}
+
+extern "C"
+bool same(pure_expr *x, pure_expr *y)
+{
+  vector< pair<pure_expr*,pure_expr*> > stk;
+  for (;;) {
+    if (x != y) {
+      if (is_thunk(x)) pure_force(x);
+      if (is_thunk(y)) pure_force(y);
+      if (x->tag != y->tag)
+	return 0;
+      else if (x->tag == EXPR::APP) {
+	/* Descend into the function part first, so that mismatches in the
+	   head symbol are detected early. */
+	stk.push_back(make_pair(x->data.x[1], y->data.x[1]));
+	x = x->data.x[0]; y = y->data.x[0];
+	continue;
+      } else if (x->tag == EXPR::MATRIX) {
+	gsl_matrix_symbolic *m1 = (gsl_matrix_symbolic*)x->data.mat.p;
+	gsl_matrix_symbolic *m2 = (gsl_matrix_symbolic*)y->data.mat.p;
+	const size_t tda1 = m1->tda, tda2 = m2->tda;
+	if (m1->size1 != m2->size1 || m1->size2 != m2->size2)
+	  return 0;
+	for (size_t i = m1->size1; i-- > 0; )
+	  for (size_t j = m1->size2; j-- > 0; )
+	    stk.push_back(make_pair(m1->data[i*tda1+j], m2->data[i*tda2+j]));
+      } else if (!atom_same(x, y))
+	return 0;
+    }
+    if (stk.empty()) return 1;
+    x = stk.back().first; y = stk.back().second;
+    stk.pop_back();
+  }
+}
+
+extern "C"
+bool funp(const pure_expr *x)
+{
+  return (x->tag > 0 && x->data.clos);
+}
+
+extern "C"
+bool lambdap(const pure_expr *x)
+{
+  return (x->tag == 0 && x->data.clos && x->data.clos->n > 0);
+}
+
+extern "C"
+bool thunkp(const pure_expr *x)
+{
+  return (x->tag == 0 && x->data.clos && x->data.clos->n == 0);
+}
+
+extern "C"
+bool varp(const pure_expr *x)
+{
+  return (x->tag > 0 && !x->data.clos);
+}
+
+extern "C"
+int32_t pointer_get_byte(void *ptr)
+{
+  int8_t *p = (int8_t*)ptr;
+  return *p;
+}
+
+extern "C"
+int32_t pointer_get_short(void *ptr)
+{
+  int16_t *p = (int16_t*)ptr;
+  return *p;
+}
+
+extern "C"
+int32_t pointer_get_int(void *ptr)
+{
+  int32_t *p = (int32_t*)ptr;
+  return *p;
+}
+
+extern "C"
+double pointer_get_float(void *ptr)
+{
+  float *p = (float*)ptr;
+  return *p;
+}
+
+extern "C"
+double pointer_get_double(void *ptr)
+{
+  double *p = (double*)ptr;
+  return *p;
+}
+
+extern "C"
+char *pointer_get_string(void *ptr)
+{
+  char **p = (char**)ptr;
+  return *p;
+}
+
+extern "C"
+void *pointer_get_pointer(void *ptr)
+{
+  void **p = (void**)ptr;
+  return *p;
+}
+
+extern "C"
+pure_expr *pointer_get_expr(void *ptr)
+{
+  pure_expr **p = (pure_expr**)ptr;
+  return *p;
+}
+
+extern "C"
+void pointer_put_byte(void *ptr, int32_t x)
+{
+  int8_t *p = (int8_t*)ptr;
+  *p = x;
+}
+
+extern "C"
+void pointer_put_short(void *ptr, int32_t x)
+{
+  int16_t *p = (int16_t*)ptr;
+  *p = x;
+}
+
+extern "C"
+void pointer_put_int(void *ptr, int32_t x)
+{
+  int32_t *p = (int32_t*)ptr;
+  *p = x;
+}
+
+extern "C"
+void pointer_put_float(void *ptr, double x)
+{
+  float *p = (float*)ptr;
+  *p = x;
+}
+
+extern "C"
+void pointer_put_double(void *ptr, double x)
+{
+  double *p = (double*)ptr;
+  *p = x;
+}
+
+extern "C"
+void pointer_put_string(void *ptr, const char *x)
+{
+  char **p = (char**)ptr;
+  *p = strdup(x);
+}
+
+extern "C"
+void pointer_put_pointer(void *ptr, void *x)
+{
+  void **p = (void**)ptr;
+  *p = x;
+}
+
+extern "C"
+void pointer_put_expr(void *ptr, pure_expr *x)
+{
+  pure_expr **p = (pure_expr**)ptr;
+  *p = x;
+}
+
+/* Native hash dictionaries. These are implemented as persistent hash array
+   mapped tries (HAMTs) keyed by the hash() and same() functions above, so
+   they have the same semantics as the hdict type in dict.pure. Each trie node
+   holds a bitmap of the occupied slots (5 bits of the hash code per level)
+   followed by the occupied entries, which are either key-value pairs or
+   subnodes. Keys whose hash codes are identical end up in a "collision" node
+   (bitmap 0) at the bottom of the trie. Nodes are reference-counted and
+   shared between different versions of a dictionary, so that updates only
+   need to copy the nodes along the path to the modified entry. */
+
+struct hdict_node;
+
+struct hdict_entry {
+  uint32_t hash;		// hash code of key (unused for subnodes)
+  pure_expr *key;		// key, NULL for subnodes
+  union {
+    pure_expr *val;		// value
+    hdict_node *sub;		// subnode
+  };
+};
+
+struct hdict_node {
+  uint32_t refc;		// reference count
+  uint32_t bitmap;		// occupied slots, 0 for collision nodes
+  uint32_t n;			// number of entries
+  hdict_entry e[1];		// entries (variable size)
+};
+
+struct hdict {
+  size_t size;			// number of members
+  hdict_node *root;		// root node (NULL if empty)
+};
+
+static inline uint32_t hdict_popcount(uint32_t x)
+{
+#if defined(__GNUC__)
+  return __builtin_popcount(x);
+#else
+  x = x - ((x >> 1) & 0x55555555);
+  x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+  return (((x + (x >> 4)) & 0x0f0f0f0f) * 0x01010101) >> 24;
+#endif
+}
+
+static inline hdict_node *hdict_node_alloc(uint32_t n)
+{
+  hdict_node *nd = (hdict_node*)
+    malloc(sizeof(hdict_node)+(n>0?n-1:0)*sizeof(hdict_entry));
+  assert(nd);
+  nd->refc = 1; nd->bitmap = 0; nd->n = n;
+  return nd;
+}
+
+static inline void hdict_entry_ref(const hdict_entry& e)
+{
+  if (e.key) {
+    pure_new_internal(e.key);
+    pure_new_internal(e.val);
+  } else
+    e.sub->refc++;
+}
+
+static void hdict_node_unref(hdict_node *nd)
+{
+  if (!nd || --nd->refc > 0) return;
+  for (uint32_t i = 0; i < nd->n; i++)
+    if (nd->e[i].key) {
+      pure_free_internal(nd->e[i].key);
+      pure_free_internal(nd->e[i].val);
+    } else
+      hdict_node_unref(nd->e[i].sub);
+  free(nd);
+}
+
+/* Make a copy of a node, leaving room for d additional entries (d may also be
+   -1 if an entry is to be removed; the caller must then fill in the entries
+   accordingly). If skip is a valid index, the corresponding entry is not
+   copied; if ins is a valid index, an empty slot is left at that position. */
+
+static hdict_node *hdict_node_copy(hdict_node *nd, int d,
+				   uint32_t ins, uint32_t skip)
+{
+  hdict_node *nd1 = hdict_node_alloc(nd->n+d);
+  nd1->bitmap = nd->bitmap;
+  for (uint32_t i = 0, j = 0; i < nd->n; i++) {
+    if (i == skip) continue;
+    if (j == ins) j++;
+    nd1->e[j] = nd->e[i];
+    hdict_entry_ref(nd1->e[j]);
+    j++;
+  }
+  return nd1;
+}
+
+static inline void hdict_set_leaf(hdict_entry& e, uint32_t h,
+				  pure_expr *key, pure_expr *val)
+{
+  e.hash = h;
+  e.key = pure_new_internal(key);
+  e.val = pure_new_internal(val);
+}
+
+#define HDICT_BITS 5
+#define HDICT_MASK 31
+
+/* Create a node holding the two given leaves, at the given level. */
+
+static hdict_node *hdict_merge(uint32_t shift, const hdict_entry& e1,
+			       uint32_t h2, pure_expr *key, pure_expr *val)
+{
+  hdict_node *nd;
+  if (shift >= 32) {
+    // collision node
+    nd = hdict_node_alloc(2);
+    nd->e[0] = e1; hdict_entry_ref(nd->e[0]);
+    hdict_set_leaf(nd->e[1], h2, key, val);
+    return nd;
+  }
+  uint32_t i1 = (e1.hash>>shift)&HDICT_MASK, i2 = (h2>>shift)&HDICT_MASK;
+  if (i1 == i2) {
+    nd = hdict_node_alloc(1);
+    nd->bitmap = 1u<<i1;
+    nd->e[0].hash = 0; nd->e[0].key = 0;
+    nd->e[0].sub = hdict_merge(shift+HDICT_BITS, e1, h2, key, val);
+  } else {
+    nd = hdict_node_alloc(2);
+    nd->bitmap = (1u<<i1)|(1u<<i2);
+    uint32_t k1 = i1<i2?0:1, k2 = 1-k1;
+    nd->e[k1] = e1; hdict_entry_ref(nd->e[k1]);
+    hdict_set_leaf(nd->e[k2], h2, key, val);
+  }
+  return nd;
+}
+
+/* Insert a key-value pair into the subtrie nd at the given level. Returns the
+   new subtrie and sets added to true if a new key was added. */
+
+static hdict_node *hdict_insert_node(hdict_node *nd, uint32_t shift,
+				     uint32_t h, pure_expr *key,
+				     pure_expr *val, bool& added)
+{
+  hdict_node *nd1;
+  if (!nd) {
+    nd1 = hdict_node_alloc(1);
+    nd1->bitmap = 1u<<((h>>shift)&HDICT_MASK);
+    hdict_set_leaf(nd1->e[0], h, key, val);
+    added = true;
+    return nd1;
+  } else if (nd->bitmap == 0) {
+    // collision node
+    for (uint32_t i = 0; i < nd->n; i++)
+      if (same(nd->e[i].key, key)) {
+	nd1 = hdict_node_copy(nd, 0, (uint32_t)-1, (uint32_t)-1);
+	pure_free_internal(nd1->e[i].val);
+	nd1->e[i].val = pure_new_internal(val);
+	return nd1;
+      }
+    nd1 = hdict_node_copy(nd, 1, nd->n, (uint32_t)-1);
+    hdict_set_leaf(nd1->e[nd->n], h, key, val);
+    added = true;
+    return nd1;
+  }
+  uint32_t bit = 1u<<((h>>shift)&HDICT_MASK);
+  uint32_t i = hdict_popcount(nd->bitmap&(bit-1));
+  if (!(nd->bitmap&bit)) {
+    // free slot, add a new leaf
+    nd1 = hdict_node_copy(nd, 1, i, (uint32_t)-1);
+    nd1->bitmap |= bit;
+    hdict_set_leaf(nd1->e[i], h, key, val);
+    added = true;
+    return nd1;
+  }
+  hdict_entry& e = nd->e[i];
+  if (!e.key) {
+    // subnode, descend
+    hdict_node *sub =
+      hdict_insert_node(e.sub, shift+HDICT_BITS, h, key, val, added);
+    nd1 = hdict_node_copy(nd, 0, (uint32_t)-1, (uint32_t)-1);
+    hdict_node_unref(nd1->e[i].sub);
+    nd1->e[i].sub = sub;
+  } else if (e.hash == h && same(e.key, key)) {
+    // existing key, replace the value
+    nd1 = hdict_node_copy(nd, 0, (uint32_t)-1, (uint32_t)-1);
+    pure_free_internal(nd1->e[i].val);
+    nd1->e[i].val = pure_new_internal(val);
+  } else {
+    // different key in this slot, push both down one level
+    hdict_node *sub = hdict_merge(shift+HDICT_BITS, e, h, key, val);
+    nd1 = hdict_node_copy(nd, 0, (uint32_t)-1, (uint32_t)-1);
+    pure_free_internal(nd1->e[i].key);
+    pure_free_internal(nd1->e[i].val);
+    nd1->e[i].hash = 0; nd1->e[i].key = 0;
+    nd1->e[i].sub = sub;
+    added = true;
+  }
+  return nd1;
+}
+
+/* Delete a key from the subtrie nd at the given level. Returns the new
+   subtrie (NULL if it becomes empty), or nd itself with an additional
+   reference if the key wasn't found. */
+
+static hdict_node *hdict_delete_node(hdict_node *nd, uint32_t shift,
+				     uint32_t h, pure_expr *key,
+				     bool& removed)
+{
+  hdict_node *nd1;
+  if (nd->bitmap == 0) {
+    // collision node
+    for (uint32_t i = 0; i < nd->n; i++)
+      if (same(nd->e[i].key, key)) {
+	removed = true;
+	if (nd->n == 1) return 0;
+	return hdict_node_copy(nd, -1, (uint32_t)-1, i);
+      }
+    nd->refc++;
+    return nd;
+  }
+  uint32_t bit = 1u<<((h>>shift)&HDICT_MASK);
+  uint32_t i = hdict_popcount(nd->bitmap&(bit-1));
+  if (!(nd->bitmap&bit)) {
+    nd->refc++;
+    return nd;
+  }
+  hdict_entry& e = nd->e[i];
+  if (!e.key) {
+    hdict_node *sub =
+      hdict_delete_node(e.sub, shift+HDICT_BITS, h, key, removed);
+    if (!removed) {
+      hdict_node_unref(sub);
+      nd->refc++;
+      return nd;
+    } else if (!sub) {
+      // subtrie became empty, remove it
+      if (nd->n == 1) return 0;
+      nd1 = hdict_node_copy(nd, -1, (uint32_t)-1, i);
+      nd1->bitmap &= ~bit;
+      return nd1;
+    }
+    nd1 = hdict_node_copy(nd, 0, (uint32_t)-1, (uint32_t)-1);
+    hdict_node_unref(nd1->e[i].sub);
+    if (sub->n == 1 && sub->e[0].key) {
+      // pull up a single remaining leaf
+      nd1->e[i] = sub->e[0];
+      hdict_entry_ref(nd1->e[i]);
+      hdict_node_unref(sub);
+    } else
+      nd1->e[i].sub = sub;
+    return nd1;
+  } else if (e.hash == h && same(e.key, key)) {
+    removed = true;
+    if (nd->n == 1) return 0;
+    nd1 = hdict_node_copy(nd, -1, (uint32_t)-1, i);
+    nd1->bitmap &= ~bit;
+    return nd1;
+  } else {
+    nd->refc++;
+    return nd;
+  }
+}
+
+static hdict_entry *hdict_find(hdict *d, pure_expr *key)
+{
+  hdict_node *nd = d->root;
+  if (!nd) return 0;
+  uint32_t h = ::hash(key), shift = 0;
+  for (;;) {
+    if (nd->bitmap == 0) {
+      for (uint32_t i = 0; i < nd->n; i++)
+	if (same(nd->e[i].key, key))
+	  return &nd->e[i];
+      return 0;
+    }
+    uint32_t bit = 1u<<((h>>shift)&HDICT_MASK);
+    if (!(nd->bitmap&bit)) return 0;
+    hdict_entry& e = nd->e[hdict_popcount(nd->bitmap&(bit-1))];
+    if (!e.key) {
+      nd = e.sub;
+      shift += HDICT_BITS;
+    } else if (e.hash == h && same(e.key, key))
+      return &e;
+    else
+      return 0;
+  }
+}
+
+/* Collect the entries of a trie in a vector. We do this in a non-recursive
+   fashion using an explicit stack; the maximum depth of the trie is 8. */
+
+static void hdict_entries(hdict *d, vector<hdict_entry*>& v)
+{
+  if (!d->root) return;
+  v.reserve(d->size);
+  hdict_node *stk[8]; uint32_t pos[8]; int sp = 0;
+  stk[0] = d->root; pos[0] = 0;
+  while (sp >= 0) {
+    hdict_node *nd = stk[sp];
+    if (pos[sp] >= nd->n) {
+      sp--;
+      continue;
+    }
+    hdict_entry& e = nd->e[pos[sp]++];
+    if (e.key)
+      v.push_back(&e);
+    else {
+      assert(sp < 7);
+      stk[++sp] = e.sub; pos[sp] = 0;
+    }
+  }
+}
+
+extern "C"
+void *hashdict_new(void)
+{
+  hdict *d = new hdict;
+  d->size = 0; d->root = 0;
+  return d;
+}
+
+extern "C"
+void hashdict_free(void *p)
+{
+  hdict *d = (hdict*)p;
+  if (!d) return;
+  hdict_node_unref(d->root);
+  delete d;
+}
+
+extern "C"
+void *hashdict_insert(void *p, pure_expr *key, pure_expr *val)
+{
+  hdict *d = (hdict*)p;
+  if (!d) return 0;
+  bool added = false;
+  hdict *d1 = new hdict;
+  d1->root = hdict_insert_node(d->root, 0, ::hash(key), key, val, added);
+  d1->size = d->size+added;
+  return d1;
+}
+
+extern "C"
+void *hashdict_delete(void *p, pure_expr *key)
+{
+  hdict *d = (hdict*)p;
+  if (!d) return 0;
+  bool removed = false;
+  hdict *d1 = new hdict;
+  if (d->root)
+    d1->root = hdict_delete_node(d->root, 0, ::hash(key), key, removed);
+  else
+    d1->root = 0;
+  d1->size = d->size-removed;
+  return d1;
+}
+
+extern "C"
+pure_expr *hashdict_get(void *p, pure_expr *key)
+{
+  hdict *d = (hdict*)p;
+  if (!d) return 0;
+  hdict_entry *e = hdict_find(d, key);
+  return e?e->val:0;
+}
+
+extern "C"
+bool hashdict_member(void *p, pure_expr *key)
+{
+  hdict *d = (hdict*)p;
+  return d && hdict_find(d, key);
+}
+
+extern "C"
+int32_t hashdict_size(void *p)
+{
+  hdict *d = (hdict*)p;
+  return d?d->size:0;
+}
+
+static pure_expr *hdict_list(void *p, int what)
+{
+  hdict *d = (hdict*)p;
+  if (!d) return 0;
+  vector<hdict_entry*> v;
+  hdict_entries(d, v);
+  pure_expr *f = what==0?pure_const(pure_sym("=>")):0, *y = mk_nil();
+  if (f) pure_new_internal(f);
+  for (size_t i = v.size(); i-- > 0; ) {
+    pure_expr *x;
+    switch (what) {
+    case 0:
+      x = pure_apply2(pure_apply2(f, v[i]->key), v[i]->val);
+      break;
+    case 1:
+      x = v[i]->key;
+      break;
+    default:
+      x = v[i]->val;
+      break;
+    }
+    y = mk_cons(x, y);
+  }
+  if (f) pure_free_internal(f);
+  return y;
+}
+
+extern "C"
+pure_expr *hashdict_members(void *p)
+{
+  return hdict_list(p, 0);
+}
+
+extern "C"
+pure_expr *hashdict_keys(void *p)
+{
+  return hdict_list(p, 1);
+}
+
+extern "C"
+pure_expr *hashdict_vals(void *p)
+{
+  return hdict_list(p, 2);
+}
+
+/* Mutable expression vectors, hash tables, priority queues and string
+   buffers. Unlike the rest of Pure's data structures, these are modified in
+   place, so they provide fast update operations for imperative code which
+   needs them. The expression containers take care of the reference counts
+   of their members, so that, in contrast to the raw pointer_put_expr()
+   operation above, expressions stored in these containers stay alive as
+   long as they are referenced from the container. */
+
+struct expr_vector {
+  size_t size, cap;
+  pure_expr **v;
+};
+
+extern "C"
+void *vector_new(void)
+{
+  expr_vector *v = new expr_vector;
+  v->size = v->cap = 0; v->v = 0;
+  return v;
+}
+
+extern "C"
+void vector_clear(void *p)
+{
+  expr_vector *v = (expr_vector*)p;
+  if (!v) return;
+  for (size_t i = 0; i < v->size; i++)
+    pure_free_internal(v->v[i]);
+  v->size = 0;
+}
+
+extern "C"
+void vector_free(void *p)
+{
+  expr_vector *v = (expr_vector*)p;
+  if (!v) return;
+  vector_clear(v);
+  if (v->v) free(v->v);
+  delete v;
+}
+
+extern "C"
+int32_t vector_size(void *p)
+{
+  expr_vector *v = (expr_vector*)p;
+  return v?v->size:0;
+}
+
+extern "C"
+pure_expr *vector_push(void *p, pure_expr *x)
+{
+  expr_vector *v = (expr_vector*)p;
+  if (!v) return 0;
+  if (v->size >= v->cap) {
+    size_t cap = v->cap?2*v->cap:16;
+    pure_expr **w = (pure_expr**)realloc(v->v, cap*sizeof(pure_expr*));
+    if (!w) return 0;
+    v->v = w; v->cap = cap;
+  }
+  v->v[v->size++] = pure_new_internal(x);
+  return x;
+}
+
+extern "C"
+pure_expr *vector_pop(void *p)
+{
+  expr_vector *v = (expr_vector*)p;
+  if (!v || v->size == 0) return 0;
+  pure_expr *x = v->v[--v->size];
+  pure_unref_internal(x);
+  return x;
+}
+
+extern "C"
+pure_expr *vector_get(void *p, int32_t i)
+{
+  expr_vector *v = (expr_vector*)p;
+  if (!v || i < 0 || (size_t)i >= v->size) return 0;
+  return v->v[i];
+}
+
+extern "C"
+pure_expr *vector_set(void *p, int32_t i, pure_expr *x)
+{
+  expr_vector *v = (expr_vector*)p;
+  if (!v || i < 0 || (size_t)i >= v->size) return 0;
+  pure_new_internal(x);
+  pure_free_internal(v->v[i]);
+  v->v[i] = x;
+  return x;
+}
+
+extern "C"
+pure_expr *vector_list(void *p)
+{
+  expr_vector *v = (expr_vector*)p;
+  if (!v) return 0;
+  return pure_listv(v->size, v->v);
+}
+
+/* Hash tables use open addressing with linear probing, and are resized
+   (doubled) whenever they become more than 3/4 full. Deleted entries are
+   removed by moving subsequent entries of the same probe sequence back, so
+   that no "tombstones" are needed. */
+
+struct hashtable_entry {
+  uint32_t hash;
+  pure_expr *key;		// NULL if the slot is empty
+  pure_expr *val;
+};
+
+struct hashtable {
+  size_t size, cap;		// cap is always a power of 2
+  hashtable_entry *e;
+};
+
+static size_t hashtable_lookup(hashtable *t, uint32_t h, pure_expr *key)
+{
+  const size_t mask = t->cap-1;
+  for (size_t i = h&mask; ; i = (i+1)&mask) {
+    hashtable_entry& e = t->e[i];
+    if (!e.key || (e.hash == h && same(e.key, key)))
+      return i;
+  }
+}
+
+static bool hashtable_resize(hashtable *t, size_t cap)
+{
+  hashtable_entry *e = (hashtable_entry*)calloc(cap, sizeof(hashtable_entry));
+  if (!e) return false;
+  const size_t mask = cap-1;
+  for (size_t i = 0; i < t->cap; i++)
+    if (t->e[i].key) {
+      size_t j = t->e[i].hash&mask;
+      while (e[j].key) j = (j+1)&mask;
+      e[j] = t->e[i];
+    }
+  if (t->e) free(t->e);
+  t->e = e; t->cap = cap;
+  return true;
+}
+
+extern "C"
+void *hashtable_new(void)
+{
+  hashtable *t = new hashtable;
+  t->size = t->cap = 0; t->e = 0;
+  return t;
+}
+
+extern "C"
+void hashtable_clear(void *p)
+{
+  hashtable *t = (hashtable*)p;
+  if (!t) return;
+  for (size_t i = 0; i < t->cap; i++)
+    if (t->e[i].key) {
+      pure_free_internal(t->e[i].key);
+      pure_free_internal(t->e[i].val);
+      t->e[i].key = t->e[i].val = 0;
+    }
+  t->size = 0;
+}
+
+extern "C"
+void hashtable_free(void *p)
+{
+  hashtable *t = (hashtable*)p;
+  if (!t) return;
+  hashtable_clear(t);
+  if (t->e) free(t->e);
+  delete t;
+}
+
+extern "C"
+int32_t hashtable_size(void *p)
+{
+  hashtable *t = (hashtable*)p;
+  return t?t->size:0;
+}
+
+extern "C"
+pure_expr *hashtable_put(void *p, pure_expr *key, pure_expr *val)
+{
+  hashtable *t = (hashtable*)p;
+  if (!t) return 0;
+  if (4*(t->size+1) > 3*t->cap &&
+      !hashtable_resize(t, t->cap?2*t->cap:16))
+    return 0;
+  uint32_t h = ::hash(key);
+  hashtable_entry& e = t->e[hashtable_lookup(t, h, key)];
+  pure_new_internal(val);
+  if (e.key)
+    pure_free_internal(e.val);
+  else {
+    e.hash = h;
+    e.key = pure_new_internal(key);
+    t->size++;
+  }
+  e.val = val;
+  return val;
+}
+
+extern "C"
+pure_expr *hashtable_get(void *p, pure_expr *key)
+{
+  hashtable *t = (hashtable*)p;
+  if (!t || t->size == 0) return 0;
+  return t->e[hashtable_lookup(t, ::hash(key), key)].val;
+}
+
+extern "C"
+bool hashtable_member(void *p, pure_expr *key)
+{
+  hashtable *t = (hashtable*)p;
+  if (!t || t->size == 0) return false;
+  return t->e[hashtable_lookup(t, ::hash(key), key)].key != 0;
+}
+
+extern "C"
+bool hashtable_remove(void *p, pure_expr *key)
+{
+  hashtable *t = (hashtable*)p;
+  if (!t || t->size == 0) return false;
+  const size_t mask = t->cap-1;
+  size_t i = hashtable_lookup(t, ::hash(key), key);
+  if (!t->e[i].key) return false;
+  pure_free_internal(t->e[i].key);
+  pure_free_internal(t->e[i].val);
+  t->size--;
+  // move back subsequent entries of the probe sequence
+  for (size_t j = (i+1)&mask; t->e[j].key; j = (j+1)&mask) {
+    size_t k = t->e[j].hash&mask;
+    if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+      t->e[i] = t->e[j];
+      i = j;
+    }
+  }
+  t->e[i].key = t->e[i].val = 0;
+  return true;
+}
+
+static pure_expr *hashtable_list(void *p, int what)
+{
+  hashtable *t = (hashtable*)p;
+  if (!t) return 0;
+  pure_expr *f = what==0?pure_const(pure_sym("=>")):0, *y = mk_nil();
+  if (f) pure_new_internal(f);
+  for (size_t i = t->cap; i-- > 0; ) {
+    hashtable_entry& e = t->e[i];
+    if (!e.key) continue;
+    pure_expr *x;
+    switch (what) {
+    case 0:
+      x = pure_apply2(pure_apply2(f, e.key), e.val);
+      break;
+    case 1:
+      x = e.key;
+      break;
+    default:
+      x = e.val;
+      break;
+    }
+    y = mk_cons(x, y);
+  }
+  if (f) pure_free_internal(f);
+  return y;
+}
+
+extern "C"
+pure_expr *hashtable_members(void *p)
+{
+  return hashtable_list(p, 0);
+}
+
+extern "C"
+pure_expr *hashtable_keys(void *p)
+{
+  return hashtable_list(p, 1);
+}
+
+extern "C"
+pure_expr *hashtable_vals(void *p)
+{
+  return hashtable_list(p, 2);
+}
+
+/* Priority queues. These are binary min-heaps stored in an expression
+   vector. Members are ordered by the '<' predicate, with fast paths for
+   machine ints and doubles which don't need to call back into Pure.
+
+   Since '<' may raise an exception, which unwinds the C stack, the heap must
+   be left intact whenever we call it. Thus the sift operations do all
+   comparisons before they move anything, and the bulk operations work on a
+   copy in the spare capacity of the vector, so that no temporary storage
+   has to be allocated which might leak. */
+
+static bool pqueue_less(pure_expr *x, pure_expr *y)
+{
+  if (x->tag == EXPR::INT) {
+    if (y->tag == EXPR::INT)
+      return x->data.i < y->data.i;
+    else if (y->tag == EXPR::DBL)
+      return x->data.i < y->data.d;
+  } else if (x->tag == EXPR::DBL) {
+    if (y->tag == EXPR::DBL)
+      return x->data.d < y->data.d;
+    else if (y->tag == EXPR::INT)
+      return x->data.d < y->data.i;
+  }
+  interpreter& interp = *interpreter::g_interp;
+  pure_expr *f = pure_symbol(interp.symtab.less_sym().f);
+  pure_expr *u = pure_apply2(pure_apply2(f, x), y);
+  int32_t res;
+  bool ok = pure_is_int(u, &res);
+  pure_freenew(u);
+  if (!ok) pure_throw(pure_const(interp.symtab.failed_cond_sym().f));
+  return res != 0;
+}
+
+/* Move x up from the hole at i to its place in the heap v. */
+
+static void pqueue_sift_up(pure_expr **v, size_t i, pure_expr *x)
+{
+  size_t k = i;
+  while (k > 0 && pqueue_less(x, v[(k-1)/2])) k = (k-1)/2;
+  while (i > k) {
+    size_t j = (i-1)/2;
+    v[i] = v[j]; i = j;
+  }
+  v[k] = x;
+}
+
+/* Move x down from the hole at i to its place in the heap v[0..n). The path
+   is recorded as a bit mask of the right turns taken on the way down, which
+   has enough bits for any heap that fits into memory. */
+
+static void pqueue_sift_down(pure_expr **v, size_t n, size_t i, pure_expr *x)
+{
+  uint64_t path = 0;
+  size_t depth = 0;
+  for (size_t k = i, j; (j = 2*k+1) < n; k = j, depth++) {
+    if (j+1 < n && pqueue_less(v[j+1], v[j])) {
+      j++; path |= (uint64_t)1<<depth;
+    }
+    if (!pqueue_less(v[j], x)) break;
+  }
+  for (size_t d = 0; d < depth; d++) {
+    size_t j = 2*i+1+((path>>d)&1);
+    v[i] = v[j]; i = j;
+  }
+  v[i] = x;
+}
+
+static bool pqueue_reserve(expr_vector *v, size_t cap)
+{
+  if (cap <= v->cap) return true;
+  pure_expr **w = (pure_expr**)realloc(v->v, cap*sizeof(pure_expr*));
+  if (!w) return false;
+  v->v = w; v->cap = cap;
+  return true;
+}
+
+extern "C"
+void *pqueue_new(void)
+{
+  return vector_new();
+}
+
+extern "C"
+void pqueue_free(void *p)
+{
+  vector_free(p);
+}
+
+extern "C"
+void pqueue_clear(void *p)
+{
+  vector_clear(p);
+}
+
+extern "C"
+int32_t pqueue_size(void *p)
+{
+  return vector_size(p);
+}
+
+extern "C"
+pure_expr *pqueue_push(void *p, pure_expr *x)
+{
+  expr_vector *v = (expr_vector*)p;
+  if (!v) return 0;
+  size_t n = v->size;
+  if (n >= v->cap && !pqueue_reserve(v, v->cap?2*v->cap:16)) return 0;
+  pqueue_sift_up(v->v, n, x);
+  pure_new_internal(x);
+  v->size++;
+  return x;
+}
+
+/* Add all members of a list and restore the heap property afterwards. This
+   takes linear time, so it's much faster than pushing the members one by
+   one if the queue is initially empty. The new heap is built behind the
+   current one and only copied over (and the new members counted) once it
+   is complete. */
+
+extern "C"
+pure_expr *pqueue_push_list(void *p, pure_expr *xs)
+{
+  expr_vector *v = (expr_vector*)p;
+  if (!v) return 0;
+  size_t n = 0;
+  pure_expr *u = xs, *y, *z;
+  while (is_cons(u, y, z)) { u = z; n++; }
+  if (!is_nil(u)) return 0;
+  if (n == 0) return xs;
+  size_t m = v->size+n;
+  if (!pqueue_reserve(v, 2*m)) return 0;
+  pure_expr **w = v->v+m;
+  memcpy(w, v->v, v->size*sizeof(pure_expr*));
+  size_t k = v->size;
+  for (u = xs; is_cons(u, y, z); u = z) w[k++] = y;
+  for (size_t i = m/2; i-- > 0; )
+    pqueue_sift_down(w, m, i, w[i]);
+  for (u = xs; is_cons(u, y, z); u = z) pure_new_internal(y);
+  memcpy(v->v, w, m*sizeof(pure_expr*));
+  v->size = m;
+  return xs;
+}
+
+extern "C"
+pure_expr *pqueue_top(void *p)
+{
+  expr_vector *v = (expr_vector*)p;
+  if (!v || v->size == 0) return 0;
+  return v->v[0];
+}
+
+extern "C"
+pure_expr *pqueue_pop(void *p)
+{
+  expr_vector *v = (expr_vector*)p;
+  if (!v || v->size == 0) return 0;
+  pure_expr *x = v->v[0];
+  size_t n = v->size-1;
+  if (n > 0) pqueue_sift_down(v->v, n, 0, v->v[n]);
+  v->size = n;
+  pure_unref_internal(x);
+  return x;
+}
+
+/* List the members in ascending order. We heapsort a copy of the queue, so
+   that the queue itself is left intact. */
+
+extern "C"
+pure_expr *pqueue_list(void *p)
+{
+  expr_vector *v = (expr_vector*)p;
+  if (!v) return 0;
+  size_t n = v->size;
+  if (n == 0) return mk_nil();
+  if (!pqueue_reserve(v, 2*n)) return 0;
+  pure_expr **w = v->v+n;
+  memcpy(w, v->v, n*sizeof(pure_expr*));
+  for (size_t k = n; --k > 0; ) {
+    pure_expr *x = w[0]; w[0] = w[k];
+    pqueue_sift_down(w, k, 0, w[0]);
+    w[k] = x;
+  }
+  // w is now in descending order
+  pure_expr *y = mk_nil();
+  for (size_t i = 0; i < n; i++)
+    y = mk_cons(w[i], y);
+  return y;
+}
+
+/* String buffers. These accumulate a string in a malloc'ed buffer which grows
+   geometrically, so that building a string from n pieces takes linear
+   time. strbuf_string hands the buffer over to a new string expression
+   (without copying) and leaves an empty buffer behind. */
+
+struct strbuf {
+  size_t size, cap;
+  char *s;
+};
+
+static bool strbuf_reserve(strbuf *b, size_t n)
+{
+  if (b->size+n < b->cap) return true;
+  size_t cap = b->cap>0?b->cap:64;
+  while (cap <= b->size+n) cap *= 2;
+  char *s = (char*)realloc(b->s, cap);
+  if (!s) return false;
+  b->s = s; b->cap = cap;
+  return true;
+}
+
+static bool strbuf_add_chars(strbuf *b, const char *s, size_t n)
+{
+  if (!strbuf_reserve(b, n)) return false;
+  memcpy(b->s+b->size, s, n);
+  b->size += n; b->s[b->size] = 0;
+  return true;
+}
+
+extern "C"
+void *strbuf_new(void)
+{
+  strbuf *b = (strbuf*)malloc(sizeof(strbuf));
+  if (b) { b->size = b->cap = 0; b->s = 0; }
+  return b;
+}
+
+extern "C"
+void strbuf_free(void *p)
+{
+  strbuf *b = (strbuf*)p;
+  if (!b) return;
+  free(b->s);
+  free(b);
+}
+
+extern "C"
+void strbuf_clear(void *p)
+{
+  strbuf *b = (strbuf*)p;
+  if (!b) return;
+  free(b->s);
+  b->size = b->cap = 0; b->s = 0;
+}
+
+extern "C"
+int32_t strbuf_size(void *p)
+{
+  strbuf *b = (strbuf*)p;
+  if (!b) return 0;
+  return b->size;
+}
+
+extern "C"
+bool strbuf_add(void *p, const char *s)
+{
+  strbuf *b = (strbuf*)p;
+  assert(s);
+  if (!b) return false;
+  return strbuf_add_chars(b, s, strlen(s));
+}
+
+extern "C"
+bool strbuf_add_char(void *p, uint32_t c)
+{
+  strbuf *b = (strbuf*)p;
+  if (!b || c == 0) return false;
+  char buf[5];
+  u8char(buf, c);
+  return strbuf_add_chars(b, buf, strlen(buf));
+}
+
+extern "C"
+bool strbuf_add_expr(void *p, pure_expr *x)
+{
+  strbuf *b = (strbuf*)p;
+  assert(x);
+  if (!b) return false;
+  switch (x->tag) {
+  case EXPR::STR:
+    return strbuf_add_chars(b, x->data.s, strlen(x->data.s));
+  case EXPR::INT: {
+    char buf[32];
+    sprintf(buf, "%d", x->data.i);
+    return strbuf_add_chars(b, buf, strlen(buf));
+  }
+  default: {
+    ostringstream os;
+    try {
+      os << x;
+    } catch (err &e) {
+      return false;
+    }
+    const string& s = os.str();
+    return strbuf_add_chars(b, s.c_str(), s.size());
+  }
+  }
+}
+
+extern "C"
+pure_expr *strbuf_string(void *p)
+{
+  strbuf *b = (strbuf*)p;
+  if (!b) return 0;
+  if (!b->s) return pure_string_dup("");
+  char *s = (char*)realloc(b->s, b->size+1);
+  if (!s) s = b->s;
+  b->size = b->cap = 0; b->s = 0;
+  return pure_string(s);
+}
+
+/* Native persistent vectors. These are 32-way tries indexed by position,
+   with the last (partial) leaf kept separately in a "tail" node, as in
+   Clojure's vectors. Thus indexing and updates take O(log32 n) time, while
+   appending an element at the end usually just needs to copy the tail. Each
+   vector also has a start offset into the trie; this allows elements to be
+   removed from and added to the front of the vector as well. Nodes are
+   reference-counted and shared between different versions of a vector, so
+   that updates only need to copy the nodes along the path to the modified
+   member. */
+
+#define PVEC_BITS 5
+#define PVEC_WIDTH 32
+#define PVEC_MASK 31
+
+struct pvec_node {
+  uint32_t refc;		// reference count
+  union {
+    pvec_node *sub[PVEC_WIDTH];	// subnodes (interior nodes)
+    pure_expr *x[PVEC_WIDTH];	// members (leaves)
+  };
+};
+
+struct pvec {
+  size_t start, size;		// trie index of first member, number of members
+  uint32_t shift;		// level of the root node
+  pvec_node *root;		// root node (NULL if empty)
+  pvec_node *tail;		// tail leaf (NULL if empty)
+};
+
+/* The tail holds the members at trie indices tailoff..start+size-1, the
+   trie all the others. */
+
+static inline size_t pvec_tailoff(const pvec *v)
+{
+  size_t end = v->start+v->size;
+  return end>0?((end-1)&~(size_t)PVEC_MASK):0;
+}
+
+static inline pvec_node *pvec_node_alloc()
+{
+  pvec_node *nd = (pvec_node*)calloc(1, sizeof(pvec_node));
+  assert(nd);
+  nd->refc = 1;
+  return nd;
+}
+
+static void pvec_node_unref(pvec_node *nd, uint32_t level)
+{
+  if (!nd || --nd->refc > 0) return;
+  for (uint32_t i = 0; i < PVEC_WIDTH; i++)
+    if (level == 0) {
+      if (nd->x[i]) pure_free_internal(nd->x[i]);
+    } else
+      pvec_node_unref(nd->sub[i], level-PVEC_BITS);
+  free(nd);
+}
+
+/* Make a copy of a node (a new empty node if nd is NULL). */
+
+static pvec_node *pvec_node_copy(pvec_node *nd, uint32_t level)
+{
+  pvec_node *nd1 = pvec_node_alloc();
+  if (!nd) return nd1;
+  for (uint32_t i = 0; i < PVEC_WIDTH; i++)
+    if (level == 0) {
+      if ((nd1->x[i] = nd->x[i])) pure_new_internal(nd1->x[i]);
+    } else {
+      if ((nd1->sub[i] = nd->sub[i])) nd1->sub[i]->refc++;
+    }
+  return nd1;
+}
+
+static bool pvec_node_empty(pvec_node *nd, uint32_t level)
+{
+  for (uint32_t i = 0; i < PVEC_WIDTH; i++)
+    if (level == 0 ? nd->x[i] != 0 : nd->sub[i] != 0)
+      return false;
+  return true;
+}
+
+/* Set the member at trie index j in the subtrie nd at the given level (0 for
+   leaves) to x, which may also be NULL to remove the member. Missing nodes
+   along the path are created as needed. Returns the new subtrie, or NULL if
+   it becomes empty. */
+
+static pvec_node *pvec_assoc(pvec_node *nd, uint32_t level, size_t j,
+			     pure_expr *x)
+{
+  uint32_t i = (j>>level)&PVEC_MASK;
+  pvec_node *nd1 = pvec_node_copy(nd, level);
+  if (level == 0) {
+    if (nd1->x[i]) pure_free_internal(nd1->x[i]);
+    nd1->x[i] = x?pure_new_internal(x):0;
+  } else if (x || nd1->sub[i]) {
+    pvec_node *sub = pvec_assoc(nd1->sub[i], level-PVEC_BITS, j, x);
+    pvec_node_unref(nd1->sub[i], level-PVEC_BITS);
+    nd1->sub[i] = sub;
+  }
+  if (!x && pvec_node_empty(nd1, level)) {
+    free(nd1);
+    return 0;
+  }
+  return nd1;
+}
+
+/* Same as above, but replace the entire leaf holding trie index j (which may
+   also be NULL). The leaf is not copied, the caller passes its reference to
+   the new subtrie. */
+
+static pvec_node *pvec_assoc_leaf(pvec_node *nd, uint32_t level, size_t j,
+				  pvec_node *leaf)
+{
+  uint32_t i = (j>>level)&PVEC_MASK;
+  pvec_node *nd1 = pvec_node_copy(nd, level), *sub;
+  if (level == PVEC_BITS)
+    sub = leaf;
+  else
+    sub = pvec_assoc_leaf(nd1->sub[i], level-PVEC_BITS, j, leaf);
+  pvec_node_unref(nd1->sub[i], level-PVEC_BITS);
+  nd1->sub[i] = sub;
+  if (!leaf && pvec_node_empty(nd1, level)) {
+    free(nd1);
+    return 0;
+  }
+  return nd1;
+}
+
+/* Return the leaf holding trie index j (NULL if none). */
+
+static pvec_node *pvec_leaf(const pvec *v, size_t j)
+{
+  if (j >= pvec_tailoff(v)) return v->tail;
+  pvec_node *nd = v->root;
+  for (uint32_t level = v->shift; nd && level > 0; level -= PVEC_BITS)
+    nd = nd->sub[(j>>level)&PVEC_MASK];
+  return nd;
+}
+
+static inline pure_expr *pvec_at(const pvec *v, size_t i)
+{
+  size_t j = v->start+i;
+  return pvec_leaf(v, j)->x[j&PVEC_MASK];
+}
+
+static pvec *pvec_empty()
+{
+  pvec *v = new pvec;
+  v->start = v->size = 0; v->shift = PVEC_BITS;
+  v->root = v->tail = 0;
+  return v;
+}
+
+static pvec *pvec_dup(const pvec *v)
+{
+  pvec *v1 = new pvec;
+  *v1 = *v;
+  if (v1->root) v1->root->refc++;
+  if (v1->tail) v1->tail->refc++;
+  return v1;
+}
+
+/* Set the member at trie index j in a (fresh) vector to x (NULL to remove
+   the member). The index must be covered by the trie or the tail. */
+
+static void pvec_put(pvec *v, size_t j, pure_expr *x)
+{
+  if (j >= pvec_tailoff(v)) {
+    pvec_node *tail = pvec_assoc(v->tail, 0, j, x);
+    pvec_node_unref(v->tail, 0);
+    v->tail = tail;
+  } else {
+    pvec_node *root = pvec_assoc(v->root, v->shift, j, x);
+    pvec_node_unref(v->root, v->shift);
+    v->root = root;
+  }
+}
+
+/* Make sure that the trie of a (fresh) vector can hold trie index j, adding
+   new root levels as needed. */
+
+static void pvec_grow(pvec *v, size_t j)
+{
+  while (j >> (v->shift+PVEC_BITS)) {
+    if (v->root) {
+      pvec_node *nd = pvec_node_alloc();
+      nd->sub[0] = v->root;
+      v->root = nd;
+    }
+    v->shift += PVEC_BITS;
+  }
+}
+
+/* Build a vector from a sequence of members in linear time. The leaves are
+   filled in order and the interior nodes are then constructed bottom-up, so
+   no path copying is necessary. The start offset is arbitrary; any leaves
+   before the start offset are left empty. */
+
+struct pvec_builder {
+  vector<pvec_node*> leaves;
+  pvec_node *leaf;
+  size_t start, size;
+  uint32_t k;
+  pvec_builder(size_t _start = 0)
+    : leaves(_start>>PVEC_BITS, (pvec_node*)0), leaf(0),
+      start(_start), size(0), k(_start&PVEC_MASK) {}
+  void push(pure_expr *x)
+  {
+    if (!leaf) leaf = pvec_node_alloc();
+    leaf->x[k++] = pure_new_internal(x);
+    size++;
+    if (k == PVEC_WIDTH) {
+      leaves.push_back(leaf);
+      leaf = 0; k = 0;
+    }
+  }
+  pvec *result();
+};
+
+pvec *pvec_builder::result()
+{
+  pvec *v = pvec_empty();
+  if (size == 0) {
+    if (leaf) free(leaf);
+    return v;
+  }
+  v->start = start; v->size = size;
+  if (leaf)
+    v->tail = leaf;
+  else {
+    v->tail = leaves.back();
+    leaves.pop_back();
+  }
+  leaf = 0;
+  // leaves now holds the leaves of the trie; build the levels above them
+  vector<pvec_node*>& nodes = leaves;
+  if (nodes.empty()) return v;
+  for (;;) {
+    size_t n = (nodes.size()+PVEC_MASK)>>PVEC_BITS;
+    for (size_t i = 0; i < n; i++) {
+      pvec_node *nd = 0;
+      for (size_t j = 0; j < PVEC_WIDTH; j++) {
+	size_t k = (i<<PVEC_BITS)+j;
+	if (k >= nodes.size()) break;
+	if (nodes[k]) {
+	  if (!nd) nd = pvec_node_alloc();
+	  nd->sub[j] = nodes[k];
+	}
+      }
+      nodes[i] = nd;
+    }
+    nodes.resize(n);
+    if (n == 1) break;
+    v->shift += PVEC_BITS;
+  }
+  v->root = nodes[0];
+  return v;
+}
+
+extern "C"
+void *pvector_new(void)
+{
+  return pvec_empty();
+}
+
+extern "C"
+void pvector_free(void *p)
+{
+  pvec *v = (pvec*)p;
+  if (!v) return;
+  pvec_node_unref(v->root, v->shift);
+  pvec_node_unref(v->tail, 0);
+  delete v;
+}
+
+extern "C"
+int32_t pvector_size(void *p)
+{
+  pvec *v = (pvec*)p;
+  return v?v->size:0;
+}
+
+extern "C"
+pure_expr *pvector_get(void *p, int32_t i)
+{
+  pvec *v = (pvec*)p;
+  if (!v || i < 0 || (size_t)i >= v->size) return 0;
+  return pvec_at(v, i);
+}
+
+extern "C"
+void *pvector_set(void *p, int32_t i, pure_expr *x)
+{
+  pvec *v = (pvec*)p;
+  if (!v || i < 0 || (size_t)i >= v->size) return 0;
+  pvec *v1 = pvec_dup(v);
+  pvec_put(v1, v->start+i, x);
+  return v1;
+}
+
+extern "C"
+void *pvector_append(void *p, pure_expr *x)
+{
+  pvec *v = (pvec*)p;
+  if (!v) return 0;
+  pvec *v1 = pvec_dup(v);
+  size_t end = v->start+v->size, tailoff = pvec_tailoff(v);
+  if (v->size > 0 && end-tailoff == PVEC_WIDTH) {
+    // the tail is full, move it to the trie
+    pvec_grow(v1, tailoff);
+    v->tail->refc++;
+    pvec_node *root = pvec_assoc_leaf(v1->root, v1->shift, tailoff, v->tail);
+    pvec_node_unref(v1->root, v1->shift);
+    v1->root = root;
+    pvec_node_unref(v1->tail, 0);
+    v1->tail = 0;
+  }
+  v1->size++;
+  pvec_put(v1, end, x);
+  return v1;
+}
+
+extern "C"
+void *pvector_prepend(void *p, pure_expr *x)
+{
+  pvec *v = (pvec*)p;
+  if (!v) return 0;
+  if (v->start > 0) {
+    pvec *v1 = pvec_dup(v);
+    v1->start--; v1->size++;
+    pvec_put(v1, v1->start, x);
+    return v1;
+  }
+  /* No room at the front, rebuild the vector with the new member at the end
+     of a block of free slots which is about as large as the vector itself.
+     Thus a sequence of prepend operations takes amortized constant time per
+     operation. */
+  size_t n = (v->size+PVEC_MASK)&~(size_t)PVEC_MASK;
+  pvec_builder b((n>0?n:PVEC_WIDTH)-1);
+  b.push(x);
+  for (size_t j = v->start, end = v->start+v->size; j < end; ) {
+    pvec_node *leaf = pvec_leaf(v, j);
+    do b.push(leaf->x[j&PVEC_MASK]); while (++j < end && (j&PVEC_MASK));
+  }
+  return b.result();
+}
+
+extern "C"
+void *pvector_rmfirst(void *p)
+{
+  pvec *v = (pvec*)p;
+  if (!v || v->size == 0) return 0;
+  if (v->size == 1) return pvec_empty();
+  pvec *v1 = pvec_dup(v);
+  pvec_put(v1, v->start, 0);
+  v1->start++; v1->size--;
+  return v1;
+}
+
+extern "C"
+void *pvector_rmlast(void *p)
+{
+  pvec *v = (pvec*)p;
+  if (!v || v->size == 0) return 0;
+  if (v->size == 1) return pvec_empty();
+  pvec *v1 = pvec_dup(v);
+  size_t j = v->start+v->size-1, tailoff = pvec_tailoff(v);
+  if (j > tailoff) {
+    pvec_put(v1, j, 0);
+    v1->size--;
+    return v1;
+  }
+  /* The tail only holds the last member, replace it with the last leaf of
+     the trie and remove that leaf from the trie. Remove unused root levels
+     afterwards. */
+  pvec_node *leaf = pvec_leaf(v, tailoff-PVEC_WIDTH);
+  leaf->refc++;
+  pvec_node_unref(v1->tail, 0);
+  v1->tail = leaf;
+  pvec_node *root =
+    pvec_assoc_leaf(v1->root, v1->shift, tailoff-PVEC_WIDTH, 0);
+  pvec_node_unref(v1->root, v1->shift);
+  v1->root = root;
+  v1->size--;
+  tailoff -= PVEC_WIDTH;
+  while (v1->shift > PVEC_BITS && tailoff <= ((size_t)1<<v1->shift)) {
+    pvec_node *nd = v1->root;
+    if (nd) {
+      v1->root = nd->sub[0];
+      if (v1->root) v1->root->refc++;
+      pvec_node_unref(nd, v1->shift);
+    }
+    v1->shift -= PVEC_BITS;
+  }
+  return v1;
+}
+
+extern "C"
+void *pvector_const(pure_expr *x, int32_t n)
+{
+  pvec_builder b;
+  pure_new_internal(x);
+  for (int32_t i = 0; i < n; i++) b.push(x);
+  pure_free_internal(x);
+  return b.result();
+}
+
+extern "C"
+void *pvector_from_list(pure_expr *xs)
+{
+  pure_expr *u = xs, *y, *z;
+  while (is_cons(u, y, z)) u = z;
+  if (!is_nil(u)) return 0;
+  pvec_builder b;
+  for (u = xs; is_cons(u, y, z); u = z) b.push(y);
+  return b.result();
+}
+
+extern "C"
+void *pvector_from_matrix(pure_expr *x)
+{
+  switch (x->tag) {
+  case EXPR::MATRIX:
+#ifdef HAVE_GSL
+  case EXPR::DMATRIX:
+  case EXPR::CMATRIX:
+  case EXPR::IMATRIX:
+#endif
+    break;
+  default:
+    return 0;
+  }
+  pvec_builder b;
+  for (uint32_t i = 0, n = matrix_size(x); i < n; i++)
+    b.push(matrix_elem_at(x, i));
+  return b.result();
+}
+
+extern "C"
+pure_expr *pvector_list(void *p)
+{
+  pvec *v = (pvec*)p;
+  if (!v) return 0;
+  pure_expr *y = mk_nil();
+  for (size_t j = v->start+v->size; j > v->start; ) {
+    pvec_node *leaf = pvec_leaf(v, j-1);
+    do y = mk_cons(leaf->x[(j-1)&PVEC_MASK], y);
+    while (--j > v->start && (j&PVEC_MASK));
+  }
+  return y;
+}
+
+extern "C"
+pure_expr *pvector_matrix(void *p)
+{
+  pvec *v = (pvec*)p;
+  if (!v) return 0;
+  gsl_matrix_symbolic *m = create_symbolic_matrix(1, v->size);
+  if (!m) return 0;
+  for (size_t j = v->start, end = v->start+v->size, i = 0; j < end; ) {
+    pvec_node *leaf = pvec_leaf(v, j);
+    do m->data[i++] = leaf->x[j&PVEC_MASK];
+    while (++j < end && (j&PVEC_MASK));
+  }
+  return pure_symbolic_matrix(m);
+}
+
+#include <errno.h>
+
+extern "C"
+int pure_errno(void)
+{
+  return errno;
+}
+
+extern "C"
+void pure_set_errno(int value)
+{
+  errno = value;
+}
+
+#include <time.h>
+
+extern "C"
+int64_t pure_time(void)
+{
+  return (int64_t)time(NULL);
+}
+
+/* Note that the following are not thread-safe as they use statically
+   allocated buffers. */
+
+extern "C"
+char *pure_ctime(int64_t t)
+{
+  time_t time = (time_t)t;
+  return ctime(&time);
+}
+
+extern "C"
+char *pure_gmtime(int64_t t)
+{
+  time_t time = (time_t)t;
+  return asctime(gmtime(&time));
+}
+
+extern "C"
+char *pure_strftime(const char *format, int64_t t)
+{
+  time_t time = (time_t)t;
+  static char buf[1024];
+  if (!strftime(buf, 1024, format, localtime(&time)))
+    /* The interface to strftime is rather brain-damaged since it returns zero
+       both in case of a buffer overflow and when the resulting string is
+       empty. We just pretend that there cannot be any errors and return an
+       empty string in both cases. */
+    buf[0] = 0;
+  return buf;
+}
+
+#ifdef HAVE_GETTIMEOFDAY
+#include <sys/time.h>
+extern "C"
+double pure_gettimeofday(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return ((double)tv.tv_sec)+((double)tv.tv_usec)*1e-6;
+}
+#else
+#ifdef HAVE_FTIME
+#include <sys/timeb.h>
+extern "C"
+double pure_gettimeofday(void)
+{
+  struct timeb tb;
+  ftime(&tb);
+  return ((double)tb.time)+((double)tb.millitm)*1e-3;
+}
+#else
+extern "C"
+double pure_gettimeofday(void)
+{
+  return (double)time(NULL);
+}
+#endif
+#endif
+
+#ifdef __MINGW32__
+#include <windows.h>
+double pure_nanosleep(double t)
+{
+  if (t > 0.0) {
+    unsigned long secs;
+    unsigned short msecs;
+    double ip, fp;
+    if (t > LONG_MAX) t = LONG_MAX;
+    fp = modf(t, &ip);
+    secs = (unsigned long)ip;
+    msecs = (unsigned short)(fp*1e3);
+    Sleep(secs*1000U+msecs);
+  }
+  return 0.0;
+}
+#else
+double pure_nanosleep(double t)
+{
+  if (t > 0.0) {
+    double ip, fp;
+    unsigned long secs;
+#ifdef HAVE_NANOSLEEP
+    unsigned long nsecs;
+    struct timespec req, rem;
+    fp = modf(t, &ip);
+    if (ip > LONG_MAX) { ip = (double)LONG_MAX; fp = 0.0; }
+    secs = (unsigned long)ip;
+    nsecs = (unsigned long)(fp*1e9);
+    req.tv_sec = secs; req.tv_nsec = nsecs;
+    if (nanosleep(&req, &rem))
+      return ((double)rem.tv_sec)+((double)rem.tv_nsec)*1e-9;
+    else
+      return 0.0;
+#else
+#ifdef HAVE_USLEEP
+    unsigned long usecs;
+    if (t > LONG_MAX) t = LONG_MAX;
+    fp = modf(t, &ip);
+    secs = (unsigned long)ip;
+    usecs = (unsigned long)(fp*1e6);
+    usleep(secs*1000000U+usecs);
+    return 0.0;
+#else
+    fp = modf(t, &ip);
+    if (ip > LONG_MAX) ip = (double)LONG_MAX;
+    secs = (unsigned long)ip;
+    return (double)sleep(secs);
+#endif
+#endif
+  } else
+    return 0.0;
+}
+#endif
+
+#ifdef __MINGW32__
+extern "C"
+FILE *popen(const char *command, const char *type)
+{
+  return _popen(command, type);
+}
+
+extern "C"
+int pclose(FILE *stream)
+{
+  return _pclose(stream);
+}
+
+extern "C"
+unsigned int sleep(unsigned int secs)
+{
+  Sleep(secs*1000);
+  return 0;
+}
+#endif
+
+/* Horrible kludge to get round, trunc and the inverse hyperbolic functions
+   from libmingwex.a (these are in C99, but not in the Windows system
+   libraries, and LLVM doesn't know how to get them either). */
+
+extern "C"
+double __round(double x)
+{
+  return round(x);
+}
+
+extern "C"
+double __trunc(double x)
+{
+  return trunc(x);
+}
+
+extern "C"
+double __asinh(double x)
+{
+  return asinh(x);
+}
+
+extern "C"
+double __acosh(double x)
+{
+  return acosh(x);
+}
+
+extern "C"
+double __atanh(double x)
+{
+  return atanh(x);
+}
+
+extern "C"
+int pure_fprintf(FILE *fp, const char *format)
+{
+  return fprintf(fp, format);
 }
 
 extern "C"
-bool thunkp(const pure_expr *x)
+int pure_fprintf_int(FILE *fp, const char *format, int32_t x)
 {
-  return (x->tag == 0 && x->data.clos && x->data.clos->n == 0);
+  return fprintf(fp, format, x);
 }
 
 extern "C"
-bool varp(const pure_expr *x)
+int pure_fprintf_double(FILE *fp, const char *format, double x)
 {
-  return (x->tag > 0 && !x->data.clos);
+  return fprintf(fp, format, x);
 }
 
 extern "C"
-int32_t pointer_get_byte(void *ptr)
+int pure_fprintf_string(FILE *fp, const char *format, const char *x)
 {
-  int8_t *p = (int8_t*)ptr;
-  return *p;
+  return fprintf(fp, format, x);
 }
 
 extern "C"
-int32_t pointer_get_short(void *ptr)
+int pure_fprintf_pointer(FILE *fp, const char *format, const void *x)
 {
-  int16_t *p = (int16_t*)ptr;
-  return *p;
+  return fprintf(fp, format, x);
 }
 
 extern "C"
-int32_t pointer_get_int(void *ptr)
+int pure_snprintf(char *buf, size_t size, const char *format)
 {
-  int32_t *p = (int32_t*)ptr;
-  return *p;
+  return snprintf(buf, size, format);
 }
 
 extern "C"
-double pointer_get_float(void *ptr)
+int pure_snprintf_int(char *buf, size_t size, const char *format, int32_t x)
 {
-  float *p = (float*)ptr;
-  return *p;
+  return snprintf(buf, size, format, x);
 }
 
 extern "C"
-double pointer_get_double(void *ptr)
+int pure_snprintf_double(char *buf, size_t size, const char *format, double x)
 {
-  double *p = (double*)ptr;
-  return *p;
+  return snprintf(buf, size, format, x);
 }
 
 extern "C"
-char *pointer_get_string(void *ptr)
+int pure_snprintf_string(char *buf, size_t size, const char *format, const char *x)
 {
-  char **p = (char**)ptr;
-  return *p;
+  return snprintf(buf, size, format, x);
 }
 
 extern "C"
-void *pointer_get_pointer(void *ptr)
+int pure_snprintf_pointer(char *buf, size_t size, const char *format, const void *x)
 {
-  void **p = (void**)ptr;
-  return *p;
+  return snprintf(buf, size, format, x);
 }
 
-extern "C"
-pure_expr *pointer_get_expr(void *ptr)
+#define myformat(format) scanf_format((char*)alloca(strlen(format)+3), format)
+
+static inline char *scanf_format(char *buf, const char *format)
 {
-  pure_expr **p = (pure_expr**)ptr;
-  return *p;
+  strcpy(buf, format); strcat(buf, "%n");
+  return buf;
 }
 
 extern "C"
-void pointer_put_byte(void *ptr, int32_t x)
+int pure_fscanf(FILE *fp, const char *format)
 {
-  int8_t *p = (int8_t*)ptr;
-  *p = x;
+  int count = -1;
+  fscanf(fp, myformat(format), &count);
+  return count;
 }
 
 extern "C"
-void pointer_put_short(void *ptr, int32_t x)
+int pure_fscanf_int(FILE *fp, const char *format, int32_t *x)
 {
-  int16_t *p = (int16_t*)ptr;
-  *p = x;
+  // wrap this up in case int on the target platform is not 32 bit
+  int count = -1, y;
+  fscanf(fp, myformat(format), &y, &count);
+  if (count >= 0) *x = y;
+  return count;
 }
 
 extern "C"
-void pointer_put_int(void *ptr, int32_t x)
+int pure_fscanf_double(FILE *fp, const char *format, double *x)
 {
-  int32_t *p = (int32_t*)ptr;
-  *p = x;
+  int count = -1;
+  fscanf(fp, myformat(format), x, &count);
+  return count;
 }
 
 extern "C"
-void pointer_put_float(void *ptr, double x)
+int pure_fscanf_string(FILE *fp, const char *format, const char *x)
 {
-  float *p = (float*)ptr;
-  *p = x;
+  int count = -1;
+  fscanf(fp, myformat(format), x, &count);
+  return count;
 }
 
 extern "C"
-void pointer_put_double(void *ptr, double x)
+int pure_fscanf_pointer(FILE *fp, const char *format, const void **x)
 {
-  double *p = (double*)ptr;
-  *p = x;
+  int count = -1;
+  fscanf(fp, myformat(format), x, &count);
+  return count;
 }
 
 extern "C"
-void pointer_put_string(void *ptr, const char *x)
+int pure_sscanf(const char *buf, const char *format)
 {
-  char **p = (char**)ptr;
-  *p = strdup(x);
+  int count = -1;
+  sscanf(buf, myformat(format), &count);
+  return count;
 }
 
 extern "C"
-void pointer_put_pointer(void *ptr, void *x)
+int pure_sscanf_int(const char *buf, const char *format, int32_t *x)
 {
-  void **p = (void**)ptr;
-  *p = x;
+  // wrap this up in case int on the target platform is not 32 bit
+  int count = -1, y; sscanf(buf, myformat(format), &y, &count);
+  if (count >= 0) *x = y;
+  return count;
 }
 
 extern "C"
-void pointer_put_expr(void *ptr, pure_expr *x)
+int pure_sscanf_double(const char *buf, const char *format, double *x)
 {
-  pure_expr **p = (pure_expr**)ptr;
-  *p = x;
+  int count = -1;
+  sscanf(buf, myformat(format), x, &count);
+  return count;
 }
 
-#include <errno.h>
-
 extern "C"
-int pure_errno(void)
+int pure_sscanf_string(const char *buf, const char *format, char *x)
 {
-  return errno;
+  int count = -1;
+  sscanf(buf, myformat(format), x, &count);
+  return count;
 }
 
 extern "C"
-void pure_set_errno(int value)
+int pure_sscanf_pointer(const char *buf, const char *format, void **x)
 {
-  errno = value;
+  int count = -1;
+  sscanf(buf, myformat(format), x, &count);
+  return count;
 }
 
-#include <time.h>
+/* Buffered line readers. These read a file in large chunks and split it into
+   lines, so that reading a text file takes just one extern call per line and
+   no per-line buffer management in Pure. If the system encoding is utf-8,
+   the lines are handed over to Pure as is, otherwise they are converted with
+   toutf8(). */
 
-extern "C"
-int64_t pure_time(void)
-{
-  return (int64_t)time(NULL);
-}
+#define READER_BUFSZ 0x10000
 
-/* Note that the following are not thread-safe as they use statically
-   allocated buffers. */
+struct line_reader {
+  FILE *fp;
+  char *buf;
+  size_t pos, len, cap;		// current position, end of data, buffer size
+  bool eof, utf8;
+};
 
 extern "C"
-char *pure_ctime(int64_t t)
+void *reader_new(FILE *fp)
 {
-  time_t time = (time_t)t;
-  return ctime(&time);
+  if (!fp) return 0;
+  line_reader *r = (line_reader*)malloc(sizeof(line_reader));
+  if (!r) return 0;
+  r->buf = (char*)malloc(READER_BUFSZ);
+  if (!r->buf) {
+    free(r);
+    return 0;
+  }
+  const char *codeset = default_encoding();
+  r->fp = fp; r->pos = r->len = 0; r->cap = READER_BUFSZ;
+  r->eof = false; r->utf8 = !codeset || strcmp(codeset, "UTF-8") == 0;
+  return r;
 }
 
 extern "C"
-char *pure_gmtime(int64_t t)
+void reader_free(void *p)
 {
-  time_t time = (time_t)t;
-  return asctime(gmtime(&time));
+  line_reader *r = (line_reader*)p;
+  if (!r) return;
+  free(r->buf);
+  free(r);
 }
 
-extern "C"
-char *pure_strftime(const char *format, int64_t t)
+/* Make a string from the line at p, minus the carriage return of a CRLF line
+   end. Returns NULL if we run out of memory. */
+
+static pure_expr *reader_string(line_reader *r, const char *p, size_t n)
 {
-  time_t time = (time_t)t;
-  static char buf[1024];
-  if (!strftime(buf, 1024, format, localtime(&time)))
-    /* The interface to strftime is rather brain-damaged since it returns zero
-       both in case of a buffer overflow and when the resulting string is
-       empty. We just pretend that there cannot be any errors and return an
-       empty string in both cases. */
-    buf[0] = 0;
-  return buf;
+  if (n > 0 && p[n-1] == '\r') n--;
+  char *s = (char*)malloc(n+1);
+  if (!s) return 0;
+  memcpy(s, p, n); s[n] = 0;
+  if (!r->utf8) {
+    char *t = toutf8(s, 0);
+    free(s);
+    if (!t) return 0;
+    s = t;
+  }
+  return pure_string(s);
 }
 
-#ifdef HAVE_GETTIMEOFDAY
-#include <sys/time.h>
 extern "C"
-double pure_gettimeofday(void)
+pure_expr *reader_getline(void *p)
 {
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
-  return ((double)tv.tv_sec)+((double)tv.tv_usec)*1e-6;
+  line_reader *r = (line_reader*)p;
+  if (!r) return 0;
+  size_t k = 0; // number of bytes already scanned
+  for (;;) {
+    char *q = (char*)memchr(r->buf+r->pos+k, '\n', r->len-r->pos-k);
+    if (q) {
+      pure_expr *x = reader_string(r, r->buf+r->pos, q-r->buf-r->pos);
+      r->pos = q-r->buf+1;
+      return x;
+    }
+    k = r->len-r->pos;
+    if (r->eof) {
+      if (k == 0) return mk_nil();
+      pure_expr *x = reader_string(r, r->buf+r->pos, k);
+      r->pos = r->len;
+      return x;
+    }
+    // move the partial line to the beginning of the buffer, enlarge the
+    // buffer if needed, and read the next chunk
+    if (r->pos > 0) {
+      memmove(r->buf, r->buf+r->pos, k);
+      r->len = k; r->pos = 0;
+    }
+    if (r->len == r->cap) {
+      char *buf = (char*)realloc(r->buf, 2*r->cap);
+      if (!buf) return 0;
+      r->buf = buf; r->cap *= 2;
+    }
+    size_t n = fread(r->buf+r->len, 1, r->cap-r->len, r->fp);
+    if (n == 0) r->eof = true;
+    r->len += n;
+  }
 }
-#else
-#ifdef HAVE_FTIME
-#include <sys/timeb.h>
-extern "C"
-double pure_gettimeofday(void)
+
+/* Memory-mapped files. The file is mapped privately (copy-on-write), so that
+   the matrix views created from the mapping can be modified without
+   affecting the file. The mapping is reference-counted; each matrix view
+   holds a reference which is released by pure_free_matrix() when the last
+   matrix sharing the view's data goes away. */
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <fcntl.h>
+#endif
+
+struct mmap_file {
+  uint32_t refc;		// reference counter
+  void *p;			// start of the mapping
+  size_t size;			// size of the mapping
+};
+
+static void mmap_unref(mmap_file *f)
 {
-  struct timeb tb;
-  ftime(&tb);
-  return ((double)tb.time)+((double)tb.millitm)*1e-3;
+  if (--f->refc == 0) {
+#ifndef _WIN32
+    if (f->size > 0) munmap(f->p, f->size);
+#endif
+    free(f);
+  }
 }
-#else
-extern "C"
-double pure_gettimeofday(void)
+
+static void mmap_release(uint32_t *refc)
 {
-  return (double)time(NULL);
+  map<uint32_t*,mmap_file*>::iterator it = mmap_views.find(refc);
+  if (it != mmap_views.end()) {
+    mmap_unref(it->second);
+    mmap_views.erase(it);
+  }
 }
-#endif
-#endif
 
-#ifdef __MINGW32__
-#include <windows.h>
-double pure_nanosleep(double t)
+/* Check that n elements of the given size starting at the given byte offset
+   lie within the mapping, and that the offset is suitably aligned. */
+
+static bool mmap_range(mmap_file *f, int64_t offs, uint64_t n, size_t size)
 {
-  if (t > 0.0) {
-    unsigned long secs;
-    unsigned short msecs;
-    double ip, fp;
-    if (t > LONG_MAX) t = LONG_MAX;
-    fp = modf(t, &ip);
-    secs = (unsigned long)ip;
-    msecs = (unsigned short)(fp*1e3);
-    Sleep(secs*1000U+msecs);
-  }
-  return 0.0;
+  return f && offs >= 0 && offs%size == 0 && (uint64_t)offs <= f->size &&
+    n <= (f->size-offs)/size;
 }
-#else
-double pure_nanosleep(double t)
+
+static pure_expr *mmap_view(mmap_file *f, pure_expr *x, uint64_t n)
 {
-  if (t > 0.0) {
-    double ip, fp;
-    unsigned long secs;
-#ifdef HAVE_NANOSLEEP
-    unsigned long nsecs;
-    struct timespec req, rem;
-    fp = modf(t, &ip);
-    if (ip > LONG_MAX) { ip = (double)LONG_MAX; fp = 0.0; }
-    secs = (unsigned long)ip;
-    nsecs = (unsigned long)(fp*1e9);
-    req.tv_sec = secs; req.tv_nsec = nsecs;
-    if (nanosleep(&req, &rem))
-      return ((double)rem.tv_sec)+((double)rem.tv_nsec)*1e-9;
-    else
-      return 0.0;
-#else
-#ifdef HAVE_USLEEP
-    unsigned long usecs;
-    if (t > LONG_MAX) t = LONG_MAX;
-    fp = modf(t, &ip);
-    secs = (unsigned long)ip;
-    usecs = (unsigned long)(fp*1e6);
-    usleep(secs*1000000U+usecs);
-    return 0.0;
-#else
-    fp = modf(t, &ip);
-    if (ip > LONG_MAX) ip = (double)LONG_MAX;
-    secs = (unsigned long)ip;
-    return (double)sleep(secs);
-#endif
-#endif
-  } else
-    return 0.0;
+  if (x && n > 0) {
+    f->refc++;
+    mmap_views[x->data.mat.refc] = f;
+  }
+  return x;
 }
-#endif
 
-#ifdef __MINGW32__
 extern "C"
-FILE *popen(const char *command, const char *type)
+void *mmap_open(const char *name)
 {
-  return _popen(command, type);
+#ifndef _WIN32
+  int fd = open(name, O_RDONLY);
+  if (fd < 0) return 0;
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return 0;
+  }
+  size_t size = st.st_size;
+  void *p = 0;
+  if (size > 0) {
+    p = mmap(0, size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+      close(fd);
+      return 0;
+    }
+  }
+  close(fd);
+  mmap_file *f = (mmap_file*)malloc(sizeof(mmap_file));
+  if (!f) {
+    if (size > 0) munmap(p, size);
+    return 0;
+  }
+  f->refc = 1; f->p = p; f->size = size;
+  return f;
+#else
+  return 0;
+#endif
 }
 
 extern "C"
-int pclose(FILE *stream)
+void mmap_free(void *p)
 {
-  return _pclose(stream);
+  if (p) mmap_unref((mmap_file*)p);
 }
 
 extern "C"
-unsigned int sleep(unsigned int secs)
+int64_t mmap_size(void *p)
 {
-  Sleep(secs*1000);
-  return 0;
+  mmap_file *f = (mmap_file*)p;
+  return f?f->size:0;
 }
-#endif
-
-/* Horrible kludge to get round, trunc and the inverse hyperbolic functions
-   from libmingwex.a (these are in C99, but not in the Windows system
-   libraries, and LLVM doesn't know how to get them either). */
 
 extern "C"
-double __round(double x)
+pure_expr *mmap_string(void *p, int64_t offs, int64_t n)
 {
-  return round(x);
+  mmap_file *f = (mmap_file*)p;
+  if (n < 0 || !mmap_range(f, offs, n, 1)) return 0;
+  char *buf = (char*)malloc(n+1);
+  if (!buf) return 0;
+  if (n > 0) memcpy(buf, (char*)f->p+offs, n);
+  buf[n] = 0;
+  return pure_string(buf);
 }
 
 extern "C"
-double __trunc(double x)
+pure_expr *mmap_int_matrix(void *p, int64_t offs, uint32_t n1, uint32_t n2)
 {
-  return trunc(x);
+  mmap_file *f = (mmap_file*)p;
+  uint64_t n = (uint64_t)n1*n2;
+  if (!mmap_range(f, offs, n, sizeof(int))) return 0;
+  void *s = (char*)f->p+offs;
+  return mmap_view(f, matrix_from_int_array_nodup(n1, n2, s), n);
 }
 
 extern "C"
-double __asinh(double x)
+pure_expr *mmap_double_matrix(void *p, int64_t offs, uint32_t n1, uint32_t n2)
 {
-  return asinh(x);
+  mmap_file *f = (mmap_file*)p;
+  uint64_t n = (uint64_t)n1*n2;
+  if (!mmap_range(f, offs, n, sizeof(double))) return 0;
+  void *s = (char*)f->p+offs;
+  return mmap_view(f, matrix_from_double_array_nodup(n1, n2, s), n);
 }
 
 extern "C"
-double __acosh(double x)
+pure_expr *mmap_byte_matrix(void *p, int64_t offs, uint32_t n1, uint32_t n2)
 {
-  return acosh(x);
+#ifdef HAVE_GSL
+  mmap_file *f = (mmap_file*)p;
+  uint64_t n = (uint64_t)n1*n2;
+  if (!mmap_range(f, offs, n, 1)) return 0;
+  if (n == 0) return pure_byte_matrix(create_byte_matrix(n1, n2));
+  gsl_matrix_uchar_view v =
+    gsl_matrix_uchar_view_array((unsigned char*)f->p+offs, n1, n2);
+  // take a copy of the view matrix
+  gsl_matrix_uchar *m = (gsl_matrix_uchar*)malloc(sizeof(gsl_matrix_uchar));
+  if (!m) return 0;
+  *m = v.matrix;
+  pure_expr *x = new_expr();
+  x->tag = EXPR::BMATRIX;
+  x->data.mat.p = m;
+  x->data.mat.refc = new uint32_t;
+  *x->data.mat.refc = 1;
+  MEMDEBUG_NEW(x)
+  return mmap_view(f, x, n);
+#else
+  return 0;
+#endif
 }
 
 extern "C"
-double __atanh(double x)
+pure_expr *mmap_parse_int_matrix(void *p, const char *delims)
 {
-  return atanh(x);
+  mmap_file *f = (mmap_file*)p;
+  return f?matrix_parse_int(f->p, f->size, delims):0;
 }
 
 extern "C"
-int pure_fprintf(FILE *fp, const char *format)
+pure_expr *mmap_parse_double_matrix(void *p, const char *delims)
 {
-  return fprintf(fp, format);
+  mmap_file *f = (mmap_file*)p;
+  return f?matrix_parse_double(f->p, f->size, delims):0;
 }
 
-extern "C"
-int pure_fprintf_int(FILE *fp, const char *format, int32_t x)
+/* Binary serialization of expressions (see blob in system.pure). A blob
+   starts with a 16 byte header consisting of the magic "PBLB", the format
+   version, a byte order flag, the size of a GMP limb, a reserved byte, and
+   the total size of the blob in bytes as a 64 bit integer (0 if unknown,
+   i.e., if the blob was written to a file). This is followed by the nodes of
+   the expression in preorder. Each node starts with an opcode byte. Bit 7 of
+   the opcode marks nodes which are referenced more than once; all later
+   references to such a node are encoded as a BLOB_REF to its index in the
+   order in which the shared nodes were written. Symbols are encoded by their
+   print names, which are written only once. Integers, sizes and indices are
+   written as variable-length (LEB128) numbers, all other data in the host
+   byte order. Sparse matrices are written as their dimensions, the number of
+   nonzeros, the length of each row, the column indices and the values. */
+
+enum {
+  BLOB_REF, BLOB_APP, BLOB_INT, BLOB_BIGINT, BLOB_DBL, BLOB_STR, BLOB_PTR,
+  BLOB_SYM, BLOB_SYMDEF, BLOB_MATRIX, BLOB_DMATRIX, BLOB_CMATRIX,
+  BLOB_IMATRIX, BLOB_FMATRIX, BLOB_LMATRIX, BLOB_HMATRIX, BLOB_BMATRIX,
+  BLOB_SDMATRIX, BLOB_SIMATRIX,
+  BLOB_SHARED = 0x80
+};
+
+#define BLOB_HDRSZ 16
+#define BLOB_VERSION 1
+#define BLOB_BUFSZ 0x10000
+
+static inline char blob_big_endian()
 {
-  return fprintf(fp, format, x);
+  const uint16_t x = 1;
+  return *(const char*)&x == 0;
 }
 
-extern "C"
-int pure_fprintf_double(FILE *fp, const char *format, double x)
+static void blob_header(char *hdr, uint64_t size)
 {
-  return fprintf(fp, format, x);
+  memcpy(hdr, "PBLB", 4);
+  hdr[4] = BLOB_VERSION;
+  hdr[5] = blob_big_endian();
+  hdr[6] = sizeof(limb_t);
+  hdr[7] = 0;
+  memcpy(hdr+8, &size, 8);
 }
 
-extern "C"
-int pure_fprintf_string(FILE *fp, const char *format, const char *x)
+static bool blob_check_header(const char *hdr, uint64_t& size)
 {
-  return fprintf(fp, format, x);
+  if (memcmp(hdr, "PBLB", 4) != 0 || hdr[4] != BLOB_VERSION ||
+      hdr[5] != blob_big_endian() || hdr[6] != sizeof(limb_t))
+    return false;
+  memcpy(&size, hdr+8, 8);
+  return true;
 }
 
-extern "C"
-int pure_fprintf_pointer(FILE *fp, const char *format, const void *x)
-{
-  return fprintf(fp, format, x);
+struct blob_writer {
+  FILE *fp;			// output file (0 if writing to memory)
+  char *buf;			// output buffer
+  size_t len, cap;		// buffer size and capacity
+  uint64_t size;		// total number of bytes written
+  bool ok;			// no errors so far?
+  map<const pure_expr*,uint32_t> refs;	// indices of shared nodes
+  map<int32_t,uint32_t> syms;		// indices of symbols
+  blob_writer(FILE *_fp)
+    : fp(_fp), buf((char*)malloc(BLOB_BUFSZ)), len(0), cap(BLOB_BUFSZ),
+      size(0), ok(buf!=0) {}
+};
+
+static void blob_put(blob_writer& w, const void *p, size_t n)
+{
+  if (!w.ok) return;
+  if (w.len+n > w.cap) {
+    if (w.fp) {
+      // flush the buffer, write large chunks directly
+      if (fwrite(w.buf, 1, w.len, w.fp) < w.len) w.ok = false;
+      w.len = 0;
+      if (n > w.cap) {
+	if (fwrite(p, 1, n, w.fp) < n) w.ok = false;
+	w.size += n;
+	return;
+      }
+    } else {
+      size_t cap = w.cap;
+      while (w.len+n > cap) cap *= 2;
+      char *buf = (char*)realloc(w.buf, cap);
+      if (!buf) {
+	w.ok = false;
+	return;
+      }
+      w.buf = buf; w.cap = cap;
+    }
+  }
+  memcpy(w.buf+w.len, p, n);
+  w.len += n; w.size += n;
 }
 
-extern "C"
-int pure_snprintf(char *buf, size_t size, const char *format)
+static inline void blob_putc(blob_writer& w, int c)
 {
-  return snprintf(buf, size, format);
+  if (w.len < w.cap) {
+    w.buf[w.len++] = c; w.size++;
+  } else {
+    char b = c;
+    blob_put(w, &b, 1);
+  }
 }
 
-extern "C"
-int pure_snprintf_int(char *buf, size_t size, const char *format, int32_t x)
+static void blob_put_uint(blob_writer& w, uint64_t n)
 {
-  return snprintf(buf, size, format, x);
+  char buf[10];
+  size_t k = 0;
+  while (n >= 0x80) {
+    buf[k++] = (char)(n|0x80);
+    n >>= 7;
+  }
+  buf[k++] = (char)n;
+  blob_put(w, buf, k);
 }
 
-extern "C"
-int pure_snprintf_double(char *buf, size_t size, const char *format, double x)
+static inline void blob_put_int(blob_writer& w, int64_t n)
 {
-  return snprintf(buf, size, format, x);
+  // zigzag encoding, so that small negative numbers take few bytes, too
+  blob_put_uint(w, ((uint64_t)n<<1)^(uint64_t)(n>>63));
 }
 
-extern "C"
-int pure_snprintf_string(char *buf, size_t size, const char *format, const char *x)
+static void blob_put_rows(blob_writer& w, const void *data,
+			  size_t n1, size_t n2, size_t tda, size_t elsz)
 {
-  return snprintf(buf, size, format, x);
+  const char *p = (const char*)data;
+  blob_put_uint(w, n1);
+  blob_put_uint(w, n2);
+  if (n1 == 0 || n2 == 0)
+    return;
+  else if (tda == n2)
+    blob_put(w, p, n1*n2*elsz);
+  else
+    for (size_t i = 0; i < n1; i++)
+      blob_put(w, p+i*tda*elsz, n2*elsz);
 }
 
-extern "C"
-int pure_snprintf_pointer(char *buf, size_t size, const char *format, const void *x)
+/* This is done non-recursively, so that big lists and other deeply nested
+   structures don't overflow the C stack. Returns false if the expression
+   contains a value which can't be serialized (anonymous or local closures,
+   thunks). */
+
+static bool blob_write(blob_writer& w, const pure_expr *x)
 {
-  return snprintf(buf, size, format, x);
+  interpreter& interp = *interpreter::g_interp;
+  vector<const pure_expr*> stk;
+  stk.push_back(x);
+  while (!stk.empty() && w.ok) {
+    x = stk.back(); stk.pop_back();
+    int op = 0;
+    if (x->refc > 1) {
+      map<const pure_expr*,uint32_t>::iterator it = w.refs.find(x);
+      if (it != w.refs.end()) {
+	blob_putc(w, BLOB_REF);
+	blob_put_uint(w, it->second);
+	continue;
+      }
+      uint32_t k = w.refs.size();
+      w.refs[x] = k;
+      op = BLOB_SHARED;
+    }
+    switch (x->tag) {
+    case EXPR::APP:
+      blob_putc(w, op|BLOB_APP);
+      stk.push_back(x->data.x[1]);
+      stk.push_back(x->data.x[0]);
+      break;
+    case EXPR::INT:
+      blob_putc(w, op|BLOB_INT);
+      blob_put_int(w, x->data.i);
+      break;
+    case EXPR::BIGINT: {
+      int32_t size = x->data.z->_mp_size;
+      blob_putc(w, op|BLOB_BIGINT);
+      blob_put_int(w, size);
+      blob_put(w, x->data.z->_mp_d, abs(size)*sizeof(limb_t));
+      break;
+    }
+    case EXPR::DBL:
+      blob_putc(w, op|BLOB_DBL);
+      blob_put(w, &x->data.d, sizeof(double));
+      break;
+    case EXPR::STR: {
+      size_t n = strlen(x->data.s);
+      blob_putc(w, op|BLOB_STR);
+      blob_put_uint(w, n);
+      blob_put(w, x->data.s, n);
+      break;
+    }
+    case EXPR::PTR:
+      // pointers are meaningless outside the running process
+      blob_putc(w, op|BLOB_PTR);
+      break;
+    case EXPR::MATRIX: {
+      gsl_matrix_symbolic *m = (gsl_matrix_symbolic*)x->data.mat.p;
+      blob_putc(w, op|BLOB_MATRIX);
+      blob_put_uint(w, m->size1);
+      blob_put_uint(w, m->size2);
+      for (size_t i = m->size1; i-- > 0; )
+	for (size_t j = m->size2; j-- > 0; )
+	  stk.push_back(m->data[i*m->tda+j]);
+      break;
+    }
+#ifdef HAVE_GSL
+    case EXPR::DMATRIX: {
+      gsl_matrix *m = (gsl_matrix*)x->data.mat.p;
+      blob_putc(w, op|BLOB_DMATRIX);
+      blob_put_rows(w, m->data, m->size1, m->size2, m->tda, sizeof(double));
+      break;
+    }
+    case EXPR::CMATRIX: {
+      gsl_matrix_complex *m = (gsl_matrix_complex*)x->data.mat.p;
+      blob_putc(w, op|BLOB_CMATRIX);
+      blob_put_rows(w, m->data, m->size1, m->size2, m->tda, 2*sizeof(double));
+      break;
+    }
+    case EXPR::IMATRIX: {
+      gsl_matrix_int *m = (gsl_matrix_int*)x->data.mat.p;
+      blob_putc(w, op|BLOB_IMATRIX);
+      blob_put_rows(w, m->data, m->size1, m->size2, m->tda, sizeof(int));
+      break;
+    }
+    case EXPR::FMATRIX: {
+      gsl_matrix_float *m = (gsl_matrix_float*)x->data.mat.p;
+      blob_putc(w, op|BLOB_FMATRIX);
+      blob_put_rows(w, m->data, m->size1, m->size2, m->tda, sizeof(float));
+      break;
+    }
+    case EXPR::LMATRIX: {
+      gsl_matrix_int64 *m = (gsl_matrix_int64*)x->data.mat.p;
+      blob_putc(w, op|BLOB_LMATRIX);
+      blob_put_rows(w, m->data, m->size1, m->size2, m->tda, sizeof(int64_t));
+      break;
+    }
+    case EXPR::HMATRIX: {
+      gsl_matrix_short *m = (gsl_matrix_short*)x->data.mat.p;
+      blob_putc(w, op|BLOB_HMATRIX);
+      blob_put_rows(w, m->data, m->size1, m->size2, m->tda, sizeof(short));
+      break;
+    }
+    case EXPR::BMATRIX: {
+      gsl_matrix_uchar *m = (gsl_matrix_uchar*)x->data.mat.p;
+      blob_putc(w, op|BLOB_BMATRIX);
+      blob_put_rows(w, m->data, m->size1, m->size2, m->tda,
+		    sizeof(unsigned char));
+      break;
+    }
+#endif
+    case EXPR::SDMATRIX:
+    case EXPR::SIMATRIX: {
+      sparse_matrix *s = (sparse_matrix*)x->data.mat.p;
+      const bool dbl = x->tag == EXPR::SDMATRIX;
+      blob_putc(w, op|(dbl?BLOB_SDMATRIX:BLOB_SIMATRIX));
+      blob_put_uint(w, s->size1);
+      blob_put_uint(w, s->size2);
+      blob_put_uint(w, s->nnz);
+      for (size_t i = 0; i < s->size1; i++)
+	blob_put_uint(w, s->rowptr[i+1]-s->rowptr[i]);
+      for (size_t l = 0; l < s->nnz; l++)
+	blob_put_uint(w, s->colidx[l]);
+      blob_put(w, s->data, s->nnz*(dbl?sizeof(double):sizeof(int)));
+      break;
+    }
+    default: {
+      if (x->tag <= 0 || (x->data.clos && x->data.clos->local))
+	return false;
+      map<int32_t,uint32_t>::iterator it = w.syms.find(x->tag);
+      if (it != w.syms.end()) {
+	blob_putc(w, op|BLOB_SYM);
+	blob_put_uint(w, it->second);
+      } else {
+	const string& s = interp.symtab.sym(x->tag).s;
+	uint32_t k = w.syms.size();
+	w.syms[x->tag] = k;
+	blob_putc(w, op|BLOB_SYMDEF);
+	blob_put_uint(w, s.size());
+	blob_put(w, s.data(), s.size());
+      }
+      break;
+    }
+    }
+  }
+  return w.ok;
 }
 
-#define myformat(format) scanf_format((char*)alloca(strlen(format)+3), format)
+struct blob_reader {
+  FILE *fp;			// input file (0 if reading from memory)
+  const char *p, *end;		// input buffer
+};
 
-static inline char *scanf_format(char *buf, const char *format)
+static bool blob_get(blob_reader& r, void *p, size_t n)
 {
-  strcpy(buf, format); strcat(buf, "%n");
-  return buf;
+  if (r.fp)
+    return fread(p, 1, n, r.fp) == n;
+  else if (n > (size_t)(r.end-r.p))
+    return false;
+  memcpy(p, r.p, n);
+  r.p += n;
+  return true;
 }
 
-extern "C"
-int pure_fscanf(FILE *fp, const char *format)
+static inline int blob_getc(blob_reader& r)
 {
-  int count = -1;
-  fscanf(fp, myformat(format), &count);
-  return count;
+  if (r.fp)
+    return getc(r.fp);
+  else if (r.p < r.end)
+    return (unsigned char)*r.p++;
+  else
+    return EOF;
 }
 
-extern "C"
-int pure_fscanf_int(FILE *fp, const char *format, int32_t *x)
+static bool blob_get_uint(blob_reader& r, uint64_t& n)
 {
-  // wrap this up in case int on the target platform is not 32 bit
-  int count = -1, y;
-  fscanf(fp, myformat(format), &y, &count);
-  if (count >= 0) *x = y;
-  return count;
+  n = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    int c = blob_getc(r);
+    if (c == EOF) return false;
+    n |= (uint64_t)(c&0x7f) << shift;
+    if (!(c&0x80)) return true;
+  }
+  return false;
 }
 
-extern "C"
-int pure_fscanf_double(FILE *fp, const char *format, double *x)
+static bool blob_get_int(blob_reader& r, int64_t& n)
 {
-  int count = -1;
-  fscanf(fp, myformat(format), x, &count);
-  return count;
+  uint64_t u;
+  if (!blob_get_uint(r, u)) return false;
+  n = (int64_t)(u>>1)^-(int64_t)(u&1);
+  return true;
 }
 
-extern "C"
-int pure_fscanf_string(FILE *fp, const char *format, const char *x)
+/* Check that n items of the given size can still be read. This is only
+   possible when reading from memory; it makes sure that corrupt data doesn't
+   make us allocate huge amounts of memory. */
+
+static inline bool blob_avail(blob_reader& r, uint64_t n, size_t size)
 {
-  int count = -1;
-  fscanf(fp, myformat(format), x, &count);
-  return count;
+  return r.fp || n <= (uint64_t)(r.end-r.p)/size;
 }
 
-extern "C"
-int pure_fscanf_pointer(FILE *fp, const char *format, const void **x)
+static bool blob_get_dim(blob_reader& r, size_t& n1, size_t& n2, size_t size)
 {
-  int count = -1;
-  fscanf(fp, myformat(format), x, &count);
-  return count;
+  uint64_t k1, k2;
+  if (!blob_get_uint(r, k1) || !blob_get_uint(r, k2) ||
+      (uint32_t)k1 != k1 || (uint32_t)k2 != k2 || !blob_avail(r, k1*k2, size))
+    return false;
+  n1 = k1; n2 = k2;
+  return true;
+}
+
+/* Decode a single leaf node (everything but applications and symbolic
+   matrices, which are handled in blob_read). Returns NULL if the data is
+   invalid. */
+
+static pure_expr *blob_get_leaf(blob_reader& r, int op,
+				vector<pure_expr*>& refs,
+				vector<pure_expr*>& syms)
+{
+  switch (op) {
+  case BLOB_REF: {
+    uint64_t k;
+    if (!blob_get_uint(r, k) || k >= refs.size()) return 0;
+    return refs[k];
+  }
+  case BLOB_INT: {
+    int64_t i;
+    if (!blob_get_int(r, i) || (int32_t)i != i) return 0;
+    return pure_int((int32_t)i);
+  }
+  case BLOB_BIGINT: {
+    int64_t size;
+    if (!blob_get_int(r, size) || (int32_t)size != size) return 0;
+    size_t n = size<0?-size:size;
+    if (!blob_avail(r, n, sizeof(limb_t))) return 0;
+    vector<limb_t> limbs(n);
+    if (n > 0 && !blob_get(r, &limbs[0], n*sizeof(limb_t))) return 0;
+    return pure_bigint((int32_t)size, n>0?&limbs[0]:0);
+  }
+  case BLOB_DBL: {
+    double d;
+    if (!blob_get(r, &d, sizeof(double))) return 0;
+    return pure_double(d);
+  }
+  case BLOB_STR: {
+    uint64_t n;
+    if (!blob_get_uint(r, n) || !blob_avail(r, n, 1) || (size_t)(n+1) <= n)
+      return 0;
+    char *s = (char*)malloc(n+1);
+    if (!s) return 0;
+    if (!blob_get(r, s, n)) {
+      free(s);
+      return 0;
+    }
+    s[n] = 0;
+    return pure_string(s);
+  }
+  case BLOB_PTR:
+    return pure_pointer(0);
+  case BLOB_SYM: {
+    uint64_t k;
+    if (!blob_get_uint(r, k) || k >= syms.size()) return 0;
+    return syms[k];
+  }
+  case BLOB_SYMDEF: {
+    uint64_t n;
+    if (!blob_get_uint(r, n) || n == 0 || n > 0x10000) return 0;
+    string s(n, 0);
+    if (!blob_get(r, &s[0], n) || strlen(s.c_str()) != n) return 0;
+    // symbols are resolved in the running program, like eval does
+    pure_expr *x = pure_symbol(pure_sym(s.c_str()));
+    if (!x) return 0;
+    syms.push_back(pure_new_internal(x));
+    return x;
+  }
+#ifdef HAVE_GSL
+  case BLOB_DMATRIX: {
+    size_t n1, n2;
+    if (!blob_get_dim(r, n1, n2, sizeof(double))) return 0;
+    gsl_matrix *m = create_double_matrix(n1, n2);
+    if (!m) return 0;
+    if (n1*n2 > 0 && !blob_get(r, m->data, n1*n2*sizeof(double))) {
+      gsl_matrix_free(m);
+      return 0;
+    }
+    return pure_double_matrix(m);
+  }
+  case BLOB_CMATRIX: {
+    size_t n1, n2;
+    if (!blob_get_dim(r, n1, n2, 2*sizeof(double))) return 0;
+    gsl_matrix_complex *m = create_complex_matrix(n1, n2);
+    if (!m) return 0;
+    if (n1*n2 > 0 && !blob_get(r, m->data, n1*n2*2*sizeof(double))) {
+      gsl_matrix_complex_free(m);
+      return 0;
+    }
+    return pure_complex_matrix(m);
+  }
+  case BLOB_IMATRIX: {
+    size_t n1, n2;
+    if (!blob_get_dim(r, n1, n2, sizeof(int))) return 0;
+    gsl_matrix_int *m = create_int_matrix(n1, n2);
+    if (!m) return 0;
+    if (n1*n2 > 0 && !blob_get(r, m->data, n1*n2*sizeof(int))) {
+      gsl_matrix_int_free(m);
+      return 0;
+    }
+    return pure_int_matrix(m);
+  }
+  case BLOB_FMATRIX: {
+    size_t n1, n2;
+    if (!blob_get_dim(r, n1, n2, sizeof(float))) return 0;
+    gsl_matrix_float *m = create_float_matrix(n1, n2);
+    if (!m) return 0;
+    if (n1*n2 > 0 && !blob_get(r, m->data, n1*n2*sizeof(float))) {
+      gsl_matrix_float_free(m);
+      return 0;
+    }
+    return pure_float_matrix(m);
+  }
+  case BLOB_LMATRIX: {
+    size_t n1, n2;
+    if (!blob_get_dim(r, n1, n2, sizeof(int64_t))) return 0;
+    gsl_matrix_int64 *m = create_int64_matrix(n1, n2);
+    if (!m) return 0;
+    if (n1*n2 > 0 && !blob_get(r, m->data, n1*n2*sizeof(int64_t))) {
+      gsl_matrix_int64_free(m);
+      return 0;
+    }
+    return pure_int64_matrix(m);
+  }
+  case BLOB_HMATRIX: {
+    size_t n1, n2;
+    if (!blob_get_dim(r, n1, n2, sizeof(short))) return 0;
+    gsl_matrix_short *m = create_short_matrix(n1, n2);
+    if (!m) return 0;
+    if (n1*n2 > 0 && !blob_get(r, m->data, n1*n2*sizeof(short))) {
+      gsl_matrix_short_free(m);
+      return 0;
+    }
+    return pure_short_matrix(m);
+  }
+  case BLOB_BMATRIX: {
+    size_t n1, n2;
+    if (!blob_get_dim(r, n1, n2, sizeof(unsigned char))) return 0;
+    gsl_matrix_uchar *m = create_byte_matrix(n1, n2);
+    if (!m) return 0;
+    if (n1*n2 > 0 && !blob_get(r, m->data, n1*n2*sizeof(unsigned char))) {
+      gsl_matrix_uchar_free(m);
+      return 0;
+    }
+    return pure_byte_matrix(m);
+  }
+#endif
+  case BLOB_SDMATRIX:
+  case BLOB_SIMATRIX: {
+    const bool dbl = op == BLOB_SDMATRIX;
+    const size_t size = dbl?sizeof(double):sizeof(int);
+    uint64_t n1, n2, nnz;
+    if (!blob_get_uint(r, n1) || !blob_get_uint(r, n2) ||
+	!blob_get_uint(r, nnz) || (uint32_t)n1 != n1 || (uint32_t)n2 != n2 ||
+	nnz > n1*n2 || !blob_avail(r, n1, 1) || !blob_avail(r, nnz, size))
+      return 0;
+    sparse_matrix *s = sparse_alloc(n1, n2, nnz, size);
+    if (!s) return 0;
+    // The data must be in canonical form (ascending column indices in each
+    // row, no zeros), like the matrices created by the sparse functions.
+    bool ok = true;
+    for (size_t i = 0; ok && i < n1; i++) {
+      uint64_t k;
+      ok = blob_get_uint(r, k) && k <= nnz-s->rowptr[i];
+      if (ok) s->rowptr[i+1] = s->rowptr[i]+k;
+    }
+    ok = ok && s->rowptr[n1] == nnz;
+    for (size_t i = 0; ok && i < n1; i++)
+      for (size_t l = s->rowptr[i]; ok && l < s->rowptr[i+1]; l++) {
+	uint64_t j;
+	ok = blob_get_uint(r, j) && j < n2 &&
+	  (l == s->rowptr[i] || j > s->colidx[l-1]);
+	if (ok) s->colidx[l] = j;
+      }
+    if (ok && nnz > 0) ok = blob_get(r, s->data, nnz*size);
+    for (size_t l = 0; ok && l < nnz; l++)
+      ok = dbl?((double*)s->data)[l] != 0.0:((int*)s->data)[l] != 0;
+    if (!ok) {
+      sparse_free(s);
+      return 0;
+    }
+    return pure_sparse_matrix(dbl?EXPR::SDMATRIX:EXPR::SIMATRIX, s);
+  }
+  default:
+    return 0;
+  }
+}
+
+/* Applications and symbolic matrices which are still under construction.
+   The values in these (and in the refs and syms tables) each hold a
+   reference, so that they can be freed if the data turns out to be invalid
+   later. */
+
+struct blob_frame {
+  int op;			// BLOB_APP or BLOB_MATRIX
+  int64_t idx;			// index of a shared node, -1 if none
+  pure_expr *f;			// BLOB_APP: function (0 if not read yet)
+  gsl_matrix_symbolic *m;	// BLOB_MATRIX: matrix, and number of elements
+  size_t n, k;			// total and read so far
+};
+
+static pure_expr *blob_read(blob_reader& r)
+{
+  vector<blob_frame> stk;
+  vector<pure_expr*> refs, syms;
+  pure_expr *x = 0;
+  bool ok = true;
+  while (ok && !x) {
+    int op = blob_getc(r);
+    int64_t idx = -1;
+    if (op == EOF) {
+      ok = false;
+      break;
+    }
+    if (op & BLOB_SHARED) {
+      op &= ~BLOB_SHARED;
+      idx = refs.size();
+      refs.push_back(0);
+    }
+    if (op == BLOB_APP) {
+      blob_frame fr = { op, idx, 0, 0, 0, 0 };
+      stk.push_back(fr);
+      continue;
+    } else if (op == BLOB_MATRIX) {
+      size_t n1, n2;
+      gsl_matrix_symbolic *m;
+      if (!blob_get_dim(r, n1, n2, 1) ||
+	  !(m = create_symbolic_matrix(n1, n2))) {
+	ok = false;
+	break;
+      }
+      if (n1*n2 > 0) {
+	blob_frame fr = { op, idx, 0, m, n1*n2, 0 };
+	stk.push_back(fr);
+	continue;
+      }
+      x = pure_symbolic_matrix(m);
+    } else if (!(x = blob_get_leaf(r, op, refs, syms))) {
+      ok = false;
+      break;
+    }
+    // We have a complete value now. Record it if it's shared, and pass it
+    // on to the enclosing nodes, finishing those that are complete.
+    x = pure_new_internal(x);
+    for (;;) {
+      if (idx >= 0) refs[idx] = pure_new_internal(x);
+      if (stk.empty()) break;
+      blob_frame& fr = stk.back();
+      if (fr.op == BLOB_APP) {
+	if (!fr.f) {
+	  fr.f = x; x = 0;
+	  break;
+	}
+	pure_expr *y = new_expr();
+	y->tag = EXPR::APP;
+	y->data.x[0] = fr.f;
+	y->data.x[1] = x;
+	MEMDEBUG_NEW(y)
+	x = pure_new_internal(y);
+      } else {
+	fr.m->data[fr.k++] = x; x = 0;
+	if (fr.k < fr.n) break;
+	x = pure_new_internal(pure_symbolic_matrix(fr.m));
+	// the matrix holds its own references to the elements now
+	for (size_t i = 0; i < fr.n; i++)
+	  pure_free_internal(fr.m->data[i]);
+      }
+      idx = fr.idx;
+      stk.pop_back();
+    }
+  }
+  if (!ok || !stk.empty()) {
+    // invalid data, get rid of the partial results
+    for (size_t i = 0; i < stk.size(); i++) {
+      blob_frame& fr = stk[i];
+      if (fr.op == BLOB_APP) {
+	if (fr.f) pure_free_internal(fr.f);
+      } else {
+	for (size_t j = 0; j < fr.k; j++)
+	  pure_free_internal(fr.m->data[j]);
+	free(fr.m->data);
+	gsl_matrix_symbolic_free(fr.m);
+      }
+    }
+    if (x) pure_free_internal(x);
+    x = 0;
+  }
+  for (size_t i = 0; i < refs.size(); i++)
+    if (refs[i]) pure_free_internal(refs[i]);
+  for (size_t i = 0; i < syms.size(); i++)
+    pure_free_internal(syms[i]);
+  if (x) pure_unref_internal(x);
+  return x;
 }
 
 extern "C"
-int pure_sscanf(const char *buf, const char *format)
+void *blob(pure_expr *x)
 {
-  int count = -1;
-  sscanf(buf, myformat(format), &count);
-  return count;
+  blob_writer w(0);
+  char hdr[BLOB_HDRSZ];
+  blob_header(hdr, 0);
+  blob_put(w, hdr, BLOB_HDRSZ);
+  if (!blob_write(w, x)) {
+    free(w.buf);
+    return 0;
+  }
+  memcpy(w.buf+8, &w.size, 8);
+  char *buf = (char*)realloc(w.buf, w.len);
+  return buf?buf:w.buf;
 }
 
 extern "C"
-int pure_sscanf_int(const char *buf, const char *format, int32_t *x)
+int64_t blob_size(const void *p)
 {
-  // wrap this up in case int on the target platform is not 32 bit
-  int count = -1, y; sscanf(buf, myformat(format), &y, &count);
-  if (count >= 0) *x = y;
-  return count;
+  uint64_t size;
+  if (!p || !blob_check_header((const char*)p, size) || size < BLOB_HDRSZ)
+    return 0;
+  return size;
 }
 
 extern "C"
-int pure_sscanf_double(const char *buf, const char *format, double *x)
+pure_expr *unblob(const void *p)
 {
-  int count = -1;
-  sscanf(buf, myformat(format), x, &count);
-  return count;
+  int64_t size = blob_size(p);
+  if (size == 0) return 0;
+  blob_reader r = { 0, (const char*)p+BLOB_HDRSZ, (const char*)p+size };
+  return blob_read(r);
 }
 
 extern "C"
-int pure_sscanf_string(const char *buf, const char *format, char *x)
+int64_t fblob(FILE *fp, pure_expr *x)
 {
-  int count = -1;
-  sscanf(buf, myformat(format), x, &count);
-  return count;
+  blob_writer w(fp);
+  char hdr[BLOB_HDRSZ];
+  blob_header(hdr, 0);
+  blob_put(w, hdr, BLOB_HDRSZ);
+  bool res = blob_write(w, x);
+  if (res && w.len > 0 && fwrite(w.buf, 1, w.len, fp) < w.len) w.ok = false;
+  free(w.buf);
+  return !w.ok?-1:res?(int64_t)w.size:0;
 }
 
 extern "C"
-int pure_sscanf_pointer(const char *buf, const char *format, void **x)
+pure_expr *funblob(FILE *fp)
 {
-  int count = -1;
-  sscanf(buf, myformat(format), x, &count);
-  return count;
+  char hdr[BLOB_HDRSZ];
+  uint64_t size;
+  if (fread(hdr, 1, BLOB_HDRSZ, fp) < BLOB_HDRSZ ||
+      !blob_check_header(hdr, size))
+    return 0;
+  blob_reader r = { fp, 0, 0 };
+  return blob_read(r);
 }
 
 #include <fnmatch.h>
@@ -85,6 +85,47 @@ typedef struct _gsl_matrix_symbolic_view
   gsl_matrix_symbolic matrix;
 } gsl_matrix_symbolic_view;
 
+/* GSL's own long matrices have only 32 bit elements on some systems, so we
+   also provide a GSL-like matrix struct for 64 bit integer matrices. */
+
+typedef struct _gsl_block_int64
+{
+  size_t size;
+  int64_t *data;
+} gsl_block_int64;
+
+typedef struct _gsl_matrix_int64
+{
+  size_t size1;
+  size_t size2;
+  size_t tda;
+  int64_t *data;
+  gsl_block_int64 *block;
+  int owner;
+} gsl_matrix_int64;
+
+typedef struct _gsl_matrix_int64_view
+{
+  gsl_matrix_int64 matrix;
+} gsl_matrix_int64_view;
+
+/* Sparse double and int matrices in compressed sparse row (CSR) format. The
+   nnz nonzero elements are stored row by row in data (double or int,
+   depending on the type tag), along with their column indices in colidx,
+   which are in ascending order in each row. The elements of row i are at
+   positions rowptr[i]..rowptr[i+1]-1, so that rowptr has size1+1 entries,
+   with rowptr[0] = 0 and rowptr[size1] = nnz. */
+
+typedef struct _sparse_matrix
+{
+  size_t size1;
+  size_t size2;
+  size_t nnz;
+  size_t *rowptr;
+  size_t *colidx;
+  void *data;
+} sparse_matrix;
+
 /* Blocks of expression memory allocated in one chunk. */
 
 #define MEMSIZE 0x20000 // 128K
@@ -152,8 +193,9 @@ pure_expr *pure_cstring(char *s);
 
 /* Matrix constructors. The given pointer must point to a valid GSL matrix
    struct of the corresponding GSL matrix type (gsl_matrix,
-   gsl_matrix_complex, gsl_matrix_int), or a pointer to the special
-   gsl_matrix_symbolic struct provide by the runtime. (These are just given as
+   gsl_matrix_complex, gsl_matrix_int, gsl_matrix_float, gsl_matrix_short,
+   gsl_matrix_uchar), or a pointer to the special gsl_matrix_symbolic or
+   gsl_matrix_int64 struct provide by the runtime. (These are just given as
    void* here to avoid depending on the GSL headers which might not be
    available for some implementations.) In the case of the _matrix routines,
    the matrix must be allocated dynamically and Pure takes ownership of the
@@ -166,6 +208,10 @@ pure_expr *pure_symbolic_matrix(void *p);
 pure_expr *pure_double_matrix(void *p);
 pure_expr *pure_complex_matrix(void *p);
 pure_expr *pure_int_matrix(void *p);
+pure_expr *pure_float_matrix(void *p);
+pure_expr *pure_int64_matrix(void *p);
+pure_expr *pure_short_matrix(void *p);
+pure_expr *pure_byte_matrix(void *p);
 pure_expr *pure_symbolic_matrix_dup(const void *p);
 pure_expr *pure_double_matrix_dup(const void *p);
 pure_expr *pure_complex_matrix_dup(const void *p);
@@ -635,6 +681,28 @@ pure_expr *string_concat_list(pure_expr *xs);
 pure_expr *string_substr(const char* s, uint32_t pos, uint32_t size);
 int32_t string_index(const char* s, const char *t);
 
+/* Variations of the above operations which take the string expression itself
+   as argument. These cache the size of the string and an index of character
+   positions in the expression when first invoked on a string, so that
+   subsequent operations on the same string take constant time, even if the
+   string contains multibyte characters. */
+
+uint32_t string_expr_size(pure_expr *x);
+pure_expr *string_expr_char_at(pure_expr *x, uint32_t n);
+pure_expr *string_expr_substr(pure_expr *x, uint32_t pos, uint32_t size);
+int32_t string_expr_index(pure_expr *x, const char *t);
+
+/* Split a string into a list of substrings at the given (nonempty)
+   delimiter, split a string at any of the given delimiter characters
+   (skipping empty tokens), join a list of strings with a delimiter, and
+   replace all occurrences of a (nonempty) substring. These take linear time
+   and return NULL to indicate failure. */
+
+pure_expr *string_split(const char *s, const char *delim);
+pure_expr *string_tokenize(const char *s, const char *delims);
+pure_expr *string_join(const char *delim, pure_expr *xs);
+pure_expr *string_replace(const char *s, const char *t, const char *u);
+
 /* Conversions between utf-8 characters and numbers. These convert a Unicode
    character code (code point) to the corresponding utf-8 character, and vice
    versa. */
@@ -667,8 +735,10 @@ const char *lasterr();
    access the "extra" elements in each row, but may be useful if the data
    pointer is passed to an external C routine.) matrix_type determines the
    exact type of a matrix, returning an integer denoting the subtype tag (0 =
-   symbolic, 1 = double, 2 = complex, 3 = integer matrix; -1 is returned if
-   the given object is not a matrix). */
+   symbolic, 1 = double, 2 = complex, 3 = integer, 4 = float, 5 = int64, 6 =
+   short, 7 = byte matrix; 0x11 and 0x13 denote sparse double and integer
+   matrices, -1 is returned if the given object is not a matrix).
+   matrix_size and matrix_dim also work with sparse matrices. */
 
 uint32_t matrix_size(pure_expr *x);
 pure_expr *matrix_dim(pure_expr *x);
@@ -715,11 +785,20 @@ pure_expr *matrix_columns(pure_expr *xs);
 
 pure_expr *matrix_transpose(pure_expr *x);
 
-/* Convert between different types of numeric matrices. */
+/* Convert between different types of numeric matrices. matrix_float,
+   matrix_int64, matrix_short and matrix_byte convert an int, double or
+   compact (float, int64, short or byte) matrix, or a symbolic matrix of
+   ints, bigints and doubles, to the corresponding compact matrix type. These
+   always return a new (packed) matrix; values are converted as with the
+   corresponding C casts. */
 
 pure_expr *matrix_double(pure_expr *x);
 pure_expr *matrix_complex(pure_expr *x);
 pure_expr *matrix_int(pure_expr *x);
+pure_expr *matrix_float(pure_expr *x);
+pure_expr *matrix_int64(pure_expr *x);
+pure_expr *matrix_short(pure_expr *x);
+pure_expr *matrix_byte(pure_expr *x);
 
 /* Extract the real and imaginary parts of a numeric matrix. If the input is a
    complex matrix, the result is a new double matrix. Otherwise the type of
@@ -773,6 +852,136 @@ void *matrix_to_complex_float_array(void *p, pure_expr *x);
 void *matrix_to_short_array(void *p, pure_expr *x);
 void *matrix_to_byte_array(void *p, pure_expr *x);
 
+/* Copy-on-write updates of matrices. matrix_update and matrix_update2
+   replace the element at the given row-major index or row and column,
+   matrix_fill sets all elements to the given value, and matrix_scatter
+   stores the elements of the matrix ys at the row-major indices given by
+   the int matrix is. The matrix is modified in place (and returned) if
+   neither the matrix expression nor its data are shared, otherwise a
+   modified copy is returned. Numeric matrices are converted to a double,
+   complex or symbolic matrix as needed to hold the new values. Returns NULL
+   if an index is out of bounds (in which case the matrix is left
+   unchanged). */
+
+pure_expr *matrix_update(pure_expr *x, int32_t i, pure_expr *y);
+pure_expr *matrix_update2(pure_expr *x, int32_t i, int32_t j, pure_expr *y);
+pure_expr *matrix_fill(pure_expr *x, pure_expr *y);
+pure_expr *matrix_scatter(pure_expr *x, pure_expr *is, pure_expr *ys);
+
+/* Native map, zipwith and fold operations on matrices. The elements are
+   taken in row-major order. matrix_map, matrix_zipwith and matrix_zipwith3
+   return a row vector of the results, which is numeric if the results are
+   all ints, doubles or complex values, and symbolic otherwise (zipwith
+   stops at the end of the shortest matrix). matrix_foldl1 and
+   matrix_foldr1 return NULL if the matrix is empty. */
+
+pure_expr *matrix_map(pure_expr *f, pure_expr *x);
+pure_expr *matrix_zipwith(pure_expr *f, pure_expr *x, pure_expr *y);
+pure_expr *matrix_zipwith3(pure_expr *f, pure_expr *x, pure_expr *y,
+			   pure_expr *z);
+pure_expr *matrix_foldl(pure_expr *f, pure_expr *a, pure_expr *x);
+pure_expr *matrix_foldl1(pure_expr *f, pure_expr *x);
+pure_expr *matrix_foldr(pure_expr *f, pure_expr *a, pure_expr *x);
+pure_expr *matrix_foldr1(pure_expr *f, pure_expr *x);
+
+/* Helpers for matrix comprehensions. matrix_colcatmap maps f over the list
+   xs, matrix_rangemap over the ints n..m, and both return the row vector of
+   the results, like colcat would do it. matrix_colcatmap returns NULL if xs
+   isn't a proper list, both return NULL if memory allocation fails. */
+
+pure_expr *matrix_colcatmap(pure_expr *f, pure_expr *xs);
+pure_expr *matrix_rangemap(pure_expr *f, int n, int m);
+
+/* Elementwise arithmetic and comparisons on numeric matrices. op is one of
+   0..9 for +, -, *, /, <, <=, >, >=, == and !=, one of the operands may also
+   be a scalar (int, double or complex) which is combined with each element
+   of the other operand. The operands are converted to a common element type
+   as needed. Division always yields a double or complex matrix, comparisons
+   an int matrix of truth values. Returns NULL if the operands don't have the
+   same dimensions or are of the wrong type (complex values can't be compared
+   with <, <=, >, >=). matrix_scalarp returns 1 for an int or double, 2 for
+   a complex number and 0 otherwise. matrix_neg and matrix_abs negate and
+   take the absolute value of each element, where the absolute value of a
+   complex matrix is a double matrix of the moduli. matrix_math applies a
+   math function to each element of an int or double matrix, yielding a
+   double matrix; fn is one of 0..12 for sqrt, exp, ln, log, sin, cos, tan,
+   asin, acos, atan, sinh, cosh and tanh. */
+
+int matrix_scalarp(pure_expr *x);
+pure_expr *matrix_binop(int op, pure_expr *x, pure_expr *y);
+pure_expr *matrix_neg(pure_expr *x);
+pure_expr *matrix_abs(pure_expr *x);
+pure_expr *matrix_math(int fn, pure_expr *x);
+
+/* Dense linear algebra on numeric matrices, using the GSL BLAS and linear
+   algebra routines. Int matrices are converted to double, mixed double and
+   complex operands to complex. matrix_matmul computes the matrix product,
+   matrix_dot the (unconjugated) dot product of two matrices with the same
+   number of elements; for two int matrices, these are computed directly and
+   yield an int matrix or int, with wraparound. matrix_norm computes the
+   Euclidean norm. matrix_solve returns the solution x of a*x = b for a
+   square matrix a, or NULL if a is singular. matrix_lu returns a tuple
+   (lu,p) of the packed LU decomposition of a and the row permutation p (an
+   int vector), or NULL if a is singular; matrix_qr returns a tuple (q,r)
+   (real matrices only), and matrix_chol the lower triangular Cholesky
+   factor of a (real matrices only, NULL if a isn't positive definite). All
+   routines return NULL if the dimensions don't match. */
+
+pure_expr *matrix_matmul(pure_expr *x, pure_expr *y);
+pure_expr *matrix_dot(pure_expr *x, pure_expr *y);
+pure_expr *matrix_norm(pure_expr *x);
+pure_expr *matrix_solve(pure_expr *a, pure_expr *b);
+pure_expr *matrix_lu(pure_expr *a);
+pure_expr *matrix_qr(pure_expr *a);
+pure_expr *matrix_chol(pure_expr *a);
+
+/* Reductions of numeric matrices. op is one of 0..4 for sum, product,
+   minimum, maximum and mean. If dim is 0, the entire matrix is reduced to a
+   scalar, otherwise the matrix is reduced along the columns (dim = 1,
+   yielding a row vector) or the rows (dim = 2, yielding a column
+   vector). Int sums and products are exact; if they don't fit into a
+   machine int, they yield a bigint (or a double matrix holding the rounded
+   values in the case of vectors), means always yield doubles. Doubles are
+   summed pairwise for accuracy. Returns NULL for the minimum or maximum of
+   an empty or complex matrix. */
+
+pure_expr *matrix_reduce(int op, int dim, pure_expr *x);
+
+/* Sparse matrices. sparse_from_triplets creates an n x m sparse matrix from
+   a list of (i,j,v) triples or a k x 3 int or double matrix with one triple
+   per row, where i,j are the zero-based row and column index and v is the
+   value. Values at the same position are added up, zeros are dropped. The
+   result is an int matrix if all values are ints, a double matrix
+   otherwise. sparse_from_matrix and sparse_to_matrix convert between int or
+   double matrices and the corresponding sparse matrices, sparse_triplets
+   returns the nonzero elements of a sparse matrix as a list of triples in
+   row-major order, and sparse_nnz their number. sparse_transpose transposes
+   a sparse matrix. sparse_mul multiplies a sparse matrix with a dense int
+   or double matrix (on either side), returning a dense matrix which is an
+   int matrix if both operands are int matrices, a double matrix otherwise.
+   The routines return NULL if an argument has the wrong type, an index is
+   out of bounds or the dimensions don't match. */
+
+pure_expr *sparse_from_triplets(int32_t n, int32_t m, pure_expr *xs);
+pure_expr *sparse_from_matrix(pure_expr *x);
+pure_expr *sparse_to_matrix(pure_expr *x);
+pure_expr *sparse_triplets(pure_expr *x);
+uint32_t sparse_nnz(pure_expr *x);
+pure_expr *sparse_transpose(pure_expr *x);
+pure_expr *sparse_mul(pure_expr *x, pure_expr *y);
+
+/* Parse numeric data in text form into an int or double matrix. p points to
+   n bytes of text, or to a null-terminated string if n is negative. Each
+   line gives a row of the matrix, the numbers in a row are separated by any
+   of the characters in delims, or by blanks if delims is empty. Blank lines
+   are skipped. Doubles are converted with my_strntod(), which is correctly
+   rounded and locale-independent. Returns NULL if the text contains
+   anything else than numbers (or an integer is out of range), or if the
+   rows don't all have the same length. */
+
+pure_expr *matrix_parse_int(const void *p, int64_t n, const char *delims);
+pure_expr *matrix_parse_double(const void *p, int64_t n, const char *delims);
+
 /* Compute a 32 bit hash code of a Pure expression. This makes it possible to
    use arbitary Pure values as keys in a hash table. */
 
@@ -812,6 +1021,113 @@ void pointer_put_string(void *ptr, const char *x);
 void pointer_put_pointer(void *ptr, void *x);
 void pointer_put_expr(void *ptr, pure_expr *x);
 
+/* Native hash dictionaries (see hashdict.pure). These are persistent hash
+   tries using the hash() and same() functions above on the keys. Each
+   dictionary is represented by an opaque pointer which must be freed with
+   hashdict_free() when no longer needed; the insert and delete operations
+   return a new dictionary and leave the original one intact. hashdict_get
+   returns the value stored under the given key (without counting a new
+   reference), or NULL if the key isn't in the dictionary. */
+
+void *hashdict_new(void);
+void hashdict_free(void *d);
+void *hashdict_insert(void *d, pure_expr *key, pure_expr *val);
+void *hashdict_delete(void *d, pure_expr *key);
+pure_expr *hashdict_get(void *d, pure_expr *key);
+bool hashdict_member(void *d, pure_expr *key);
+int32_t hashdict_size(void *d);
+pure_expr *hashdict_members(void *d);
+pure_expr *hashdict_keys(void *d);
+pure_expr *hashdict_vals(void *d);
+
+/* Mutable expression vectors, hash tables, priority queues and string
+   buffers (see mutable.pure). These are updated in place and count
+   references to their members, so that, unlike with pointer_put_expr(), no
+   manual memory management is needed for the stored expressions. The
+   containers themselves must be freed with vector_free(), hashtable_free(),
+   pqueue_free() and strbuf_free(), respectively. The get, set, top and pop
+   operations return NULL if the given index or key doesn't exist (or the
+   container is empty); the push and put operations return NULL if memory
+   allocation fails. As with hashdict_get, the returned expressions are not
+   counted as new references. */
+
+void *vector_new(void);
+void vector_free(void *v);
+void vector_clear(void *v);
+int32_t vector_size(void *v);
+pure_expr *vector_push(void *v, pure_expr *x);
+pure_expr *vector_pop(void *v);
+pure_expr *vector_get(void *v, int32_t i);
+pure_expr *vector_set(void *v, int32_t i, pure_expr *x);
+pure_expr *vector_list(void *v);
+
+void *hashtable_new(void);
+void hashtable_free(void *t);
+void hashtable_clear(void *t);
+int32_t hashtable_size(void *t);
+pure_expr *hashtable_put(void *t, pure_expr *key, pure_expr *val);
+pure_expr *hashtable_get(void *t, pure_expr *key);
+bool hashtable_member(void *t, pure_expr *key);
+bool hashtable_remove(void *t, pure_expr *key);
+pure_expr *hashtable_members(void *t);
+pure_expr *hashtable_keys(void *t);
+pure_expr *hashtable_vals(void *t);
+
+/* Priority queues are ordered by the '<' predicate, which is only invoked
+   for members which aren't machine ints or doubles. pqueue_push_list adds
+   all members of a list in linear time; it returns NULL if the argument
+   isn't a proper list. pqueue_list lists the members in ascending order. */
+
+void *pqueue_new(void);
+void pqueue_free(void *q);
+void pqueue_clear(void *q);
+int32_t pqueue_size(void *q);
+pure_expr *pqueue_push(void *q, pure_expr *x);
+pure_expr *pqueue_push_list(void *q, pure_expr *xs);
+pure_expr *pqueue_top(void *q);
+pure_expr *pqueue_pop(void *q);
+pure_expr *pqueue_list(void *q);
+
+/* String buffers accumulate a string in place. strbuf_add appends a string,
+   strbuf_add_char a Unicode character, and strbuf_add_expr a string or the
+   print representation of any other expression; these return false if
+   memory allocation fails. strbuf_size gives the current size in bytes.
+   strbuf_string returns the contents of the buffer as a string expression
+   and resets the buffer, so that no copy of the string needs to be made. */
+
+void *strbuf_new(void);
+void strbuf_free(void *b);
+void strbuf_clear(void *b);
+int32_t strbuf_size(void *b);
+bool strbuf_add(void *b, const char *s);
+bool strbuf_add_char(void *b, uint32_t c);
+bool strbuf_add_expr(void *b, pure_expr *x);
+pure_expr *strbuf_string(void *b);
+
+/* Native persistent vectors (see pvector.pure). Like hash dictionaries,
+   these are represented as opaque pointers which must be freed with
+   pvector_free(), and all update operations return a new vector. The set,
+   rmfirst and rmlast operations return NULL if the index is out of range or
+   the vector is empty, pvector_get returns NULL in this case. The
+   pvector_from_list and pvector_from_matrix routines return NULL if the
+   argument isn't a proper list or a matrix, respectively. pvector_matrix
+   returns the members as a symbolic row vector. */
+
+void *pvector_new(void);
+void pvector_free(void *v);
+int32_t pvector_size(void *v);
+pure_expr *pvector_get(void *v, int32_t i);
+void *pvector_set(void *v, int32_t i, pure_expr *x);
+void *pvector_append(void *v, pure_expr *x);
+void *pvector_prepend(void *v, pure_expr *x);
+void *pvector_rmfirst(void *v);
+void *pvector_rmlast(void *v);
+void *pvector_const(pure_expr *x, int32_t n);
+void *pvector_from_list(pure_expr *xs);
+void *pvector_from_matrix(pure_expr *x);
+pure_expr *pvector_list(void *v);
+pure_expr *pvector_matrix(void *v);
+
 /* Initialize a bunch of variables with useful system constants. */
 
 void pure_sys_vars(void);
@@ -884,6 +1200,62 @@ int pure_sscanf_double(const char *buf, const char *format, double *x);
 int pure_sscanf_string(const char *buf, const char *format, char *x);
 int pure_sscanf_pointer(const char *buf, const char *format, void **x);
 
+/* Buffered line readers (see readlines in system.pure). reader_new creates a
+   reader for the given file, which must be freed with reader_free when no
+   longer needed (the file itself is not closed). reader_getline returns the
+   next line (without the trailing newline or CRLF) as a Pure string, or the
+   empty list at the end of the file. It returns NULL if memory allocation or
+   the conversion to utf-8 fails. The reader reads ahead, so the file
+   shouldn't be accessed by other means while a reader is active on it. */
+
+void *reader_new(FILE *fp);
+void reader_free(void *r);
+pure_expr *reader_getline(void *r);
+
+/* Memory-mapped files (see mmap in system.pure). mmap_open maps the given
+   file into memory (privately, so that changes to the mapped data are never
+   written back to the file) and returns a handle for the mapping, or NULL if
+   the file couldn't be mapped. The handle must be freed with mmap_free().
+   mmap_size returns the size of the mapping in bytes. mmap_int_matrix,
+   mmap_double_matrix and mmap_byte_matrix return an n1 x n2 int, double or
+   byte matrix whose data is the given range of the mapping, without
+   copying; the mapping stays alive as long as the matrix (or any other
+   matrix sharing its data) exists, even if the handle is freed. The offset
+   must be a multiple of the element size. mmap_string returns a copy of the
+   given range as a string. All of these return NULL if the given range
+   isn't inside the mapping. */
+
+void *mmap_open(const char *name);
+void mmap_free(void *f);
+int64_t mmap_size(void *f);
+pure_expr *mmap_string(void *f, int64_t offs, int64_t n);
+pure_expr *mmap_int_matrix(void *f, int64_t offs, uint32_t n1, uint32_t n2);
+pure_expr *mmap_double_matrix(void *f, int64_t offs, uint32_t n1, uint32_t n2);
+pure_expr *mmap_byte_matrix(void *f, int64_t offs, uint32_t n1, uint32_t n2);
+
+/* Parse the contents of a mapping as numeric data, as with
+   matrix_parse_int() and matrix_parse_double(). */
+
+pure_expr *mmap_parse_int_matrix(void *f, const char *delims);
+pure_expr *mmap_parse_double_matrix(void *f, const char *delims);
+
+/* Binary serialization (see blob in system.pure). blob() encodes an
+   expression as a malloc'ed block of memory, which must be freed by the
+   caller, and blob_size() returns the size of such a block in bytes (0 if it
+   isn't a valid blob). unblob() decodes a blob. fblob() writes a blob to a
+   file and returns the number of bytes written (-1 if there was a write
+   error), funblob() reads it back. Shared subterms are preserved, symbols
+   are looked up by name when the blob is decoded, and pointers are encoded
+   as null pointers. blob() and fblob() return NULL or 0, respectively, if
+   the expression contains closures (other than global functions) or thunks,
+   unblob() and funblob() return NULL if the data is invalid. */
+
+void *blob(pure_expr *x);
+int64_t blob_size(const void *p);
+pure_expr *unblob(const void *p);
+int64_t fblob(FILE *fp, pure_expr *x);
+pure_expr *funblob(FILE *fp);
+
 /* glob(3) support. */
 
 #include <glob.h>
@@ -34,15 +34,18 @@ void symtable::init_builtins()
   fdiv_sym();
   div_sym();
   mod_sym();
+  index_sym();
   catch_sym();
   catmap_sym();
   rowcatmap_sym();
   colcatmap_sym();
+  colrangemap_sym();
   failed_match_sym();
   failed_cond_sym();
   signal_sym();
   segfault_sym();
   bad_matrix_sym();
+  out_of_bounds_sym();
   amp_sym();
 }
 
@@ -366,6 +369,15 @@ symbol& symtable::mod_sym()
     return sym("mod", 7, infixl);
 }
 
+symbol& symtable::index_sym()
+{
+  symbol *_sym = lookup("!");
+  if (_sym)
+    return *_sym;
+  else
+    return sym("!", 9, infixl);
+}
+
 symbol& symtable::amp_sym()
 {
   symbol *_sym = lookup("&");
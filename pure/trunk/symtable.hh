@@ -90,21 +90,27 @@ public:
   symbol& fdiv_sym();
   symbol& div_sym();
   symbol& mod_sym();
+  symbol& index_sym();
   symbol& catch_sym() { return sym("catch"); }
   symbol& catmap_sym() { return sym("catmap"); }
   symbol& rowcatmap_sym() { return sym("rowcatmap"); }
   symbol& colcatmap_sym() { return sym("colcatmap"); }
+  symbol& colrangemap_sym() { return sym("colrangemap"); }
   symbol& failed_match_sym() { return sym("failed_match"); }
   symbol& failed_cond_sym() { return sym("failed_cond"); }
   symbol& signal_sym() { return sym("signal"); }
   symbol& segfault_sym() { return sym("stack_fault"); }
   symbol& bad_matrix_sym() { return sym("bad_matrix_value"); }
+  symbol& out_of_bounds_sym() { return sym("out_of_bounds"); }
   symbol& amp_sym();
   // These aren't predefined and aren't in the prelude either, so they may be
   // undefined in which case a null pointer is returned. Pass force=true to
   // forcibly create these symbols.
   symbol* complex_rect_sym(bool force = false);
   symbol* complex_polar_sym(bool force = false);
+  // The arithmetic sequence operator. This is defined in the prelude, so we
+  // just look it up; a null pointer is returned if it isn't there.
+  symbol* range_sym() { return lookup(".."); }
 };
 
 #endif // ! SYMTABLE_HH
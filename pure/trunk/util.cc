@@ -8,10 +8,15 @@
 #include <locale.h>
 #include <iconv.h>
 #include <ctype.h>
+#include <float.h>
 #include <wctype.h>
 
 #include "config.h"
 
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#endif
+
 #ifndef _WIN32
 #ifdef HAVE_LANGINFO_CODESET
 #include <langinfo.h>
@@ -285,6 +290,46 @@ u8encode(char *t, unsigned long c)
   return t;
 }
 
+/* Determine the length of the initial segment of a string which consists of
+   (nonzero) ASCII characters only. Most strings are mostly ASCII, so the
+   utf-8 routines below use this to skip over ASCII text quickly. With SSE2
+   we check 16 bytes at a time, otherwise a machine word at a time. In either
+   case only aligned blocks are read, so that we never read across a page
+   boundary past the end of the string. */
+
+static inline size_t u8asciilen(const char *s)
+{
+  const char *t = s;
+#if defined(__SSE2__) && defined(__GNUC__)
+  while (((size_t)t & 15) && ((signed char)*t) > 0) t++;
+  if (((size_t)t & 15) == 0) {
+    const __m128i zero = _mm_setzero_si128();
+    for (;; t += 16) {
+      __m128i x = _mm_load_si128((const __m128i*)t);
+      int m = _mm_movemask_epi8(x) | _mm_movemask_epi8(_mm_cmpeq_epi8(x, zero));
+      if (m) {
+	t += __builtin_ctz(m);
+	break;
+      }
+    }
+  }
+#else
+  const size_t ones = ((size_t)-1)/0xff, highs = ones*0x80;
+  while (((size_t)t & (sizeof(size_t)-1)) && ((signed char)*t) > 0) t++;
+  if (((size_t)t & (sizeof(size_t)-1)) == 0) {
+    /* A byte in w is zero or has its high bit set iff the corresponding high
+       bit is set in (w-ones)|w (modulo false positives due to borrows, which
+       only occur above such a byte). */
+    for (;; t += sizeof(size_t)) {
+      size_t w = *(const size_t*)t;
+      if (((w-ones)|w) & highs) break;
+    }
+    while (((signed char)*t) > 0) t++;
+  }
+#endif
+  return t-s;
+}
+
 /* UTF-8 string length and position of a substring */
 
 size_t u8strlen(const char *s)
@@ -295,7 +340,12 @@ size_t u8strlen(const char *s)
   for (; *s; s++) {
     unsigned char uc = (unsigned char)*s;
     if (q == 0) {
-      if (((signed char)uc) < 0) {
+      if (uc < 0x80) {
+	/* skip a run of ASCII chars */
+	size_t k = u8asciilen(s);
+	n += k; s += k-1; p = 0;
+	continue;
+      } else {
 	switch (uc & 0xf0) {
 	case 0xc0: case 0xd0:
 	  q = 1;
@@ -337,7 +387,13 @@ size_t u8strpos(const char *s, const char *t)
   for (; s < t && *s; s++) {
     unsigned char uc = (unsigned char)*s;
     if (q == 0) {
-      if (((signed char)uc) < 0) {
+      if (uc < 0x80) {
+	/* skip a run of ASCII chars */
+	size_t k = u8asciilen(s);
+	if (k > (size_t)(t-s)) k = t-s;
+	n += k; s += k-1; p = 0;
+	continue;
+      } else {
 	switch (uc & 0xf0) {
 	case 0xc0: case 0xd0:
 	  q = 1;
@@ -381,7 +437,13 @@ u8strind(const char *s, size_t i)
   for (; *s && i > 0; s++) {
     unsigned char uc = (unsigned char)*s;
     if (q == 0) {
-      if (((signed char)uc) < 0) {
+      if (uc < 0x80) {
+	/* skip a run of ASCII chars */
+	size_t k = u8asciilen(s);
+	if (k > i) k = i;
+	i -= k; s += k-1; p = 0;
+	continue;
+      } else {
 	switch (uc & 0xf0) {
 	case 0xc0: case 0xd0:
 	  q = 1;
@@ -441,12 +503,19 @@ char *default_encoding()
 
 #define CHUNKSZ 128
 
+/* NOTE: POSIX requires that the portable character set (which includes
+   ASCII) is encoded the same in all locales, so pure ASCII strings can be
+   passed through as is if we're converting from or to the system
+   encoding. */
+
 char *
 toutf8(const char *s, const char *codeset)
 {
   iconv_t ic;
-  if (!codeset || !*codeset)
+  if (!codeset || !*codeset) {
+    if (!s[u8asciilen(s)]) return strdup(s);
     codeset = default_encoding();
+  }
   if (codeset && strcmp(codeset, "UTF-8"))
     ic = iconv_open("UTF-8", codeset);
   else
@@ -498,8 +567,10 @@ char *
 fromutf8(const char *s, char *codeset)
 {
   iconv_t ic;
-  if (!codeset || !*codeset)
+  if (!codeset || !*codeset) {
+    if (!s[u8asciilen(s)]) return strdup(s);
     codeset = default_encoding();
+  }
   if (codeset && strcmp(codeset, "UTF-8"))
     ic = iconv_open(codeset, "UTF-8");
   else
@@ -693,6 +764,13 @@ pstr(char *s1, const char *s2)
 
   *s1 = '\0';
   for (s = s1; *s2; s2 = t) {
+    /* fast path for printable ASCII chars which don't need escaping */
+    for (t = s2; *t >= ' ' && *t < 0x7f && *t != '\\' && *t != '"'; t++) ;
+    if (t > s2) {
+      memcpy(s, s2, t-s2);
+      s += t-s2; *s = 0;
+      continue;
+    }
     long c = u8decode(s2, &t);
     if (c < 0) {
       c = (unsigned char)*s2;
@@ -1095,6 +1173,123 @@ my_strtod (const char  *nptr,
   return val;
 }
 
+/*
+ * This works like my_strtod(), but reads at most n characters, so the input
+ * doesn't need to be null-terminated. Decimal numbers with at most 19
+ * significant digits, a mantissa below 2^53 and a decimal exponent of at
+ * most 22 in magnitude are converted directly. In this case both the
+ * mantissa and the power of ten are exact doubles, so a single
+ * multiplication or division gives the correctly rounded result. This
+ * covers most numeric data in practice; everything else is passed on to
+ * my_strtod().
+ */
+double
+my_strntod (const char  *nptr,
+	    size_t       n,
+	    char       **endptr)
+{
+  static const double pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+  };
+  const char *p = nptr, *end = nptr+n, *q;
+  unsigned long long m = 0;
+  int ndigits = 0, nfrac = 0, e = 0, neg = 0, eneg = 0;
+  bool fast = true;
+  char buf[64], *copy, *fail_pos;
+  double val;
+  size_t len;
+
+  while (p < end && ascii_isspace (*p))
+    p++;
+  q = p;
+  if (p < end && (*p == '+' || *p == '-'))
+    neg = *p++ == '-';
+  /* mantissa */
+  while (p < end && ascii_isdigit (*p)) {
+    if (ndigits < 19) {
+      m = 10*m + (*p - '0');
+      if (m) ndigits++;
+    } else
+      fast = false;
+    p++;
+  }
+  if (p < end && (*p == 'x' || *p == 'X'))
+    /* hex number */
+    fast = false;
+  if (p < end && *p == '.') {
+    const char *r = p++;
+    while (p < end && ascii_isdigit (*p)) {
+      if (ndigits < 19) {
+	m = 10*m + (*p - '0');
+	if (m) ndigits++;
+	nfrac++;
+      } else if (*p != '0')
+	fast = false;
+      p++;
+    }
+    if (p == r+1 && (r == q || !ascii_isdigit (r[-1])))
+      /* a lone '.' isn't a number */
+      fast = false;
+  } else if (p == q || !ascii_isdigit (p[-1]))
+    /* no digits, maybe inf, nan or garbage */
+    fast = false;
+  /* exponent */
+  if (fast && p < end && (*p == 'e' || *p == 'E')) {
+    const char *r = p+1;
+    if (r < end && (*r == '+' || *r == '-'))
+      eneg = *r++ == '-';
+    if (r < end && ascii_isdigit (*r)) {
+      while (r < end && ascii_isdigit (*r)) {
+	if (e < 10000) e = 10*e + (*r - '0');
+	r++;
+      }
+      p = r;
+    }
+  }
+  if (eneg) e = -e;
+  e -= nfrac;
+#if !defined(FLT_EVAL_METHOD) || FLT_EVAL_METHOD == 0
+  /* The above requires that double arithmetic is actually carried out in
+     double precision, otherwise we might round twice. */
+  if (fast && m <= (1ULL<<53) && e >= -22 && e <= 22) {
+    val = (double)m;
+    if (e < 0)
+      val /= pow10[-e];
+    else
+      val *= pow10[e];
+    if (neg) val = -val;
+    if (endptr) *endptr = (char*)p;
+    errno = 0;
+    return val;
+  }
+#endif
+  /* Slow path. Make a null-terminated copy of the number. We take all
+     characters which may occur in a number (including hex numbers, inf and
+     nan), my_strtod figures out where it actually ends. */
+  p = q;
+  while (p < end && (ascii_isalnum (*p) || *p == '.' || *p == '+' ||
+		     *p == '-'))
+    p++;
+  len = p-nptr;
+  copy = (len < sizeof(buf))?buf:(char*)malloc(len+1);
+  if (!copy) {
+    if (endptr) *endptr = (char*)nptr;
+    errno = ENOMEM;
+    return 0.0;
+  }
+  memcpy(copy, nptr, len);
+  copy[len] = 0;
+  val = my_strtod(copy, &fail_pos);
+  if (endptr) *endptr = (char*)nptr + (fail_pos - copy);
+  if (copy != buf) {
+    int save_errno = errno;
+    free(copy);
+    errno = save_errno;
+  }
+  return val;
+}
+
 /*
  * Converts a double to a string, using the '.' as decimal point. To format
  * the number you pass in a printf()-style format string. Allowed conversion
@@ -22,6 +22,7 @@ char *default_encoding();
    precision floating point numbers and strings. */
 
 double my_strtod(const char  *nptr, char **endptr);
+double my_strntod(const char  *nptr, size_t n, char **endptr);
 char *my_formatd(char *buffer, const char  *format, double d);
 
 /* utf-8 string helpers. */